@@ -2,8 +2,14 @@
 #include "Log.h"
 #include "Network.h"
 #include "CSLocker.h"
+#include "RecvBufferPool.h"
+#include "Packet.h"
+#include "TlsSession.h"
 
 #include <boost/array.hpp>
+#include <cstring>
+#include <new>
+#include <algorithm>
 
 #pragma warning(disable:4996) //4996: 'std::copy': Function call with parameters that may be unsafe - this call relies on the caller to check that the passed values are correct. To disable this warning, use -D_SCL_SECURE_NO_WARNINGS. See documentation on how to use Visual C++ 'Checked Iterators'
 
@@ -12,76 +18,306 @@ namespace
 	static int kCount = 0;
 }
 
-/*static*/ std::vector<Client*> Client::sClients;
-/* static */ Client::PoolType Client::sPool;
+/* static */ std::vector<Client*> Client::sClients;
+/* static */ Client::FreeClientMap Client::sFreeClients;
+/* static */ std::vector<int> Client::sWarmFamilies;
+/* static */ std::vector<Client*> Client::sRecycledClients;
+/* static */ FreeListPool Client::sPool(sizeof(Client));
 /* static */ CRITICAL_SECTION Client::sPoolCS;
+/* static */ size_t Client::sWarmClients = 0;
+/* static */ TP_WORK* Client::sRefillTPWORK = NULL;
+/* static */ volatile long Client::sRefilling = 0;
 
 
-/* static */ void Client::Init()
+/* static */ void Client::Init(int warmClients)
 {
 	InitializeCriticalSection(&sPoolCS);
+	sPool.Init();
+
+	sWarmClients = warmClients;
+	sRefillTPWORK = CreateThreadpoolWork(Client::WorkerRefill, NULL, NULL);
+	if(sRefillTPWORK == NULL)
+	{
+		ERROR_CODE(GetLastError(), "Could not create client refill work. The pool is refilled on demand.");
+	}
+}
+
+/* static */ void Client::KeepWarm(int family)
+{
+	{
+		CSLocker lock(&sPoolCS);
+		if(std::find(sWarmFamilies.begin(), sWarmFamilies.end(), family) != sWarmFamilies.end())
+		{
+			return;
+		}
+		sWarmFamilies.push_back(family);
+	}
+
+	// The first batch is created right here so that the first accepts find their sockets ready.
+	RefillPool();
 }
 
 /* static */ void Client::Shutdown()
 {
+	if(sRefillTPWORK != NULL)
+	{
+		WaitForThreadpoolWorkCallbacks(sRefillTPWORK, false);
+		CloseThreadpoolWork(sRefillTPWORK);
+		sRefillTPWORK = NULL;
+	}
+
 	EnterCriticalSection(&sPoolCS);
 	{
-		for (int i = 0 ; i < sClients.size() ; ++i)
+		for (size_t i = 0 ; i < sClients.size() ; ++i)
 		{
-			sPool.destroy(sClients[i]);
+			sClients[i]->~Client();
+			sPool.Free(sClients[i]);
 		}
 		sClients.clear();
+		sFreeClients.clear();
+		sRecycledClients.clear();
+		sWarmFamilies.clear();
 	}
+	LeaveCriticalSection(&sPoolCS);
 	DeleteCriticalSection(&sPoolCS);
+
+	sPool.Shutdown();
 }
 
 
-/* static */ Client* Client::Create()
+/* static */ Client* Client::Create(int family)
 {
-	CSLocker lock(&sPoolCS);
-	Client* client = sPool.construct();
-	sClients.push_back(client);
+	Client* client = NULL;
+	bool refill = false;
+	{
+		CSLocker lock(&sPoolCS);
+		ClientList& freeClients = sFreeClients[family];
+		if(!freeClients.empty())
+		{
+			client = freeClients.back();
+			freeClients.pop_back();
+		}
+		else if(!sRecycledClients.empty())
+		{
+			client = sRecycledClients.back();
+			sRecycledClients.pop_back();
+		}
+		else
+		{
+			client = Construct();
+		}
+
+		refill = freeClients.size() < sWarmClients / 2 && std::find(sWarmFamilies.begin(), sWarmFamilies.end(), family) != sWarmFamilies.end();
+	}
+
+	if(client == NULL)
+	{
+		ERROR_MSG("Could not allocate a client.");
+		return NULL;
+	}
 
-	if (client->CreateSocket())
+	if(refill && sRefillTPWORK != NULL && InterlockedExchange(&sRefilling, 1) == 0)
 	{
-		return client;
+		SubmitThreadpoolWork(sRefillTPWORK);
 	}
-	else
+
+	// The pool has run dry or the family is not kept warm, so this one pays for its socket.
+	if(client->m_Socket == INVALID_SOCKET && !client->CreateSocket(family))
 	{
-		sPool.destroy(client);
+		Destroy(client);
 		return NULL;
 	}
+
+	return client;
 }
 
 
 /* static */ void Client::Destroy(Client* client)
 {
+	client->Reset();
+
 	CSLocker lock(&sPoolCS);
-	sClients.erase(std::remove(sClients.begin(), sClients.end(), client));
-	sPool.destroy(client);
+	if(CountFree() + sRecycledClients.size() < sWarmClients * (sWarmFamilies.size() + 1))
+	{
+		sRecycledClients.push_back(client);
+		return;
+	}
+
+	// The pool is full. Move the last one into the slot of this one, so that removal does not scan the list.
+	Client* last = sClients.back();
+	last->m_PoolIndex = client->m_PoolIndex;
+	sClients[client->m_PoolIndex] = last;
+	sClients.pop_back();
+
+	client->~Client();
+	sPool.Free(client);
+}
+
+
+/* static */ long Client::GetNumClients()
+{
+	CSLocker lock(&sPoolCS);
+	return static_cast<long>(sClients.size());
+}
+
+
+/* static */ long Client::GetNumFree()
+{
+	CSLocker lock(&sPoolCS);
+	return static_cast<long>(CountFree());
+}
+
+
+/* static */ size_t Client::CountFree()
+{
+	size_t count = 0;
+	for(FreeClientMap::iterator itor = sFreeClients.begin() ; itor != sFreeClients.end() ; ++itor)
+	{
+		count += itor->second.size();
+	}
+	return count;
+}
+
+
+/* static */ Client* Client::Construct()
+{
+	void* memory = sPool.Alloc();
+	if(memory == NULL)
+	{
+		return NULL;
+	}
+
+	Client* client = new(memory) Client;
+	client->m_PoolIndex = sClients.size();
+	sClients.push_back(client);
+	return client;
 }
 
+
+/* static */ void Client::RefillPool()
+{
+	for(;;)
+	{
+		int family = AF_UNSPEC;
+		Client* client = NULL;
+		{
+			CSLocker lock(&sPoolCS);
+
+			// The families are filled one after another.
+			for(size_t i = 0 ; i < sWarmFamilies.size() && family == AF_UNSPEC ; ++i)
+			{
+				if(sFreeClients[sWarmFamilies[i]].size() < sWarmClients)
+				{
+					family = sWarmFamilies[i];
+				}
+			}
+
+			if(family == AF_UNSPEC)
+			{
+				break;
+			}
+
+			if(!sRecycledClients.empty())
+			{
+				client = sRecycledClients.back();
+				sRecycledClients.pop_back();
+			}
+			else
+			{
+				client = Construct();
+			}
+
+			if(client == NULL)
+			{
+				break;
+			}
+		}
+
+		// The socket is created without the lock, since nobody else can see this client now.
+		bool created = client->CreateSocket(family);
+
+		CSLocker lock(&sPoolCS);
+		if(!created)
+		{
+			sRecycledClients.push_back(client);
+			break;
+		}
+		sFreeClients[family].push_back(client);
+	}
+}
+
+
+/* static */ void CALLBACK Client::WorkerRefill(PTP_CALLBACK_INSTANCE /* Instance */, PVOID /* Context */, PTP_WORK /* Work */)
+{
+	RefillPool();
+
+	InterlockedExchange(&sRefilling, 0);
+}
+
+
 Client::Client(void)
 : m_pTPIO(NULL)
 , m_State(WAIT)
 , m_Socket(INVALID_SOCKET)
-, m_RecvBuffer(MAX_DATA_SIZE)
+, m_Family(AF_INET)
+, m_Listener(0)
+, m_Shard(0)
+, m_ServiceShard(SERVICE_SHARD_NONE)
+, m_Upstream(false)
+, m_Tls(NULL)
+, m_RefCount(1)
+, m_Closed(0)
+, m_RecvCallBuffer(NULL)
+, m_ReleaseIdleRecvBuffer(false)
+, m_RecvBacklogLimit(0)
+, m_RecvPaused(false)
+, m_RecvStuckReported(false)
+, m_MessageReceived(false)
+, m_DatagramToken(0)
+, m_DatagramAddressLength(0)
+, m_DatagramBound(false)
+, m_SendingSize(0)
+, m_Sending(false)
+, m_ZeroCopySend(false)
+, m_DefaultSendBufferSize(-1)
+, m_PendingSendBytes(0)
+, m_SendHighWatermark(0)
+, m_SendLowWatermark(0)
+, m_SendBlocked(false)
+, m_SendBlockedTick(0)
+, m_SendStallReported(false)
+, m_Timeout(TIMEOUT_NONE)
+, m_TimerWheel(0)
+, m_TimeoutData(NULL)
+, m_PoolIndex(0)
 {
 	InitializeCriticalSection(&m_RecvBufferCS);
+	InitializeCriticalSection(&m_SendCS);
 }
 
 Client::~Client(void)
 {
-	EnterCriticalSection(&m_RecvBufferCS);
+	Reset();
 
-	if( m_Socket != INVALID_SOCKET )
+	DeleteCriticalSection(&m_SendCS);
+	DeleteCriticalSection(&m_RecvBufferCS);
+}
+
+
+void Client::Reset()
+{
 	{
-		Network::CloseSocket(m_Socket);
-		CancelIoEx(reinterpret_cast<HANDLE>(m_Socket), NULL);
-		m_Socket = INVALID_SOCKET;
-		m_State = DISCONNECTED;
+		CSLocker lock(&m_RecvBufferCS);
+
+		if( m_Socket != INVALID_SOCKET )
+		{
+			Network::CloseSocket(m_Socket);
+			CancelIoEx(reinterpret_cast<HANDLE>(m_Socket), NULL);
+			m_Socket = INVALID_SOCKET;
+		}
 	}
 
+	// Not under the lock, since the callbacks may still be waiting for it.
 	if( m_pTPIO != NULL )
 	{
 		WaitForThreadpoolIoCallbacks(m_pTPIO, true);
@@ -89,13 +325,85 @@ Client::~Client(void)
 		m_pTPIO = NULL;
 	}
 
-	DeleteCriticalSection(&m_RecvBufferCS);
+	{
+		CSLocker lock(&m_RecvBufferCS);
+
+		if( m_RecvCallBuffer != NULL )
+		{
+			RecvBufferPool::Destroy(m_RecvCallBuffer);
+			m_RecvCallBuffer = NULL;
+		}
+
+		// The memory of the ring buffer is kept for the next connection.
+		m_RecvBuffer.clear();
+		m_ReleaseIdleRecvBuffer = false;
+		m_RecvBacklogLimit = 0;
+		m_RecvPaused = false;
+		m_RecvStuckReported = false;
+		m_MessageReceived = false;
+
+		m_DatagramToken = 0;
+		m_DatagramBound = false;
+		while (!m_Datagrams.empty())
+		{
+			m_Datagrams.pop();
+		}
+	}
+
+	{
+		CSLocker lock(&m_SendCS);
+
+		for (size_t i = 0 ; i < m_SendingPackets.size() ; ++i)
+		{
+			Packet::Destroy(m_SendingPackets[i]);
+		}
+		m_SendingPackets.clear();
+
+		while (!m_SendQueue.empty())
+		{
+			Packet::Destroy(m_SendQueue.front());
+			m_SendQueue.pop();
+		}
+
+		m_SendingSize = 0;
+		m_Sending = false;
+		m_ZeroCopySend = false;
+		m_DefaultSendBufferSize = -1;
+		m_PendingSendBytes = 0;
+		m_SendHighWatermark = 0;
+		m_SendLowWatermark = 0;
+		m_SendBlocked = false;
+		m_SendBlockedTick = 0;
+		m_SendStallReported = false;
+	}
+
+	if( m_Tls != NULL )
+	{
+		TlsSession::Destroy(m_Tls);
+		m_Tls = NULL;
+	}
+
+	// Server cancels the timer before the client is destroyed.
+	assert(!m_Timer.IsArmed());
+	m_Timer.context = NULL;
+	m_Timeout = TIMEOUT_NONE;
+	m_TimerWheel = 0;
+	m_TimeoutData = NULL;
+
+	m_State = WAIT;
+	m_Listener = 0;
+	m_Shard = 0;
+	m_ServiceShard = SERVICE_SHARD_NONE;
+	m_Upstream = false;
+	m_RefCount = 1;
+	m_Closed = 0;
 }
 
 
-bool Client::CreateSocket()
+bool Client::CreateSocket(int family)
 {
-	m_Socket = Network::CreateSocket(false, 0);
+	m_Family = family;
+	m_Socket = Network::CreateOverlappedSocket(family);
 	if(m_Socket == INVALID_SOCKET)
 	{
 		ERROR_MSG("Could not create socket.");	
@@ -105,7 +413,35 @@ bool Client::CreateSocket()
 }
 
 
-void Client::OnRecvComplete(int size)
+bool Client::BindServiceShard(long shard)
+{
+	long previous = InterlockedCompareExchange(&m_ServiceShard, shard, SERVICE_SHARD_NONE);
+	return previous == SERVICE_SHARD_NONE || previous == shard;
+}
+
+
+bool Client::Close()
+{
+	if(InterlockedExchange(&m_Closed, 1) != 0)
+	{
+		return false;
+	}
+
+	CSLocker lock(&m_RecvBufferCS);
+
+	if( m_Socket != INVALID_SOCKET )
+	{
+		Network::CloseSocket(m_Socket);
+		CancelIoEx(reinterpret_cast<HANDLE>(m_Socket), NULL);
+		m_Socket = INVALID_SOCKET;
+	}
+	m_State = DISCONNECTED;
+
+	return true;
+}
+
+
+bool Client::OnRecvComplete(const BYTE* data, int size)
 {
 	CSLocker lock(&m_RecvBufferCS);
 
@@ -116,7 +452,67 @@ void Client::OnRecvComplete(int size)
 	}
 	assert(m_RecvBuffer.capacity() - m_RecvBuffer.size() >= static_cast<size_t>(size));
 
-	m_RecvBuffer.insert(m_RecvBuffer.end(), m_RecvCallBuffer, m_RecvCallBuffer + size);
+	m_RecvBuffer.insert(m_RecvBuffer.end(), data, data + size);
+
+	if (!m_MessageReceived && memchr(data, '\0', size) != NULL)
+	{
+		m_MessageReceived = true;
+	}
+
+	// Stop reading and let TCP flow control push back on the sender until the services catch up.
+	if (m_RecvBacklogLimit > 0 && m_RecvBuffer.size() >= m_RecvBacklogLimit)
+	{
+		LOG("Client(%p) reached the receive backlog limit. backlog[%d]", this, m_RecvBuffer.size());
+
+		m_RecvPaused = true;
+		return false;
+	}
+
+	return true;
+}
+
+
+bool Client::HasPartialMessage()
+{
+	CSLocker lock(&m_RecvBufferCS);
+
+	// Messages end with '\0', so anything after the last one is an unfinished message.
+	return !m_RecvBuffer.empty() && m_RecvBuffer.back() != '\0';
+}
+
+
+bool Client::CheckRecvResume()
+{
+	CSLocker lock(&m_RecvBufferCS);
+
+	if (!m_RecvPaused || m_RecvBuffer.size() > m_RecvBacklogLimit / 2)
+	{
+		return false;
+	}
+
+	LOG("Client(%p) drained its receive backlog. backlog[%d]", this, m_RecvBuffer.size());
+
+	m_RecvPaused = false;
+	return true;
+}
+
+
+bool Client::CheckRecvStuck()
+{
+	CSLocker lock(&m_RecvBufferCS);
+
+	if (!m_RecvPaused || m_RecvStuckReported)
+	{
+		return false;
+	}
+
+	if (std::find(m_RecvBuffer.begin(), m_RecvBuffer.end(), '\0') != m_RecvBuffer.end())
+	{
+		return false;
+	}
+
+	m_RecvStuckReported = true;
+	return true;
 }
 
 
@@ -137,6 +533,11 @@ bool Client::PopRecvData(rapidjson::Document& jsonData)
 
 		m_RecvBuffer.erase(m_RecvBuffer.begin(), itorEnd);
 
+		if (m_ReleaseIdleRecvBuffer && m_RecvBuffer.empty())
+		{
+			m_RecvBuffer.set_capacity(0);
+		}
+
 		jsonData.Parse<0>(jsonStr.data());
 
 		if (jsonData.HasParseError())
@@ -156,3 +557,200 @@ bool Client::PopRecvData(rapidjson::Document& jsonData)
 
 	return false;
 }
+
+
+void Client::SetDatagramAddress(const sockaddr_storage& address, int addressLength)
+{
+	CSLocker lock(&m_RecvBufferCS);
+
+	m_DatagramAddress = address;
+	m_DatagramAddressLength = addressLength;
+	m_DatagramBound = true;
+}
+
+
+bool Client::GetDatagramAddress(sockaddr_storage& outAddress, int& outAddressLength)
+{
+	CSLocker lock(&m_RecvBufferCS);
+
+	if (!m_DatagramBound)
+	{
+		return false;
+	}
+
+	outAddress = m_DatagramAddress;
+	outAddressLength = m_DatagramAddressLength;
+	return true;
+}
+
+
+bool Client::PushDatagram(const BYTE* data, int size)
+{
+	CSLocker lock(&m_RecvBufferCS);
+
+	// Datagrams are unreliable anyway. Dropping is better than letting a flooding peer grow the queue.
+	if (m_Datagrams.size() >= MAX_DATAGRAMS)
+	{
+		return false;
+	}
+
+	m_Datagrams.push(std::string(reinterpret_cast<const char*>(data), size));
+	return true;
+}
+
+
+bool Client::PopDatagram(rapidjson::Document& outData)
+{
+	std::string datagram;
+	{
+		CSLocker lock(&m_RecvBufferCS);
+
+		if (m_Datagrams.empty())
+		{
+			return false;
+		}
+
+		datagram.swap(m_Datagrams.front());
+		m_Datagrams.pop();
+	}
+
+	// Each datagram holds exactly one null-terminated message, which has been checked on reception.
+	outData.Parse<0>(datagram.c_str());
+	if (outData.HasParseError())
+	{
+		LOG("Client::PopDatagram - parsing failed. %s error[%s]", datagram.c_str(), outData.GetParseError());
+		return false;
+	}
+
+	return true;
+}
+
+
+bool Client::PushSendPacket(Packet* packet)
+{
+	CSLocker lock(&m_SendCS);
+
+	m_SendQueue.push(packet);
+
+	m_PendingSendBytes += packet->GetSize();
+	if (m_SendHighWatermark > 0 && !m_SendBlocked && m_PendingSendBytes >= m_SendHighWatermark)
+	{
+		LOG("Client(%p) reached the send high watermark. pending[%d]", this, m_PendingSendBytes);
+
+		m_SendBlocked = true;
+		m_SendBlockedTick = GetTickCount64();
+	}
+
+	if (m_Sending)
+	{
+		return false;
+	}
+
+	m_Sending = true;
+	return true;
+}
+
+
+DWORD Client::BeginSend(WSABUF* buffers, DWORD maxBuffers, DWORD zeroCopyThreshold, bool& outZeroCopy)
+{
+	CSLocker lock(&m_SendCS);
+
+	assert(m_Sending);
+	assert(m_SendingPackets.empty());
+	assert(maxBuffers >= Packet::MAX_SEGMENTS);
+
+	DWORD count = 0;
+	m_SendingSize = 0;
+	outZeroCopy = false;
+
+	while (!m_SendQueue.empty() && count < maxBuffers)
+	{
+		Packet* packet = m_SendQueue.front();
+
+		// Large and small packets never go in the same send as they need different socket send buffer settings.
+		bool large = zeroCopyThreshold > 0 && packet->GetSize() >= zeroCopyThreshold;
+		if (count == 0)
+		{
+			outZeroCopy = large;
+		}
+		else if (large != outZeroCopy)
+		{
+			break;
+		}
+
+		// A chained packet goes in one send as a whole, a buffer per segment.
+		if (count + packet->GetNumSegments() > maxBuffers)
+		{
+			break;
+		}
+
+		m_SendQueue.pop();
+
+		for (Packet* segment = packet ; segment != NULL ; segment = segment->GetNext())
+		{
+			buffers[count].buf = reinterpret_cast<char*>(segment->GetSegmentData());
+			buffers[count].len = segment->GetSegmentSize();
+			++count;
+		}
+
+		m_SendingSize += packet->GetSize();
+		m_SendingPackets.push_back(packet);
+	}
+
+	if (count == 0)
+	{
+		m_Sending = false;
+	}
+
+	return count;
+}
+
+
+bool Client::EndSend()
+{
+	CSLocker lock(&m_SendCS);
+
+	for (size_t i = 0 ; i < m_SendingPackets.size() ; ++i)
+	{
+		Packet::Destroy(m_SendingPackets[i]);
+	}
+	m_SendingPackets.clear();
+
+	m_PendingSendBytes -= m_SendingSize;
+	m_SendingSize = 0;
+
+	if (m_SendBlocked && m_PendingSendBytes <= m_SendLowWatermark)
+	{
+		LOG("Client(%p) drained to the send low watermark. pending[%d]", this, m_PendingSendBytes);
+
+		m_SendBlocked = false;
+		m_SendStallReported = false;
+	}
+
+	if (m_SendQueue.empty())
+	{
+		m_Sending = false;
+		return false;
+	}
+
+	return true;
+}
+
+
+bool Client::CheckSendStalled(ULONGLONG now, DWORD graceMs)
+{
+	CSLocker lock(&m_SendCS);
+
+	if (!m_SendBlocked || m_SendStallReported)
+	{
+		return false;
+	}
+
+	if (now - m_SendBlockedTick < graceMs)
+	{
+		return false;
+	}
+
+	m_SendStallReported = true;
+	return true;
+}
@@ -1,33 +1,57 @@
 #pragma once
 
 #include <winsock2.h>
-#include <boost/pool/object_pool.hpp>
 #include <boost/circular_buffer.hpp>
 #include <rapidjson/document.h>
 #include <queue>
+#include <string>
+#include <map>
+#include "TimerWheel.h"
+#include "FreeListPool.h"
 
+class Packet;
+class TlsSession;
 class Client
 {
 public:
 	enum
 	{
 		MAX_DATA_SIZE = 256,
+		MAX_DATAGRAMS = 64,	// datagrams waiting to be parsed. more are dropped.
 	};
 
 	enum State
 	{
 		WAIT,
-		ACCEPTED,
+		ACCEPTED,	// connected. also for upstream connections.
 		DISCONNECTED,
 	};
 
+	// What the armed timer of the client is waiting for.
+	enum Timeout
+	{
+		TIMEOUT_NONE,
+		TIMEOUT_ACCEPT,				// a connection on a pending AcceptEx() which has not sent anything.
+		TIMEOUT_FIRST_MESSAGE,		// accepted but no complete message yet.
+		TIMEOUT_PARTIAL_MESSAGE,	// a message has been started but not finished.
+		TIMEOUT_IDLE,				// nothing received.
+	};
+
 public:
-	static void Init();
+	// warmClients clients of each family given to KeepWarm() are kept with their sockets ready, refilled in the background
+	// as accepts take them. Destroyed clients are recycled with their critical sections and buffer memory.
+	static void Init(int warmClients = 0);
 	static void Shutdown();
+	// Keeps clients with sockets of the family ready from now on. Server calls it with the family of each listener.
+	static void KeepWarm(int family);
 
-	static Client* Create();
+	// Families which are not kept warm get a new socket.
+	static Client* Create(int family = AF_INET);
 	static void Destroy(Client* client);
 
+	static long GetNumClients();
+	static long GetNumFree();
+
 public:
 	void SetTPIO(TP_IO* pTPIO) { m_pTPIO = pTPIO; }
 	TP_IO* GetTPIO() { return m_pTPIO; }
@@ -37,11 +61,110 @@ public:
 
 	SOCKET GetSocket() { return m_Socket; }
 
+	// Index of the Server listener which accepted this client.
+	void SetListener(int listener) { m_Listener = listener; }
+	int GetListener() { return m_Listener; }
+
+	void SetShard(int shard) { m_Shard = shard; }
+	int GetShard() { return m_Shard; }
+
+	// Shared-nothing mode. The shard whose games the client plays in, which may not be its own. Set by its first match for good.
+	enum
+	{
+		SERVICE_SHARD_NONE = -1,
+		SERVICE_SHARD_REMOVED = -2,	// the client has left. no shard may take it in any more.
+	};
+	long GetServiceShard() { return m_ServiceShard; }
+	// Fails if the client has left or plays on another shard.
+	bool BindServiceShard(long shard);
+	// Returns the shard the client played in, if any.
+	long UnbindServiceShard() { return InterlockedExchange(&m_ServiceShard, SERVICE_SHARD_REMOVED); }
+
+	// An outbound connection owned by UpstreamPool rather than a client of our services.
+	void SetUpstream(bool upstream) { m_Upstream = upstream; }
+	bool IsUpstream() { return m_Upstream; }
+
+	// NULL unless the listener has TLS. The client owns the session.
+	void SetTls(TlsSession* tls) { m_Tls = tls; }
+	TlsSession* GetTls() { return m_Tls; }
+
+	// Every pending I/O and every removal request holds a reference, so that a client is recycled only once nothing uses it.
+	// A new client starts with one reference owned by Server.
+	long AddRef() { return InterlockedIncrement(&m_RefCount); }
+	long Release() { return InterlockedDecrement(&m_RefCount); }
+
+	// Closes the socket so that all pending I/O complete. Returns false if it has been already closed.
+	bool Close();
+
 	// recv
+	// The call buffer is borrowed from RecvBufferPool. It is kept while connected with Server::RECV_PER_CLIENT only.
+	void SetRecvCallBuff(BYTE* buffer) { m_RecvCallBuffer = buffer; }
 	BYTE* GetRecvCallBuff() { return m_RecvCallBuffer; }
-	void OnRecvComplete(int size);
+	// Returns false if the unparsed data reached the backlog limit. Receiving has to pause until CheckRecvResume() returns true.
+	bool OnRecvComplete(const BYTE* data, int size);
 	bool PopRecvData(rapidjson::Document& outData);
 
+	// Receive backpressure. A limit of 0 disables it.
+	void SetRecvBacklogLimit(size_t limit) { m_RecvBacklogLimit = limit; }
+	bool IsRecvPaused() { return m_RecvPaused; }
+	// Returns true once if receiving was paused and the backlog has drained below half the limit.
+	bool CheckRecvResume();
+	// Returns true once if receiving is paused but the backlog holds no complete message, which can never drain.
+	bool CheckRecvStuck();
+
+	// Whether a complete message has ever been received, and whether received data end in the middle of a message.
+	bool HasReceivedMessage() { return m_MessageReceived; }
+	bool HasPartialMessage();
+
+	// Frees the ring buffer memory whenever all received data have been parsed.
+	void SetReleaseIdleRecvBuffer(bool release) { m_ReleaseIdleRecvBuffer = release; }
+
+	// datagram
+	// The token binds datagrams to this client. 0 means the client has no datagram session.
+	void SetDatagramToken(DWORD token) { m_DatagramToken = token; }
+	DWORD GetDatagramToken() { return m_DatagramToken; }
+	// The address the last datagram came from, which replies go to. It may change with NAT rebinding.
+	void SetDatagramAddress(const sockaddr_storage& address, int addressLength);
+	bool GetDatagramAddress(sockaddr_storage& outAddress, int& outAddressLength);
+	// Returns false if the datagram has been dropped because too many are waiting.
+	bool PushDatagram(const BYTE* data, int size);
+	bool PopDatagram(rapidjson::Document& outData);
+
+	// send
+	// At most one send is in flight. Packets queued meanwhile go out together in the next send.
+	// Returns true if no send is in flight, so the caller has to start one with BeginSend().
+	bool PushSendPacket(Packet* packet);
+	// Moves queued packets into the in-flight list and fills their buffers. Returns the number of buffers filled.
+	// With zeroCopyThreshold > 0, packets of at least that size are never gathered with smaller ones,
+	// and outZeroCopy tells whether this send consists of such large packets.
+	DWORD BeginSend(WSABUF* buffers, DWORD maxBuffers, DWORD zeroCopyThreshold, bool& outZeroCopy);
+	// Destroys the in-flight packets. Returns true if more packets have been queued, so the caller has to call BeginSend() again.
+	bool EndSend();
+	DWORD GetSendingSize() { return m_SendingSize; }
+
+	// Outbound byte accounting. Sending is blocked once the bytes queued or in flight reach the high watermark,
+	// until they drain down to the low watermark. A high watermark of 0 disables it.
+	void SetSendWatermarks(DWORD high, DWORD low) { m_SendHighWatermark = high; m_SendLowWatermark = low; }
+	DWORD GetPendingSendBytes() { return m_PendingSendBytes; }
+	bool IsSendBlocked() { return m_SendBlocked; }
+	// Returns true once if sending has been blocked for longer than graceMs.
+	bool CheckSendStalled(ULONGLONG now, DWORD graceMs);
+
+	// timeout
+	// Managed by Server under the lock of the timer wheel the timer is armed on.
+	TimerWheel::Timer& GetTimer() { return m_Timer; }
+	// data is the OVERLAPPED of the pending AcceptEx() with TIMEOUT_ACCEPT.
+	void SetTimeout(Timeout timeout, int wheel, void* data = NULL) { m_Timeout = timeout; m_TimerWheel = wheel; m_TimeoutData = data; }
+	Timeout GetTimeout() { return m_Timeout; }
+	int GetTimerWheel() { return m_TimerWheel; }
+	void* GetTimeoutData() { return m_TimeoutData; }
+
+	// Whether the socket send buffer is turned off, so that sends go directly from our packets.
+	bool IsZeroCopySend() { return m_ZeroCopySend; }
+	void SetZeroCopySend(bool zeroCopy) { m_ZeroCopySend = zeroCopy; }
+	int GetDefaultSendBufferSize() { return m_DefaultSendBufferSize; }
+	void SetDefaultSendBufferSize(int size) { m_DefaultSendBufferSize = size; }
+
 private:
 	Client(void);
 	~Client(void);
@@ -49,23 +172,81 @@ private:
 	Client(const Client& rhs);
 
 private:
-	bool CreateSocket();
+	// Back to the state of a new client without a socket.
+	void Reset();
+	bool CreateSocket(int family = AF_INET);
+
+	static Client* Construct();
+	static size_t CountFree();
+	static void RefillPool();
+	static void CALLBACK WorkerRefill(PTP_CALLBACK_INSTANCE /* Instance */, PVOID /* Context */, PTP_WORK /* Work */);
 
 private:
 	TP_IO* m_pTPIO;
 	State m_State;
 	SOCKET m_Socket;
-	BYTE m_RecvCallBuffer[MAX_DATA_SIZE];
+	int m_Family;
+	int m_Listener;
+	int m_Shard;
+	volatile long m_ServiceShard;
+	bool m_Upstream;
+	TlsSession* m_Tls;
+	volatile long m_RefCount;
+	volatile long m_Closed;
+	BYTE* m_RecvCallBuffer;
 
 	typedef boost::circular_buffer<char> RingBuffer;
 	RingBuffer m_RecvBuffer;
+	bool m_ReleaseIdleRecvBuffer;
+	size_t m_RecvBacklogLimit;
+	volatile bool m_RecvPaused;
+	bool m_RecvStuckReported;
+	bool m_MessageReceived;
 	CRITICAL_SECTION m_RecvBufferCS;
 
-	typedef boost::object_pool<Client> PoolType; 
-	friend PoolType;
-	static PoolType sPool;
+	typedef std::queue<std::string> DatagramQueue;
+	DWORD m_DatagramToken;
+	sockaddr_storage m_DatagramAddress;	// of the family of the datagram sockets.
+	int m_DatagramAddressLength;
+	bool m_DatagramBound;
+	DatagramQueue m_Datagrams;	// guarded by m_RecvBufferCS as well.
+
+	typedef std::queue<Packet*> PacketQueue;
+	typedef std::vector<Packet*> PacketList;
+	PacketQueue m_SendQueue;
+	PacketList m_SendingPackets;
+	DWORD m_SendingSize;
+	bool m_Sending;
+	bool m_ZeroCopySend;
+	int m_DefaultSendBufferSize;
+
+	DWORD m_PendingSendBytes;
+	DWORD m_SendHighWatermark;
+	DWORD m_SendLowWatermark;
+	volatile bool m_SendBlocked;
+	ULONGLONG m_SendBlockedTick;
+	bool m_SendStallReported;
+	CRITICAL_SECTION m_SendCS;
+
+	TimerWheel::Timer m_Timer;
+	Timeout m_Timeout;
+	int m_TimerWheel;
+	void* m_TimeoutData;
+
+	size_t m_PoolIndex;
+
+	// Memory of the clients. The lists below are about their sockets, so they keep their own lock.
+	static FreeListPool sPool;
 	static CRITICAL_SECTION sPoolCS;
 
 private:
-	static std::vector<Client*> sClients;
+	static std::vector<Client*> sClients;			// every client constructed. m_PoolIndex is the position.
+	typedef std::vector<Client*> ClientList;
+	typedef std::map<int, ClientList> FreeClientMap;
+	static FreeClientMap sFreeClients;				// ready to accept with a socket, by address family.
+	static std::vector<int> sWarmFamilies;
+	static ClientList sRecycledClients;				// waiting for a socket.
+	static size_t sWarmClients;
+	static TP_WORK* sRefillTPWORK;
+	static volatile long sRefilling;
 };
@@ -28,6 +28,13 @@
 	std::string type(data["type"].GetString());
 	if (type == "echo")
 	{
+		// Echoes are not worth queueing behind a client which is not reading.
+		if (client->IsSendBlocked())
+		{
+			Server::Instance()->CountBlockedSend(true);
+			return;
+		}
+
 		rapidjson::StringBuffer buffer;
 		rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
 		data.Accept(writer);
@@ -36,4 +43,15 @@
 
 		Server::Instance()->PostSend(client, packet);
 	}
+	else if (type == "echo_datagram")
+	{
+		// Answered over the datagram session whichever way it came, so that UDP can be measured on its own.
+		rapidjson::StringBuffer buffer;
+		rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+		data.Accept(writer);
+
+		Packet* packet = Packet::Create(client, (const BYTE*)buffer.GetString(), buffer.Size()+1);
+
+		Server::Instance()->SendDatagram(client, packet);
+	}
 }
@@ -0,0 +1,281 @@
+#include "FreeListPool.h"
+#include "CSLocker.h"
+#include "Log.h"
+
+#include <cassert>
+
+
+namespace
+{
+	// In front of every block, so that a free knows the node without asking the block's owner.
+	const size_t HEADER_SIZE = MEMORY_ALLOCATION_ALIGNMENT;
+
+	size_t AlignUp(size_t size)
+	{
+		return (size + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~static_cast<size_t>(MEMORY_ALLOCATION_ALIGNMENT - 1);
+	}
+}
+
+
+FreeListPool::FreeListPool(size_t blockSize, int batchSize)
+: m_BlockStride(HEADER_SIZE + AlignUp(blockSize > sizeof(FreeBlock) ? blockSize : sizeof(FreeBlock))),
+  m_BatchSize(batchSize < 1 ? 1 : (batchSize > BATCH_SIZE ? BATCH_SIZE : batchSize)),
+  m_CacheSize(m_BatchSize * 2),
+  m_SlabSize(m_BatchSize),
+  m_FlsIndex(FLS_OUT_OF_INDEXES),
+  m_NumSlabs(0),
+  m_NumDepotPops(0),
+  m_NumDepotPushes(0)
+{
+	for(int i = 0 ; i < Numa::MAX_NODES ; ++i)
+	{
+		InitializeSListHead(&m_Depots[i]);
+	}
+
+	size_t batchBytes = m_BlockStride * m_BatchSize;
+	for(int i = 1 ; i < SLAB_BATCHES && batchBytes * (i + 1) <= MAX_SLAB_BYTES ; ++i)
+	{
+		m_SlabSize += m_BatchSize;
+	}
+	InitializeCriticalSection(&m_SlabCS);
+}
+
+
+FreeListPool::~FreeListPool()
+{
+	Shutdown();
+
+	for(size_t i = 0 ; i < m_Slabs.size() ; ++i)
+	{
+		Numa::Free(m_Slabs[i]);
+	}
+	m_Slabs.clear();
+
+	DeleteCriticalSection(&m_SlabCS);
+}
+
+
+void FreeListPool::Init()
+{
+	assert(m_FlsIndex == FLS_OUT_OF_INDEXES);
+
+	m_FlsIndex = FlsAlloc(FreeListPool::OnThreadExit);
+	if(m_FlsIndex == FLS_OUT_OF_INDEXES)
+	{
+		ERROR_CODE(GetLastError(), "FlsAlloc() failed. Every allocation goes to the depot.");
+	}
+}
+
+
+void FreeListPool::Shutdown()
+{
+	// FlsFree() hands the cache of every thread to OnThreadExit(), so the threads must not use the pool any more.
+	if(m_FlsIndex != FLS_OUT_OF_INDEXES)
+	{
+		FlsFree(m_FlsIndex);
+		m_FlsIndex = FLS_OUT_OF_INDEXES;
+	}
+}
+
+
+void* FreeListPool::Alloc()
+{
+	Cache* cache = GetCache();
+	if(cache == NULL)
+	{
+		// Without a cache, take one block off a batch and give the rest back.
+		int node = Numa::GetCurrentNode();
+		FreeBlock* head = reinterpret_cast<FreeBlock*>(InterlockedPopEntrySList(&m_Depots[node]));
+		if(head == NULL)
+		{
+			head = AllocSlab(node);
+		}
+		if(head != NULL && head->next != NULL)
+		{
+			PushBatch(node, head->next);
+		}
+		return head;
+	}
+
+	if(cache->count == 0 && !Refill(cache))
+	{
+		return NULL;
+	}
+
+	FreeBlock* block = cache->blocks[--cache->count];
+	return block;
+}
+
+
+void FreeListPool::Free(void* block)
+{
+	if(block == NULL)
+	{
+		return;
+	}
+
+	FreeBlock* freeBlock = static_cast<FreeBlock*>(block);
+	int node = GetNode(freeBlock);
+	Numa::CountFree(node);
+
+	// Blocks of another node go home, so that the caches of this node only hand out local memory.
+	Cache* cache = GetCache();
+	if(cache == NULL || cache->node != node)
+	{
+		freeBlock->next = NULL;
+		PushBatch(node, freeBlock);
+		return;
+	}
+
+	// Keep a batch in the cache, so that a thread alternating between Alloc() and Free() never touches the depot.
+	if(cache->count == m_CacheSize)
+	{
+		Flush(cache, m_BatchSize);
+	}
+
+	cache->blocks[cache->count++] = freeBlock;
+}
+
+
+void FreeListPool::GetStats(Stats& outStats)
+{
+	outStats.numSlabs = m_NumSlabs;
+	outStats.numSlabBytes = m_NumSlabs * static_cast<long long>(m_BlockStride * m_SlabSize);
+	outStats.numDepotPops = m_NumDepotPops;
+	outStats.numDepotPushes = m_NumDepotPushes;
+}
+
+
+/* static */ void WINAPI FreeListPool::OnThreadExit(PVOID data)
+{
+	Cache* cache = static_cast<Cache*>(data);
+	if(cache == NULL)
+	{
+		return;
+	}
+
+	if(cache->count > 0)
+	{
+		cache->pool->Flush(cache, cache->count);
+	}
+	delete cache;
+}
+
+
+FreeListPool::Cache* FreeListPool::GetCache()
+{
+	if(m_FlsIndex == FLS_OUT_OF_INDEXES)
+	{
+		return NULL;
+	}
+
+	Cache* cache = static_cast<Cache*>(FlsGetValue(m_FlsIndex));
+	if(cache != NULL)
+	{
+		return cache;
+	}
+
+	// The node is that of the first allocation. I/O threads are bound to their node, so it does not change for them.
+	cache = new Cache;
+	cache->pool = this;
+	cache->node = Numa::GetCurrentNode();
+	cache->count = 0;
+
+	if(!FlsSetValue(m_FlsIndex, cache))
+	{
+		ERROR_CODE(GetLastError(), "FlsSetValue() failed.");
+		delete cache;
+		return NULL;
+	}
+	return cache;
+}
+
+
+bool FreeListPool::Refill(Cache* cache)
+{
+	assert(cache->count == 0);
+
+	FreeBlock* head = reinterpret_cast<FreeBlock*>(InterlockedPopEntrySList(&m_Depots[cache->node]));
+	if(head != NULL)
+	{
+		InterlockedIncrement64(&m_NumDepotPops);
+	}
+	else
+	{
+		head = AllocSlab(cache->node);
+		if(head == NULL)
+		{
+			return false;
+		}
+	}
+
+	for(FreeBlock* block = head ; block != NULL && cache->count < m_CacheSize ; block = block->next)
+	{
+		cache->blocks[cache->count++] = block;
+	}
+	return true;
+}
+
+
+void FreeListPool::Flush(Cache* cache, int count)
+{
+	assert(count > 0 && count <= cache->count);
+
+	int first = cache->count - count;
+	for(int i = first ; i < cache->count - 1 ; ++i)
+	{
+		cache->blocks[i]->next = cache->blocks[i + 1];
+	}
+	cache->blocks[cache->count - 1]->next = NULL;
+
+	PushBatch(cache->node, cache->blocks[first]);
+	cache->count = first;
+}
+
+
+void FreeListPool::PushBatch(int node, FreeBlock* head)
+{
+	InterlockedPushEntrySList(&m_Depots[node], &head->entry);
+	InterlockedIncrement64(&m_NumDepotPushes);
+}
+
+
+FreeListPool::FreeBlock* FreeListPool::AllocSlab(int node)
+{
+	BYTE* slab = static_cast<BYTE*>(Numa::Alloc(m_BlockStride * m_SlabSize, node));
+	if(slab == NULL)
+	{
+		return NULL;
+	}
+
+	{
+		CSLocker lock(&m_SlabCS);
+		m_Slabs.push_back(slab);
+	}
+	InterlockedIncrement64(&m_NumSlabs);
+
+	// Carve the slab into blocks. The first batch goes to the caller, the rest to the depot in batches.
+	FreeBlock* batch = NULL;
+	for(int i = m_SlabSize - 1 ; i >= 0 ; --i)
+	{
+		BYTE* header = slab + m_BlockStride * i;
+		*reinterpret_cast<int*>(header) = node;
+
+		FreeBlock* block = reinterpret_cast<FreeBlock*>(header + HEADER_SIZE);
+		block->next = batch;
+		batch = block;
+
+		if(i % m_BatchSize == 0 && i > 0)
+		{
+			PushBatch(node, batch);
+			batch = NULL;
+		}
+	}
+	return batch;
+}
+
+
+/* static */ int FreeListPool::GetNode(FreeBlock* block)
+{
+	return *reinterpret_cast<int*>(reinterpret_cast<BYTE*>(block) - HEADER_SIZE);
+}
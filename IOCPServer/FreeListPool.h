@@ -0,0 +1,94 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+#include "Numa.h"
+
+// Pool of fixed size blocks without a lock on the way of an allocation or a free.
+// Each thread keeps a cache of free blocks of its own. Caches trade batches of BATCH_SIZE blocks with a depot, which is an SLIST
+// of batches per NUMA node, so a thread only touches shared memory once every BATCH_SIZE allocations or frees.
+// A block goes back to the node it has been taken from, straight to the depot if it is freed on another node.
+// A thread leaves its cache to the depot when it exits, so thread pool threads coming and going lose nothing.
+// Pools of large blocks take smaller batches, so that caches and slabs do not hold megabytes nobody asked for.
+
+class FreeListPool
+{
+public:
+	enum
+	{
+		BATCH_SIZE = 32,
+		CACHE_SIZE = BATCH_SIZE * 2,
+		SLAB_BATCHES = 8,				// batches allocated at once when the depot is empty,
+		MAX_SLAB_BYTES = 1024 * 1024,	// unless they take more than this. a slab has one batch at least.
+	};
+
+	struct Stats
+	{
+		long long numSlabs;
+		long long numSlabBytes;
+		long long numDepotPops;		// batches taken by caches.
+		long long numDepotPushes;	// batches and remote blocks given back.
+	};
+
+public:
+	// batchSize is up to BATCH_SIZE.
+	explicit FreeListPool(size_t blockSize, int batchSize = BATCH_SIZE);
+	~FreeListPool();
+
+	void Init();
+	// Takes the caches of all threads back. Blocks still in use stay valid until the pool is destroyed.
+	void Shutdown();
+
+	// Aligned to MEMORY_ALLOCATION_ALIGNMENT. NULL if no memory is left.
+	void* Alloc();
+	void Free(void* block);
+
+	void GetStats(Stats& outStats);
+
+private:
+	FreeListPool(const FreeListPool& rhs);
+	FreeListPool& operator=(const FreeListPool& rhs);
+
+private:
+	// Overlays a free block. The head of a batch is linked in the depot, and the rest of the batch hangs from it.
+	struct FreeBlock
+	{
+		SLIST_ENTRY entry;
+		FreeBlock* next;
+	};
+
+	struct Cache
+	{
+		FreeListPool* pool;
+		int node;
+		int count;
+		FreeBlock* blocks[CACHE_SIZE];
+	};
+
+	static void WINAPI OnThreadExit(PVOID data);
+
+	Cache* GetCache();
+	bool Refill(Cache* cache);
+	// Moves the last count blocks of the cache to the depot of its node.
+	void Flush(Cache* cache, int count);
+	void PushBatch(int node, FreeBlock* head);
+	FreeBlock* AllocSlab(int node);
+
+	static int GetNode(FreeBlock* block);
+
+private:
+	SLIST_HEADER m_Depots[Numa::MAX_NODES];
+	size_t m_BlockStride;	// header and block, aligned.
+	int m_BatchSize;
+	int m_CacheSize;
+	int m_SlabSize;			// in blocks.
+	DWORD m_FlsIndex;
+
+	std::vector<void*> m_Slabs;
+	CRITICAL_SECTION m_SlabCS;
+
+	volatile LONGLONG m_NumSlabs;
+	volatile LONGLONG m_NumDepotPops;
+	volatile LONGLONG m_NumDepotPushes;
+};
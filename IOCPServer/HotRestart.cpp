@@ -0,0 +1,262 @@
+#include "HotRestart.h"
+#include "Network.h"
+#include "Log.h"
+
+#include <sstream>
+
+/* static */ HANDLE HotRestart::sPipe = INVALID_HANDLE_VALUE;
+
+
+namespace
+{
+	const DWORD MAX_SOCKETS = 64;
+	const DWORD CONNECT_TIMEOUT = 5000;	// ms the running server waits for the pipe of the new one.
+	const BYTE ACKNOWLEDGED = 1;
+
+	// The pipe is in byte mode, so a read or a write may take more than one call.
+	bool ReadAll(HANDLE pipe, void* buffer, DWORD size)
+	{
+		BYTE* data = static_cast<BYTE*>(buffer);
+		while(size > 0)
+		{
+			DWORD bytes = 0;
+			if(!ReadFile(pipe, data, size, &bytes, NULL) || bytes == 0)
+			{
+				ERROR_CODE(GetLastError(), "ReadFile() on the restart pipe failed.");
+				return false;
+			}
+			data += bytes;
+			size -= bytes;
+		}
+		return true;
+	}
+
+	bool WriteAll(HANDLE pipe, const void* buffer, DWORD size)
+	{
+		const BYTE* data = static_cast<const BYTE*>(buffer);
+		while(size > 0)
+		{
+			DWORD bytes = 0;
+			if(!WriteFile(pipe, data, size, &bytes, NULL))
+			{
+				ERROR_CODE(GetLastError(), "WriteFile() on the restart pipe failed.");
+				return false;
+			}
+			data += bytes;
+			size -= bytes;
+		}
+		return true;
+	}
+
+	// TOKEN_USER of the process, whose SID follows it in the buffer.
+	bool GetProcessUser(HANDLE process, std::vector<BYTE>& outUser)
+	{
+		HANDLE token = NULL;
+		if(!OpenProcessToken(process, TOKEN_QUERY, &token))
+		{
+			ERROR_CODE(GetLastError(), "OpenProcessToken() failed.");
+			return false;
+		}
+
+		DWORD size = 0;
+		GetTokenInformation(token, TokenUser, NULL, 0, &size);
+		outUser.resize(size > 0 ? size : sizeof(TOKEN_USER));
+
+		bool result = GetTokenInformation(token, TokenUser, &outUser[0], static_cast<DWORD>(outUser.size()), &size) != FALSE;
+		if(!result)
+		{
+			ERROR_CODE(GetLastError(), "GetTokenInformation() failed with TokenUser.");
+		}
+
+		CloseHandle(token);
+		return result;
+	}
+
+	PSID GetSid(std::vector<BYTE>& user)
+	{
+		return reinterpret_cast<TOKEN_USER*>(&user[0])->User.Sid;
+	}
+}
+
+
+/* static */ std::string HotRestart::GetPipeName(u_short port)
+{
+	std::stringstream name;
+	name << "\\\\.\\pipe\\IOCPServer." << port;
+	return name.str();
+}
+
+
+/* static */ bool HotRestart::Receive(const std::string& pipeName, std::vector<SOCKET>& outSockets)
+{
+	// Only processes of our own user may open the pipe, and the pipe must be ours from the start.
+	// Otherwise another process could create it first or connect to it, and take the listeners or hand us sockets of its own.
+	std::vector<BYTE> user;
+	if(!GetProcessUser(GetCurrentProcess(), user))
+	{
+		return false;
+	}
+
+	PSID sid = GetSid(user);
+	std::vector<BYTE> acl(sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) + GetLengthSid(sid));
+	SECURITY_DESCRIPTOR descriptor;
+	if(!InitializeAcl(reinterpret_cast<ACL*>(&acl[0]), static_cast<DWORD>(acl.size()), ACL_REVISION) || 
+		!AddAccessAllowedAce(reinterpret_cast<ACL*>(&acl[0]), ACL_REVISION, GENERIC_ALL, sid) || 
+		!InitializeSecurityDescriptor(&descriptor, SECURITY_DESCRIPTOR_REVISION) || 
+		!SetSecurityDescriptorDacl(&descriptor, TRUE, reinterpret_cast<ACL*>(&acl[0]), FALSE))
+	{
+		ERROR_CODE(GetLastError(), "Could not set up the security of the restart pipe.");
+		return false;
+	}
+
+	SECURITY_ATTRIBUTES attributes;
+	attributes.nLength = sizeof(attributes);
+	attributes.lpSecurityDescriptor = &descriptor;
+	attributes.bInheritHandle = FALSE;
+
+	HANDLE pipe = CreateNamedPipeA(pipeName.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE, 
+		PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 4096, 4096, 0, &attributes);
+	if(pipe == INVALID_HANDLE_VALUE)
+	{
+		ERROR_CODE(GetLastError(), "CreateNamedPipe() failed. Another process may have the pipe. pipe[%s]", pipeName.c_str());
+		return false;
+	}
+
+	LOG("Waiting for the running server to hand its listeners over. pipe[%s]", pipeName.c_str());
+
+	if(!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+	{
+		ERROR_CODE(GetLastError(), "ConnectNamedPipe() failed. pipe[%s]", pipeName.c_str());
+		CloseHandle(pipe);
+		return false;
+	}
+
+	DWORD numSockets = 0;
+	if(!ReadAll(pipe, &numSockets, sizeof(numSockets)) || numSockets > MAX_SOCKETS)
+	{
+		CloseHandle(pipe);
+		return false;
+	}
+
+	for(DWORD i = 0 ; i < numSockets ; ++i)
+	{
+		WSAPROTOCOL_INFO info;
+		if(!ReadAll(pipe, &info, sizeof(info)))
+		{
+			break;
+		}
+
+		SOCKET socket = WSASocket(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+		if(socket == INVALID_SOCKET)
+		{
+			ERROR_CODE(WSAGetLastError(), "WSASocket() failed with a handed over socket.");
+			break;
+		}
+		outSockets.push_back(socket);
+	}
+
+	if(outSockets.size() != numSockets)
+	{
+		for(size_t i = 0 ; i < outSockets.size() ; ++i)
+		{
+			Network::CloseSocket(outSockets[i]);
+		}
+		outSockets.clear();
+		CloseHandle(pipe);
+		return false;
+	}
+
+	LOG("Received %d listening sockets.", numSockets);
+
+	sPipe = pipe;
+	return true;
+}
+
+
+/* static */ void HotRestart::Acknowledge()
+{
+	if(sPipe == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+
+	WriteAll(sPipe, &ACKNOWLEDGED, sizeof(ACKNOWLEDGED));
+	FlushFileBuffers(sPipe);
+	DisconnectNamedPipe(sPipe);
+	CloseHandle(sPipe);
+	sPipe = INVALID_HANDLE_VALUE;
+}
+
+
+/* static */ bool HotRestart::Send(const std::string& pipeName, const std::vector<SOCKET>& sockets)
+{
+	if(!WaitNamedPipeA(pipeName.c_str(), CONNECT_TIMEOUT))
+	{
+		ERROR_CODE(GetLastError(), "No server is waiting for the listeners. pipe[%s]", pipeName.c_str());
+		return false;
+	}
+
+	HANDLE pipe = CreateFileA(pipeName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	if(pipe == INVALID_HANDLE_VALUE)
+	{
+		ERROR_CODE(GetLastError(), "CreateFile() failed. pipe[%s]", pipeName.c_str());
+		return false;
+	}
+
+	// The sockets go to the process which owns the pipe, and only if it runs as our user.
+	// Whatever the pipe would say could come from anyone.
+	DWORD processId = 0;
+	if(!GetNamedPipeServerProcessId(pipe, &processId) || !IsSameUser(processId))
+	{
+		ERROR_CODE(GetLastError(), "The restart pipe is not owned by a process of our user. pipe[%s]", pipeName.c_str());
+		CloseHandle(pipe);
+		return false;
+	}
+
+	DWORD numSockets = static_cast<DWORD>(sockets.size());
+	bool result = WriteAll(pipe, &numSockets, sizeof(numSockets));
+
+	for(size_t i = 0 ; result && i < sockets.size() ; ++i)
+	{
+		WSAPROTOCOL_INFO info;
+		if(WSADuplicateSocket(sockets[i], processId, &info) == SOCKET_ERROR)
+		{
+			ERROR_CODE(WSAGetLastError(), "WSADuplicateSocket() failed. process[%d]", processId);
+			result = false;
+			break;
+		}
+
+		result = WriteAll(pipe, &info, sizeof(info));
+	}
+
+	// The new server may fail before posting its accepts, in which case the pipe is closed with no acknowledgement.
+	BYTE acknowledged = 0;
+	result = result && ReadAll(pipe, &acknowledged, sizeof(acknowledged)) && acknowledged == ACKNOWLEDGED;
+
+	CloseHandle(pipe);
+
+	if(result)
+	{
+		LOG("Handed %d listening sockets over to process %d.", numSockets, processId);
+	}
+
+	return result;
+}
+
+
+/* static */ bool HotRestart::IsSameUser(DWORD processId)
+{
+	HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, processId);
+	if(process == NULL)
+	{
+		ERROR_CODE(GetLastError(), "OpenProcess() failed. process[%d]", processId);
+		return false;
+	}
+
+	std::vector<BYTE> user;
+	std::vector<BYTE> ourUser;
+	bool result = GetProcessUser(process, user) && GetProcessUser(GetCurrentProcess(), ourUser) && EqualSid(GetSid(user), GetSid(ourUser));
+
+	CloseHandle(process);
+	return result;
+}
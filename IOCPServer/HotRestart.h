@@ -0,0 +1,36 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+
+// Hands the listening sockets of a running server over to the server replacing it, so that no connection is refused during a restart.
+// The new server waits on a named pipe which only its own user can open. The running one connects to it and duplicates its
+// listening sockets into the process owning the pipe with WSADuplicateSocket(), if that process runs as the same user. Once the new server has posted its accepts, the running one stops accepting and drains its clients.
+// Connections waiting in the backlog at that moment are accepted by the new server.
+
+class HotRestart
+{
+public:
+	// One pipe per port, so that servers on different ports can restart independently.
+	static std::string GetPipeName(u_short port);
+
+	// New server. Blocks until the running server has handed its sockets over, in the order it created its listeners.
+	static bool Receive(const std::string& pipeName, std::vector<SOCKET>& outSockets);
+	// New server. Tells the running server that accepts are posted on the sockets it has handed over.
+	static void Acknowledge();
+
+	// Running server. Returns true once the new server has acknowledged. The running server keeps accepting otherwise.
+	static bool Send(const std::string& pipeName, const std::vector<SOCKET>& sockets);
+
+private:
+	HotRestart();
+	~HotRestart();
+	HotRestart(const HotRestart& rhs);
+	HotRestart& operator=(const HotRestart& rhs);
+
+	static bool IsSameUser(DWORD processId);
+
+private:
+	static HANDLE sPipe;	// the new server's end, kept until Acknowledge().
+};
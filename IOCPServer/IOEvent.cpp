@@ -1,42 +1,47 @@
 #include "IOEvent.h"
 #include "Client.h"
 #include "Packet.h"
-#include "CSLocker.h"
 
+#include <new>
 
-/* static */ IOEvent::PoolType IOEvent::sPool;
-/* static */ CRITICAL_SECTION IOEvent::sPoolCS;
+
+/* static */ FreeListPool IOEvent::sPool(sizeof(IOEvent));
 
 /* static */ void IOEvent::Init()
 {
-	InitializeCriticalSection(&sPoolCS);
+	sPool.Init();
 }
 
 /* static */ void IOEvent::Shutdown()
 {
-	DeleteCriticalSection(&sPoolCS);
+	sPool.Shutdown();
 }
 
 
 
 /* static */ IOEvent* IOEvent::Create(Type type, Client* client, Packet* packet)
 {
-	CSLocker locker(&sPoolCS);
+	void* memory = sPool.Alloc();
+	if(memory == NULL)
+	{
+		return NULL;
+	}
 
-	IOEvent* event = sPool.construct();
+	IOEvent* event = new(memory) IOEvent;
 
 	ZeroMemory(&event->m_Overlapped, sizeof(OVERLAPPED));
 	event->m_Client = client;
 	event->m_Type = type;
 	event->m_Packet = packet;
+	event->m_Context = NULL;
 
 	return event;	
 }
 
 /* static */ void IOEvent::Destroy(IOEvent* event)
 {
-	CSLocker locker(&sPoolCS);
-	sPool.destroy(event);
+	event->~IOEvent();
+	sPool.Free(event);
 }
 
 IOEvent::IOEvent()
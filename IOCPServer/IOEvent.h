@@ -1,6 +1,7 @@
 #pragma once
 #include <winsock2.h>
-#include <boost/pool/object_pool.hpp>
+
+#include "FreeListPool.h"
 
 class Client;
 class Packet;
@@ -12,7 +13,11 @@ public:
 	{
 		ACCEPT,
 		RECV,
+		RECV_NOTIFY,	// zero-byte receive. data is ready to be read.
 		SEND,
+		CONNECT,		// ConnectEx() of an upstream connection.
+		DATAGRAM_RECV,	// WSARecvFrom() on a datagram socket. no client.
+		DATAGRAM_SEND,	// WSASendTo() on a datagram socket. no client.
 	};
 
 public:
@@ -28,6 +33,10 @@ public:
 	Packet* GetPacket() { return m_Packet; }
 	OVERLAPPED& GetOverlapped() { return m_Overlapped; }
 
+	// Data of the operation which is neither a client nor a packet. e.g. the receive slot of a datagram socket.
+	void SetContext(void* context) { m_Context = context; }
+	void* GetContext() { return m_Context; }
+
 private:
 	IOEvent();
 	~IOEvent();
@@ -37,11 +46,10 @@ private:
 private:
 	OVERLAPPED m_Overlapped;
 	Client* m_Client;
-	Packet* m_Packet; // only for sending.
+	Packet* m_Packet; // only for sending datagrams.
+	void* m_Context;
 	Type m_Type;
 
-	typedef boost::object_pool<IOEvent> PoolType; 
-	friend PoolType;
-	static PoolType sPool;
-	static CRITICAL_SECTION sPoolCS;
+	// Every I/O creates an event and every completion destroys one, so neither takes a lock. See FreeListPool.
+	static FreeListPool sPool;
 };
\ No newline at end of file
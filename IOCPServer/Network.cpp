@@ -1,5 +1,6 @@
 #include "Network.h"
 #include "Log.h"
+#include <mstcpip.h>
 #include <cassert>
 #include <sstream>
 #include <string>
@@ -13,6 +14,27 @@ namespace
 	LPFN_ACCEPTEX s_AcceptEx = NULL;
 	LPFN_CONNECTEX s_ConnectEx = NULL;
 
+	// TCP_QUICKACK, TCP_NOTSENT_LOWAT and SO_BUSY_POLL have no Winsock equivalents, so profiles don't have them.
+	const Network::SocketProfile s_SocketProfiles[] =
+	{
+		//	name			noDelay	sendBuf		recvBuf		keepAlive	interval	loopback	backlog
+		{	"default",		false,	-1,			-1,			0,			0,			false,		SOMAXCONN },
+		// Small messages go out at once, dead peers are found in seconds and loopback skips most of the TCP stack.
+		{	"lowlatency",	true,	64*1024,	64*1024,	10*1000,	1000,		true,		SOMAXCONN_HINT(4096) },
+		// Large buffers keep the pipe full. Nagle coalesces small writes.
+		{	"bulk",			false,	4*1024*1024,4*1024*1024,60*1000,	10*1000,	false,		SOMAXCONN },
+	};
+
+	bool SetSocketOption(SOCKET socket, int level, int name, int value, const char* optionName)
+	{
+		if(setsockopt(socket, level, name, reinterpret_cast<const char*>(&value), sizeof(value)) == SOCKET_ERROR)
+		{
+			ERROR_CODE(WSAGetLastError(), "setsockopt() failed with %s.", optionName);
+			return false;
+		}
+		return true;
+	}
+
 	bool BindSocket(SOCKET socket, addrinfo* info)
 	{
 		if(bind(socket, info->ai_addr, static_cast<int>(info->ai_addrlen)) == SOCKET_ERROR)
@@ -56,7 +78,7 @@ void Network::Shutdown()
 }
 
 
-SOCKET Network::CreateSocket(bool bind, u_short port, int aiFamily)
+SOCKET Network::CreateSocket(bool bind, u_short port, int aiFamily, const char* host, bool dualStack)
 {
 	// Get Address Info
 	addrinfo hints;
@@ -71,9 +93,9 @@ SOCKET Network::CreateSocket(bool bind, u_short port, int aiFamily)
 
 	struct addrinfo* infoList = NULL;
 	// Passing NULL for pNodeName should return INADDR_ANY
-	if (getaddrinfo(NULL, portBuff.str().c_str(), &hints, &infoList) != 0) 
+	if (getaddrinfo(host, portBuff.str().c_str(), &hints, &infoList) != 0) 
 	{
-		ERROR_CODE(WSAGetLastError(), "getaddrinfo() failed. port : %d", port);
+		ERROR_CODE(WSAGetLastError(), "getaddrinfo() failed. host : %s, port : %d", host ? host : "", port);
 		return INVALID_SOCKET;
 	}
 
@@ -88,6 +110,16 @@ SOCKET Network::CreateSocket(bool bind, u_short port, int aiFamily)
 			if(!bind) 
 				break;
 
+			// IPV6_V6ONLY is on by default on Windows and can only be changed before bind().
+			if(dualStack && info->ai_family == AF_INET6)
+			{
+				DWORD v6Only = 0;
+				if(setsockopt(socket, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&v6Only), sizeof(v6Only)) == SOCKET_ERROR)
+				{
+					ERROR_CODE(WSAGetLastError(), "setsockopt() failed with IPV6_V6ONLY.");
+				}
+			}
+
 			if(BindSocket(socket, info))
 				break;
 
@@ -106,6 +138,134 @@ SOCKET Network::CreateSocket(bool bind, u_short port, int aiFamily)
 }
 
 
+SOCKET Network::CreateOverlappedSocket(int family)
+{
+	// AF_UNIX has no protocol to choose.
+	SOCKET socket = WSASocket(family, SOCK_STREAM, family == AF_UNIX ? 0 : IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+	if(socket == INVALID_SOCKET)
+	{
+		ERROR_CODE(WSAGetLastError(), "WSASocket() failed. family : %d", family);
+	}
+	return socket;
+}
+
+
+SOCKET Network::CreateUnixSocket(const std::string& path)
+{
+	SOCKADDR_UN address;
+	int addressLength = 0;
+	if(!GetUnixAddress(path, address, addressLength))
+	{
+		return INVALID_SOCKET;
+	}
+
+	SOCKET socket = CreateOverlappedSocket(AF_UNIX);
+	if(socket == INVALID_SOCKET)
+	{
+		return INVALID_SOCKET;
+	}
+
+	// A file left by a previous run would fail bind() with WSAEADDRINUSE.
+	if(path[0] != '@')
+	{
+		DeleteFileA(path.c_str());
+	}
+
+	if(::bind(socket, reinterpret_cast<const sockaddr*>(&address), addressLength) == SOCKET_ERROR)
+	{
+		ERROR_CODE(WSAGetLastError(), "bind() failed. AF_UNIX path : %s", path.c_str());
+		CloseSocket(socket);
+		return INVALID_SOCKET;
+	}
+
+	LOG("Bind Address : AF_UNIX path[%s]", path.c_str());
+
+	return socket;
+}
+
+
+bool Network::GetUnixAddress(const std::string& path, SOCKADDR_UN& outAddress, int& outLength)
+{
+	ZeroMemory(&outAddress, sizeof(outAddress));
+	outAddress.sun_family = AF_UNIX;
+
+	if(path.empty() || path.size() >= sizeof(outAddress.sun_path))
+	{
+		ERROR_MSG("Invalid AF_UNIX path : %s", path.c_str());
+		return false;
+	}
+
+	if(path[0] == '@')
+	{
+		// The abstract namespace has a leading null and no file. Not every Windows build supports it, in which case bind() fails.
+		CopyMemory(outAddress.sun_path + 1, path.c_str() + 1, path.size() - 1);
+		outLength = static_cast<int>(offsetof(SOCKADDR_UN, sun_path) + path.size());
+	}
+	else
+	{
+		CopyMemory(outAddress.sun_path, path.c_str(), path.size());
+		outLength = sizeof(outAddress);
+	}
+
+	return true;
+}
+
+
+SOCKET Network::CreateDatagramSocket(u_short port, int family)
+{
+	SOCKET socket = WSASocket(family, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_OVERLAPPED);
+	if(socket == INVALID_SOCKET)
+	{
+		ERROR_CODE(WSAGetLastError(), "WSASocket() failed for a datagram socket.");
+		return INVALID_SOCKET;
+	}
+
+	// The zeroed address is the wildcard of either family.
+	sockaddr_storage address;
+	ZeroMemory(&address, sizeof(address));
+	int addressLength = 0;
+	if(family == AF_INET6)
+	{
+		// IPV6_V6ONLY is on by default on Windows and can only be changed before bind().
+		DWORD v6Only = 0;
+		if(setsockopt(socket, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&v6Only), sizeof(v6Only)) == SOCKET_ERROR)
+		{
+			ERROR_CODE(WSAGetLastError(), "setsockopt() failed with IPV6_V6ONLY for a datagram socket.");
+		}
+
+		sockaddr_in6* address6 = reinterpret_cast<sockaddr_in6*>(&address);
+		address6->sin6_family = AF_INET6;
+		address6->sin6_port = htons(port);
+		addressLength = sizeof(sockaddr_in6);
+	}
+	else
+	{
+		sockaddr_in* address4 = reinterpret_cast<sockaddr_in*>(&address);
+		address4->sin_family = AF_INET;
+		address4->sin_addr.s_addr = INADDR_ANY;
+		address4->sin_port = htons(port);
+		addressLength = sizeof(sockaddr_in);
+	}
+
+	if(::bind(socket, reinterpret_cast<const sockaddr*>(&address), addressLength) == SOCKET_ERROR)
+	{
+		ERROR_CODE(WSAGetLastError(), "bind() failed for a datagram socket. port : %d", port);
+		CloseSocket(socket);
+		return INVALID_SOCKET;
+	}
+
+	// Otherwise an ICMP port unreachable for one of our sends fails the next receive with WSAECONNRESET.
+	BOOL connReset = FALSE;
+	DWORD bytes = 0;
+	if(WSAIoctl(socket, SIO_UDP_CONNRESET, &connReset, sizeof(connReset), NULL, 0, &bytes, NULL, NULL) == SOCKET_ERROR)
+	{
+		ERROR_CODE(WSAGetLastError(), "WSAIoctl() failed with SIO_UDP_CONNRESET. ignored.");
+	}
+
+	return socket;
+}
+
+
 void Network::CloseSocket(SOCKET socket)
 {
 	if(closesocket(socket) == SOCKET_ERROR)
@@ -115,7 +275,7 @@ void Network::CloseSocket(SOCKET socket)
 }
 
 
-BOOL Network::AcceptEx(SOCKET listenSocket, SOCKET newSocket, LPOVERLAPPED overlapped)
+BOOL Network::AcceptEx(SOCKET listenSocket, SOCKET newSocket, BYTE* buffer, DWORD receiveDataLength, DWORD addressSize, LPOVERLAPPED overlapped)
 {
 	if(s_AcceptEx == NULL)
 	{
@@ -128,12 +288,12 @@ BOOL Network::AcceptEx(SOCKET listenSocket, SOCKET newSocket, LPOVERLAPPED overl
 		}
 	}
 
-	// This value is for retriving first data, local and remote addresses from AcceptEx by calling GetAcceptExSockaddrs() latter.
-	// Each address buffer must be at least 16 bytes more than the maximum address length for the transport protocol in use.
+	// The buffer is for retriving first data, local and remote addresses from AcceptEx by calling GetAcceptExSockaddrs() latter.
 	// It seems we don't need to use GetAcceptExSockaddrs() as we can get the address from getsockname(), getpeername() once we set SO_UPDATE_ACCEPT_CONTEXT.
-	static BYTE buffer[(sizeof(sockaddr_in6) + 16)*2];
+	// It must not be shared between pending accepts as the kernel writes into it on completion.
+	assert(buffer);
 
-	return s_AcceptEx(listenSocket, newSocket, &buffer, 0, sizeof(sockaddr_in6) + 16, sizeof(sockaddr_in6) + 16,  NULL, overlapped);
+	return s_AcceptEx(listenSocket, newSocket, buffer, receiveDataLength, addressSize, addressSize,  NULL, overlapped);
 }
 
 
@@ -154,6 +314,101 @@ BOOL Network::ConnectEx(SOCKET socket, sockaddr* addr, int addrlen, LPOVERLAPPED
 }
 
 
+const Network::SocketProfile* Network::FindSocketProfile(const std::string& name)
+{
+	for(size_t i = 0 ; i < sizeof(s_SocketProfiles)/sizeof(s_SocketProfiles[0]) ; ++i)
+	{
+		if(name == s_SocketProfiles[i].name)
+		{
+			return &s_SocketProfiles[i];
+		}
+	}
+	return NULL;
+}
+
+
+const Network::SocketProfile& Network::GetDefaultSocketProfile()
+{
+	return s_SocketProfiles[0];
+}
+
+
+void Network::PrintSocketProfiles()
+{
+	for(size_t i = 0 ; i < sizeof(s_SocketProfiles)/sizeof(s_SocketProfiles[0]) ; ++i)
+	{
+		const SocketProfile& profile = s_SocketProfiles[i];
+		LOG("  %s : nodelay[%d] sndbuf[%d] rcvbuf[%d] keepalive[%u/%u] loopback_fast_path[%d] backlog[%d]", 
+			profile.name, profile.noDelay, profile.sendBufferSize, profile.recvBufferSize, 
+			profile.keepAliveTime, profile.keepAliveInterval, profile.loopbackFastPath, profile.backlog);
+	}
+}
+
+
+bool Network::ApplySocketProfile(SOCKET socket, const SocketProfile& profile, bool listener)
+{
+	if(profile.noDelay && !SetSocketOption(socket, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY"))
+	{
+		return false;
+	}
+
+	// Accepted sockets inherit the buffer sizes of the listener, but set them anyway for the window scale to match.
+	if(profile.sendBufferSize >= 0 && !SetSocketOption(socket, SOL_SOCKET, SO_SNDBUF, profile.sendBufferSize, "SO_SNDBUF"))
+	{
+		return false;
+	}
+
+	if(profile.recvBufferSize >= 0 && !SetSocketOption(socket, SOL_SOCKET, SO_RCVBUF, profile.recvBufferSize, "SO_RCVBUF"))
+	{
+		return false;
+	}
+
+	if(profile.keepAliveTime > 0)
+	{
+		tcp_keepalive keepAlive;
+		keepAlive.onoff = 1;
+		keepAlive.keepalivetime = profile.keepAliveTime;
+		keepAlive.keepaliveinterval = profile.keepAliveInterval;
+
+		DWORD bytes = 0;
+		if(WSAIoctl(socket, SIO_KEEPALIVE_VALS, &keepAlive, sizeof(keepAlive), NULL, 0, &bytes, NULL, NULL) == SOCKET_ERROR)
+		{
+			ERROR_CODE(WSAGetLastError(), "WSAIoctl() failed with SIO_KEEPALIVE_VALS.");
+			return false;
+		}
+	}
+
+	// It has to be set before listen(). It is not supported before Windows 8, which is not an error.
+	if(listener && profile.loopbackFastPath)
+	{
+		int enable = 1;
+		DWORD bytes = 0;
+		if(WSAIoctl(socket, SIO_LOOPBACK_FAST_PATH, &enable, sizeof(enable), NULL, 0, &bytes, NULL, NULL) == SOCKET_ERROR)
+		{
+			ERROR_CODE(WSAGetLastError(), "WSAIoctl() failed with SIO_LOOPBACK_FAST_PATH. ignored.");
+		}
+	}
+
+	return true;
+}
+
+
+int Network::GetAddressFamily(SOCKET socket)
+{
+	sockaddr_storage address;
+	ZeroMemory(&address, sizeof(address));
+	int size = sizeof(address);
+
+	if( getsockname(socket, reinterpret_cast<sockaddr*>(&address), &size) == SOCKET_ERROR )
+	{
+		ERROR_CODE(WSAGetLastError(), "getsockname() failed.");
+		return AF_UNSPEC;
+	}
+
+	return address.ss_family;
+}
+
+
 bool Network::GetLocalAddress(SOCKET socket, std::string& ip, u_short& port)
 {
 	sockaddr_in6 addr6;
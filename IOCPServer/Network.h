@@ -7,17 +7,68 @@
 
 struct addrinfo;
 
+// afunix.h only ships with the Windows 10 SDK, so the older toolsets get the same declaration here.
+// _AFUNIX_ is the guard of afunix.h, which keeps the two from clashing when a newer SDK pulls it in.
+#ifndef _AFUNIX_
+#define _AFUNIX_
+#define UNIX_PATH_MAX 108
+
+typedef struct sockaddr_un
+{
+	ADDRESS_FAMILY sun_family;
+	char sun_path[UNIX_PATH_MAX];
+} SOCKADDR_UN, *PSOCKADDR_UN;
+#endif
+
 namespace Network
 {
+	// Each address buffer of AcceptEx() must be at least 16 bytes more than the maximum address length for the transport protocol in use.
+	const int ACCEPTEX_ADDRESS_SIZE = sizeof(sockaddr_in6) + 16;
+	const int ACCEPTEX_UNIX_ADDRESS_SIZE = sizeof(SOCKADDR_UN) + 16;
+
 	bool Init();
 	void Shutdown();
 
-	SOCKET CreateSocket(bool bind = true, u_short port = 0, int aiFamily = AF_INET);
+	// host NULL binds every interface of the family. With dualStack, an AF_INET6 socket accepts IPv4 as mapped addresses too.
+	SOCKET CreateSocket(bool bind = true, u_short port = 0, int aiFamily = AF_INET, const char* host = NULL, bool dualStack = false);
+	// Creates an unbound overlapped stream socket without resolving any address, for AcceptEx().
+	SOCKET CreateOverlappedSocket(int family = AF_INET);
+	// Creates an overlapped AF_UNIX stream socket bound to the path. A path starting with '@' is in the abstract namespace.
+	SOCKET CreateUnixSocket(const std::string& path);
+	// The address of bind() or connect() for the path of CreateUnixSocket().
+	bool GetUnixAddress(const std::string& path, SOCKADDR_UN& outAddress, int& outLength);
+	// Creates an overlapped UDP socket bound to the port on all interfaces. An AF_INET6 socket receives IPv4 as mapped addresses too.
+	SOCKET CreateDatagramSocket(u_short port, int family = AF_INET);
 	void CloseSocket(SOCKET socket);
 
-	BOOL AcceptEx(SOCKET listenSocket, SOCKET newSocket, LPOVERLAPPED overlapped);
+	// buffer must hold receiveDataLength bytes followed by two addresses of ACCEPTEX_ADDRESS_SIZE.
+	// With receiveDataLength > 0, it completes only once the first data has arrived, which is placed at the beginning of buffer.
+	// addressSize is the size of each address buffer following the first data. ACCEPTEX_ADDRESS_SIZE for IP.
+	BOOL AcceptEx(SOCKET listenSocket, SOCKET newSocket, BYTE* buffer, DWORD receiveDataLength, DWORD addressSize, LPOVERLAPPED overlapped);
 	BOOL ConnectEx(SOCKET socket, sockaddr* addr, int addrlen, LPOVERLAPPED overlapped);
 
+	// Named set of transport options applied to a listener and the sockets it accepts.
+	struct SocketProfile
+	{
+		const char* name;
+		bool noDelay;				// TCP_NODELAY.
+		int sendBufferSize;			// SO_SNDBUF. -1 keeps the system default.
+		int recvBufferSize;			// SO_RCVBUF. -1 keeps the system default.
+		ULONG keepAliveTime;		// ms of idle time before the first keep-alive probe. 0 keeps keep-alive off.
+		ULONG keepAliveInterval;	// ms between keep-alive probes.
+		bool loopbackFastPath;		// SIO_LOOPBACK_FAST_PATH. listener only, inherited by accepted sockets.
+		int backlog;				// listen() backlog. listener only.
+	};
+
+	// Returns NULL if there is no profile with the name.
+	const SocketProfile* FindSocketProfile(const std::string& name);
+	const SocketProfile& GetDefaultSocketProfile();
+	void PrintSocketProfiles();
+
+	bool ApplySocketProfile(SOCKET socket, const SocketProfile& profile, bool listener);
+
+	// AF_INET, AF_INET6 or AF_UNIX of a bound socket. AF_UNSPEC on failure.
+	int GetAddressFamily(SOCKET socket);
 	bool GetLocalAddress(SOCKET socket, std::string& ip, u_short& port);
 	bool GetRemoteAddress(SOCKET socket, std::string& ip, u_short& port);
 };
@@ -0,0 +1,222 @@
+#include "Numa.h"
+#include "Log.h"
+
+#include <cassert>
+#include <cstdlib>
+
+/* static */ Numa::Node Numa::sNodes[MAX_NODES];
+/* static */ BYTE Numa::sProcessorNodes[MAX_PROCESSORS];
+/* static */ int Numa::sNumNodes = 1;
+/* static */ bool Numa::sEnabled = false;
+
+
+namespace
+{
+	int CountProcessors(KAFFINITY mask)
+	{
+		int count = 0;
+		for( ; mask != 0 ; mask &= mask - 1)
+		{
+			++count;
+		}
+		return count;
+	}
+}
+
+
+/* static */ bool Numa::Init(bool enabled)
+{
+	ZeroMemory(sNodes, sizeof(sNodes));
+	ZeroMemory(sProcessorNodes, sizeof(sProcessorNodes));
+	sNumNodes = 1;
+	sEnabled = false;
+
+	if(!enabled)
+	{
+		return true;
+	}
+
+	ULONG highestNode = 0;
+	if(!GetNumaHighestNodeNumber(&highestNode))
+	{
+		ERROR_CODE(GetLastError(), "GetNumaHighestNodeNumber() failed.");
+		return false;
+	}
+
+	int numNodes = 0;
+	for(ULONG number = 0 ; number <= highestNode ; ++number)
+	{
+		// Nodes with memory only have nothing to run our threads on.
+		GROUP_AFFINITY affinity;
+		if(!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(number), &affinity) || affinity.Mask == 0)
+		{
+			continue;
+		}
+
+		if(numNodes == MAX_NODES)
+		{
+			ERROR_MSG("More than %d NUMA nodes. The rest are left out.", MAX_NODES);
+			break;
+		}
+
+		Node& node = sNodes[numNodes];
+		node.number = static_cast<USHORT>(number);
+		node.affinity = affinity;
+		node.numProcessors = CountProcessors(affinity.Mask);
+
+		for(int bit = 0 ; bit < 64 ; ++bit)
+		{
+			if(affinity.Mask & (static_cast<KAFFINITY>(1) << bit))
+			{
+				sProcessorNodes[(affinity.Group * 64 + bit) % MAX_PROCESSORS] = static_cast<BYTE>(numNodes);
+			}
+		}
+
+		LOG("NUMA node %d : system node %d, group %d, processors %d", numNodes, number, affinity.Group, node.numProcessors);
+		++numNodes;
+	}
+
+	if(numNodes == 0)
+	{
+		ERROR_MSG("No NUMA node with processors.");
+		return false;
+	}
+
+	sNumNodes = numNodes;
+	sEnabled = true;
+
+	return true;
+}
+
+
+/* static */ int Numa::GetCurrentNode()
+{
+	if(!sEnabled)
+	{
+		return 0;
+	}
+
+	PROCESSOR_NUMBER processor;
+	GetCurrentProcessorNumberEx(&processor);
+	return GetProcessorNode(processor);
+}
+
+
+/* static */ int Numa::GetProcessorNode(const PROCESSOR_NUMBER& processor)
+{
+	if(!sEnabled)
+	{
+		return 0;
+	}
+
+	return sProcessorNodes[(processor.Group * 64 + processor.Number) % MAX_PROCESSORS];
+}
+
+
+/* static */ GROUP_AFFINITY Numa::GetNodeProcessor(int node, int index)
+{
+	assert(node >= 0 && node < sNumNodes);
+
+	const Node& info = sNodes[node];
+	GROUP_AFFINITY affinity = info.affinity;
+
+	int skip = index % info.numProcessors;
+	for(int bit = 0 ; bit < 64 ; ++bit)
+	{
+		KAFFINITY mask = static_cast<KAFFINITY>(1) << bit;
+		if((info.affinity.Mask & mask) != 0 && skip-- == 0)
+		{
+			affinity.Mask = mask;
+			break;
+		}
+	}
+	return affinity;
+}
+
+
+/* static */ void* Numa::Alloc(size_t size, int node)
+{
+	if(!sEnabled)
+	{
+		return malloc(size);
+	}
+
+	assert(node >= 0 && node < sNumNodes);
+
+	// Pages committed with a preferred node come from that node as long as it has free memory.
+	void* memory = VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, sNodes[node].number);
+	if(memory == NULL)
+	{
+		ERROR_CODE(GetLastError(), "VirtualAllocExNuma() failed. size[%d], node[%d]", size, node);
+	}
+	return memory;
+}
+
+
+/* static */ void Numa::Free(void* memory)
+{
+	if(memory == NULL)
+	{
+		return;
+	}
+
+	if(!sEnabled)
+	{
+		free(memory);
+		return;
+	}
+
+	VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+
+/* static */ void Numa::CountFree(int node)
+{
+	if(!sEnabled)
+	{
+		return;
+	}
+
+	int current = GetCurrentNode();
+	if(current == node)
+	{
+		InterlockedIncrement64(&sNodes[current].numLocalFrees);
+	}
+	else
+	{
+		InterlockedIncrement64(&sNodes[current].numRemoteFrees);
+	}
+}
+
+
+/* static */ void Numa::CountConnection(int node, bool local)
+{
+	if(!sEnabled)
+	{
+		return;
+	}
+
+	assert(node >= 0 && node < sNumNodes);
+
+	if(local)
+	{
+		InterlockedIncrement64(&sNodes[node].numLocalConnections);
+	}
+	else
+	{
+		InterlockedIncrement64(&sNodes[node].numRemoteConnections);
+	}
+}
+
+
+/* static */ void Numa::GetNodeStats(int node, NodeStats& outStats)
+{
+	assert(node >= 0 && node < sNumNodes);
+
+	const Node& info = sNodes[node];
+	outStats.numProcessors = info.numProcessors;
+	outStats.numLocalFrees = info.numLocalFrees;
+	outStats.numRemoteFrees = info.numRemoteFrees;
+	outStats.numLocalConnections = info.numLocalConnections;
+	outStats.numRemoteConnections = info.numRemoteConnections;
+}
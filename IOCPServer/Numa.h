@@ -0,0 +1,76 @@
+#pragma once
+
+#include <windows.h>
+#include <cstddef>
+
+// NUMA topology, memory local to a node and per-node counters of remote accesses.
+// Nodes are numbered densely from 0 and only nodes with processors count. Until Init(true) there is a single node 0,
+// and memory comes from the heap as it would without NUMA.
+
+class Numa
+{
+public:
+	enum
+	{
+		MAX_NODES = 16,
+	};
+
+	// Counted by the node the access happens on.
+	struct NodeStats
+	{
+		int numProcessors;
+		long long numLocalFrees;		// pooled objects freed on the node whose memory they are in.
+		long long numRemoteFrees;		// pooled objects of another node, whose cache lines had to cross the interconnect.
+		long long numLocalConnections;	// connections served on the node whose NIC queue received them.
+		long long numRemoteConnections;	// connections no shard of the node could take.
+	};
+
+public:
+	static bool Init(bool enabled);
+	static bool IsEnabled() { return sEnabled; }
+
+	static int GetNumNodes() { return sNumNodes; }
+	// Node of the processor the calling thread runs on now. Threads which are not bound to a node may move at any time.
+	static int GetCurrentNode();
+	static int GetProcessorNode(const PROCESSOR_NUMBER& processor);
+	// The index-th processor of the node, counting around.
+	static GROUP_AFFINITY GetNodeProcessor(int node, int index);
+
+	// Memory committed on the node.
+	static void* Alloc(size_t size, int node);
+	static void Free(void* memory);
+
+	// Counts an access to an object in the memory of the node from the calling thread.
+	static void CountFree(int node);
+	static void CountConnection(int node, bool local);
+	static void GetNodeStats(int node, NodeStats& outStats);
+
+private:
+	Numa();
+	~Numa();
+	Numa(const Numa& rhs);
+	Numa& operator=(const Numa& rhs);
+
+private:
+	enum
+	{
+		MAX_PROCESSORS = 64 * 64,	// 64 groups of 64.
+	};
+
+	// A cache line each, so that the threads of one node never write to the counters of another.
+	struct __declspec(align(64)) Node
+	{
+		USHORT number;			// of the system.
+		GROUP_AFFINITY affinity;
+		int numProcessors;
+		volatile LONGLONG numLocalFrees;
+		volatile LONGLONG numRemoteFrees;
+		volatile LONGLONG numLocalConnections;
+		volatile LONGLONG numRemoteConnections;
+	};
+
+	static Node sNodes[MAX_NODES];
+	static BYTE sProcessorNodes[MAX_PROCESSORS];	// by group * 64 + number.
+	static int sNumNodes;
+	static bool sEnabled;
+};
@@ -1,43 +1,200 @@
 #include "Packet.h"
-#include "CSLocker.h"
+#include "Log.h"
+#include "Numa.h"
 
-#include <boost/pool/singleton_pool.hpp>
 #include <cassert>
+#include <new>
+#include <algorithm>
+
+/* static */ FreeListPool* Packet::sPools[NUM_POOLED_CLASSES];
+/* static */ volatile long Packet::sNumDirectBlocks[NUM_SIZE_CLASSES];
+/* static */ volatile LONGLONG Packet::sNumDirectBytes[NUM_SIZE_CLASSES];
+
+
+namespace
+{
+	// Blocks of a batch take about this much, so that large classes do not keep many megabytes in each thread's cache.
+	const DWORD BATCH_BYTES = 64 * 1024;
+
+	// Memory is committed by the page, so an unpooled block takes whole pages.
+	const DWORD PAGE_BYTES = 4096;
+}
 
-/* static */ Packet::PoolType Packet::sPool;
-/* static */ CRITICAL_SECTION Packet::sPoolCS;
 
 /* static */ void Packet::Init()
 {
-	InitializeCriticalSection(&sPoolCS);
+	for (int i = 0 ; i < NUM_POOLED_CLASSES ; ++i)
+	{
+		if (sPools[i] == NULL)
+		{
+			int batchSize = static_cast<int>(std::max<DWORD>(BATCH_BYTES / GetClassSize(i), 1));
+			sPools[i] = new FreeListPool(GetClassSize(i), batchSize);
+		}
+		sPools[i]->Init();
+	}
 }
 
 /* static */ void Packet::Shutdown()
 {
-	DeleteCriticalSection(&sPoolCS);
+	for (int i = 0 ; i < NUM_POOLED_CLASSES ; ++i)
+	{
+		if (sPools[i] != NULL)
+		{
+			sPools[i]->Shutdown();
+		}
+	}
 }
 
 
 
 /* static */ Packet* Packet::Create(Client* sender, const BYTE* buff, DWORD size)
 {
-	CSLocker lock(&sPoolCS);
+	DWORD maxSegmentSize = GetClassSize(NUM_SIZE_CLASSES - 1) - sizeof(Packet);
+	if (size > GetMaxSize())
+	{
+		ERROR_MSG("Packet::Create() - %u bytes is more than the max packet size %u.", size, GetMaxSize());
+		return NULL;
+	}
 
-	Packet* packet = sPool.construct();
+	Packet* head = NULL;
+	Packet* tail = NULL;
+	DWORD offset = 0;
+	do
+	{
+		DWORD segmentSize = std::min(size - offset, maxSegmentSize);
+		Packet* segment = AllocSegment(segmentSize);
+		if (segment == NULL)
+		{
+			ERROR_MSG("Packet::Create() - no memory left for %u bytes.", size);
+			FreeChain(head);
+			return NULL;
+		}
 
-	packet->m_Sender = sender; 
-	packet->m_Size = size;
+		CopyMemory(segment->GetSegmentData(), buff + offset, segmentSize);
+		offset += segmentSize;
 
-	assert(size <= Packet::MAX_BUFF_SIZE);
-	CopyMemory(packet->m_Data, buff, size);
+		if (head == NULL)
+		{
+			head = segment;
+		}
+		else
+		{
+			tail->m_Next = segment;
+			++head->m_NumSegments;
+		}
+		tail = segment;
+	}
+	while (offset < size);
 
-	return packet;
+	head->m_Sender = sender; 
+	head->m_RefCount = 1;
+	head->m_TotalSize = size;
+
+	return head;
 }
 
 /* static */ void Packet::Destroy(Packet* packet)
 {
-	CSLocker lock(&sPoolCS);
-	sPool.destroy(packet);
+	if (InterlockedDecrement(&packet->m_RefCount) > 0)
+	{
+		return;
+	}
+
+	FreeChain(packet);
+}
+
+/* static */ DWORD Packet::GetMaxSize()
+{
+	return (GetClassSize(NUM_SIZE_CLASSES - 1) - sizeof(Packet)) * MAX_SEGMENTS;
+}
+
+/* static */ void Packet::GetClassStats(int sizeClass, ClassStats& outStats)
+{
+	assert(sizeClass >= 0 && sizeClass < NUM_SIZE_CLASSES);
+
+	outStats.blockSize = GetClassSize(sizeClass);
+	outStats.numSlabs = 0;
+	outStats.numSlabBytes = 0;
+	outStats.numDirectBlocks = sNumDirectBlocks[sizeClass];
+	outStats.numDirectBytes = sNumDirectBytes[sizeClass];
+
+	if (sizeClass < NUM_POOLED_CLASSES && sPools[sizeClass] != NULL)
+	{
+		FreeListPool::Stats stats;
+		sPools[sizeClass]->GetStats(stats);
+		outStats.numSlabs = stats.numSlabs;
+		outStats.numSlabBytes = stats.numSlabBytes;
+	}
+}
+
+
+/* static */ Packet* Packet::AllocSegment(DWORD size)
+{
+	int sizeClass = 0;
+	while (GetClassSize(sizeClass) - sizeof(Packet) < size)
+	{
+		++sizeClass;
+	}
+	assert(sizeClass < NUM_SIZE_CLASSES);
+
+	void* memory = NULL;
+	DWORD capacity = GetClassSize(sizeClass);
+	if (sizeClass < NUM_POOLED_CLASSES)
+	{
+		memory = sPools[sizeClass]->Alloc();
+	}
+	else
+	{
+		capacity = (static_cast<DWORD>(sizeof(Packet)) + size + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES;
+		memory = Numa::Alloc(capacity, Numa::GetCurrentNode());
+		if (memory != NULL)
+		{
+			InterlockedIncrement(&sNumDirectBlocks[sizeClass]);
+			InterlockedExchangeAdd64(&sNumDirectBytes[sizeClass], capacity);
+		}
+	}
+
+	if (memory == NULL)
+	{
+		return NULL;
+	}
+
+	Packet* segment = new(memory) Packet;
+
+	segment->m_Sender = NULL;
+	segment->m_Next = NULL;
+	segment->m_RefCount = 0;
+	segment->m_Size = size;
+	segment->m_TotalSize = size;
+	segment->m_Capacity = capacity;
+	segment->m_SizeClass = static_cast<WORD>(sizeClass);
+	segment->m_NumSegments = 1;
+
+	return segment;
+}
+
+/* static */ void Packet::FreeChain(Packet* packet)
+{
+	while (packet != NULL)
+	{
+		Packet* next = packet->m_Next;
+		int sizeClass = packet->m_SizeClass;
+		DWORD capacity = packet->m_Capacity;
+
+		packet->~Packet();
+		if (sizeClass < NUM_POOLED_CLASSES)
+		{
+			sPools[sizeClass]->Free(packet);
+		}
+		else
+		{
+			Numa::Free(packet);
+			InterlockedDecrement(&sNumDirectBlocks[sizeClass]);
+			InterlockedExchangeAdd64(&sNumDirectBytes[sizeClass], -static_cast<LONGLONG>(capacity));
+		}
+
+		packet = next;
+	}
 }
 
 
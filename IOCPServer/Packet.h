@@ -1,29 +1,60 @@
 #pragma once
 #include <Windows.h>
-#include <boost/pool/object_pool.hpp>
+
+#include "FreeListPool.h"
 
 // Packet class for holding sending data until I/O completion.
+// A packet is immutable once created and reference counted, so one packet can be sent to many clients.
+// The data follows the packet in a block of the smallest size class which holds both, from 64 bytes up to 4 MB.
+// Classes up to 64 KB are pooled. Larger blocks are rare enough to be committed and released on each packet,
+// so that a burst of large packets does not leave megabytes in the caches of every thread. Those take the pages their data needs,
+// not the whole class.
+// Data larger than the biggest class is split into a chain of segments, each of which is contiguous.
 
 class Client;
 class Packet
 {
-private:
+public:
 	enum
 	{
-		MAX_BUFF_SIZE = 1024,
+		MIN_CLASS_SIZE = 64,
+		NUM_SIZE_CLASSES = 17,	// doubling from MIN_CLASS_SIZE, so the biggest class is 4 MB.
+		NUM_POOLED_CLASSES = 11,	// up to 64 KB.
+		MAX_SEGMENTS = 16,		// of a chain. a packet can be sent with that many buffers.
+	};
+
+	struct ClassStats
+	{
+		DWORD blockSize;
+		long long numSlabs;
+		long long numSlabBytes;
+		long numDirectBlocks;	// in use, of the classes which are not pooled.
+		long long numDirectBytes;
 	};
 	
 public:
 	static void Init();
 	static void Shutdown();
 
+	// Create() returns a packet with one reference. Destroy() releases one and frees the packet with the last one.
+	// Create() returns NULL if the data is larger than GetMaxSize() or there is no memory left.
 	static Packet* Create(Client* sender, const BYTE* buff, DWORD size);
 	static void Destroy(Packet* packet);
 
+	static DWORD GetMaxSize();
+	static void GetClassStats(int sizeClass, ClassStats& outStats);
+
 public:
+	void AddRef() { InterlockedIncrement(&m_RefCount); }
+
 	Client* GetSender() { return m_Sender; }
-	DWORD GetSize() { return m_Size; }
-	BYTE* GetData() { return m_Data; }
+	// Of the whole chain, on the first segment.
+	DWORD GetSize() { return m_TotalSize; }
+	int GetNumSegments() { return m_NumSegments; }
+
+	Packet* GetNext() { return m_Next; }
+	DWORD GetSegmentSize() { return m_Size; }
+	BYTE* GetSegmentData() { return reinterpret_cast<BYTE*>(this + 1); }
 
 private:
 	Packet();
@@ -31,13 +62,22 @@ private:
 	Packet(const Packet& rhw);
 	Packet& operator=(const Packet& input);
 
+	static DWORD GetClassSize(int sizeClass) { return static_cast<DWORD>(MIN_CLASS_SIZE) << sizeClass; }
+	static Packet* AllocSegment(DWORD size);
+	static void FreeChain(Packet* packet);
+
 private:
 	Client* m_Sender;
+	Packet* m_Next;
+	volatile long m_RefCount;
 	DWORD m_Size;
-	BYTE m_Data[MAX_BUFF_SIZE];
+	DWORD m_TotalSize;
+	DWORD m_Capacity;		// of the block, this header included.
+	WORD m_SizeClass;
+	WORD m_NumSegments;
 
-	typedef boost::object_pool<Packet> PoolType; 
-	friend PoolType;
-	static PoolType sPool;
-	static CRITICAL_SECTION sPoolCS;
+	// Created by the first Init() and kept until the process exits, as packets in flight may outlive Shutdown().
+	static FreeListPool* sPools[NUM_POOLED_CLASSES];
+	static volatile long sNumDirectBlocks[NUM_SIZE_CLASSES];
+	static volatile LONGLONG sNumDirectBytes[NUM_SIZE_CLASSES];
 };
@@ -0,0 +1,67 @@
+#include "RecvBufferPool.h"
+#include "CSLocker.h"
+
+#include <cassert>
+
+/* static */ RecvBufferPool::BufferList RecvBufferPool::sFreeBuffers;
+/* static */ CRITICAL_SECTION RecvBufferPool::sPoolCS;
+/* static */ volatile long RecvBufferPool::sNumBuffers = 0;
+/* static */ volatile long RecvBufferPool::sNumInUse = 0;
+
+/* static */ void RecvBufferPool::Init(int initialBuffers)
+{
+	InitializeCriticalSection(&sPoolCS);
+
+	sFreeBuffers.reserve(initialBuffers);
+	for (int i = 0 ; i < initialBuffers ; ++i)
+	{
+		sFreeBuffers.push_back(new BYTE[BUFF_SIZE]);
+	}
+	sNumBuffers = initialBuffers;
+	sNumInUse = 0;
+}
+
+/* static */ void RecvBufferPool::Shutdown()
+{
+	EnterCriticalSection(&sPoolCS);
+	{
+		// Buffers still in use are owned by clients which are already destroyed at this point.
+		assert(sNumInUse == 0);
+
+		for (size_t i = 0 ; i < sFreeBuffers.size() ; ++i)
+		{
+			delete [] sFreeBuffers[i];
+		}
+		sFreeBuffers.clear();
+		sNumBuffers = 0;
+	}
+	DeleteCriticalSection(&sPoolCS);
+}
+
+
+/* static */ BYTE* RecvBufferPool::Create()
+{
+	CSLocker lock(&sPoolCS);
+
+	++sNumInUse;
+
+	if (sFreeBuffers.empty())
+	{
+		++sNumBuffers;
+		return new BYTE[BUFF_SIZE];
+	}
+
+	BYTE* buffer = sFreeBuffers.back();
+	sFreeBuffers.pop_back();
+	return buffer;
+}
+
+/* static */ void RecvBufferPool::Destroy(BYTE* buffer)
+{
+	assert(buffer);
+
+	CSLocker lock(&sPoolCS);
+
+	--sNumInUse;
+	sFreeBuffers.push_back(buffer);
+}
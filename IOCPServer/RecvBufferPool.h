@@ -0,0 +1,39 @@
+#pragma once
+#include <Windows.h>
+#include <vector>
+
+// Pool of fixed size receive buffers shared by all clients.
+// With Server::RECV_SHARED a client borrows a buffer only while it is reading from its socket.
+
+class RecvBufferPool
+{
+public:
+	enum
+	{
+		BUFF_SIZE = 256,
+	};
+
+public:
+	static void Init(int initialBuffers = 0);
+	static void Shutdown();
+
+	static BYTE* Create();
+	static void Destroy(BYTE* buffer);
+
+	static long GetNumBuffers() { return sNumBuffers; }
+	static long GetNumInUse() { return sNumInUse; }
+
+private:
+	RecvBufferPool();
+	~RecvBufferPool();
+	RecvBufferPool(const RecvBufferPool& rhs);
+	RecvBufferPool& operator=(const RecvBufferPool& rhs);
+
+private:
+	typedef std::vector<BYTE*> BufferList;
+	static BufferList sFreeBuffers;
+	static CRITICAL_SECTION sPoolCS;
+
+	static volatile long sNumBuffers;
+	static volatile long sNumInUse;
+};
@@ -1,7 +1,11 @@
+#define _CRT_RAND_S
+#include <stdlib.h>
+
 #include "Server.h"
 #include "Client.h"
 #include "Packet.h"
 #include "IOEvent.h"
+#include "RecvBufferPool.h"
 #include "CSLocker.h"
 
 #include "Log.h"
@@ -10,67 +14,290 @@
 #include <iostream>
 #include <cassert>
 #include <algorithm>
+#include <sstream>
+
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
 
 #include "EchoService.h"
 #include "TicTacToeService.h"
+#include "UpstreamPool.h"
+#include "TlsSession.h"
+#include "HotRestart.h"
+#include "Numa.h"
 
 using namespace std;
 
 
+namespace
+{
+	const DWORD TIMER_TICK = 100;	// ms. resolution of the timeouts.
+	const ULONG_PTR SHARD_MESSAGE_KEY = 1;	// completion key of a ShardMessage. sockets are associated with 0.
+
+	// Turns the NTSTATUS an OVERLAPPED holds into the Win32 error the thread pool reports for the same failure.
+	// It is only in ntdll.lib of the newer SDKs, so it is looked up rather than linked.
+	typedef ULONG (WINAPI *RtlNtStatusToDosErrorFunc)(LONG status);
+	const RtlNtStatusToDosErrorFunc s_RtlNtStatusToDosError = 
+		reinterpret_cast<RtlNtStatusToDosErrorFunc>(GetProcAddress(GetModuleHandleA("ntdll.dll"), "RtlNtStatusToDosError"));
+
+	// The index-th active processor of the system, counting around over all processor groups.
+	GROUP_AFFINITY GetProcessorAffinity(int index)
+	{
+		GROUP_AFFINITY affinity;
+		ZeroMemory(&affinity, sizeof(affinity));
+
+		DWORD numProcessors = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+		DWORD skip = numProcessors > 0 ? static_cast<DWORD>(index) % numProcessors : 0;
+
+		WORD numGroups = GetActiveProcessorGroupCount();
+		for(WORD group = 0 ; group < numGroups ; ++group)
+		{
+			DWORD count = GetActiveProcessorCount(group);
+			if(skip < count)
+			{
+				affinity.Group = group;
+				affinity.Mask = static_cast<KAFFINITY>(1) << skip;
+				break;
+			}
+			skip -= count;
+		}
+		return affinity;
+	}
+
+	// The inverse of GetProcessorAffinity(). e.g. the processor RSS has delivered a connection on.
+	int GetProcessorIndex(const PROCESSOR_NUMBER& processor)
+	{
+		int index = processor.Number;
+		for(WORD group = 0 ; group < processor.Group ; ++group)
+		{
+			index += static_cast<int>(GetActiveProcessorCount(group));
+		}
+		return index;
+	}
+
+	// Of the lowest processor of the affinity. -1 for an empty one.
+	int GetProcessorIndex(const GROUP_AFFINITY& affinity)
+	{
+		for(BYTE bit = 0 ; bit < sizeof(KAFFINITY) * 8 ; ++bit)
+		{
+			if((affinity.Mask & (static_cast<KAFFINITY>(1) << bit)) != 0)
+			{
+				PROCESSOR_NUMBER processor;
+				ZeroMemory(&processor, sizeof(processor));
+				processor.Group = affinity.Group;
+				processor.Number = bit;
+				return GetProcessorIndex(processor);
+			}
+		}
+		return -1;
+	}
+}
+
+
+// A posted WSARecvFrom() with its buffer and source address, which have to live until it completes.
+struct Server::DatagramSlot
+{
+	DatagramSocket* owner;
+	BYTE buffer[DATAGRAM_HEADER_SIZE + Client::MAX_DATA_SIZE];
+	sockaddr_storage from;
+	int fromLength;
+	DWORD flags;
+};
+
+
+// Work for a shard in shared-nothing mode, which is all that crosses shards.
+// It is posted to the completion port of the shard, so the one thread of the shard handles it in turn with its completions.
+// MATCH and SERVICE_DATA hold a reference to the client, REMOVE_CLIENT and SERVICE_REMOVE the ones RemoveClient() drops.
+// ADD_CLIENT needs none, as the removal of the client comes through the same port after it.
+struct Server::ShardMessage
+{
+	enum Type
+	{
+		ADD_CLIENT,		// the client has been accepted by another thread.
+		REMOVE_CLIENT,	// the client has left.
+		SERVICE_REMOVE,	// the client has left its own shard, so it leaves its games on this one.
+		SERVICE_DATA,	// a message the client has sent to its games on this shard.
+		MATCH,			// the client looks for a game. passed on from shard to shard until one takes it in.
+		BROADCAST,		// holds a reference to the packet.
+	};
+
+	ShardMessage(Type type_, Client* client_) : type(type_), client(client_), packet(NULL), origin(0) {}
+
+	Type type;
+	Client* client;
+	Packet* packet;
+	int origin;			// MATCH. the shard of the client.
+	std::string data;	// SERVICE_DATA. the message as the client has sent it.
+};
+
+
 //---------------------------------------------------------------------------------//
 //---------------------------------------------------------------------------------//
-/* static */ void CALLBACK Server::IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */, PVOID /* Context */,
+/* static */ void CALLBACK Server::IoCompletionCallback(PTP_CALLBACK_INSTANCE Instance, PVOID /* Context */,
 														PVOID Overlapped, ULONG IoResult, ULONG_PTR NumberOfBytesTransferred, PTP_IO /* Io */)
 {
 	IOEvent* event = CONTAINING_RECORD(Overlapped, IOEvent, GetOverlapped());
 	assert(event);
 
-	if(IoResult != ERROR_SUCCESS)
-	{
-		ERROR_CODE(IoResult, "I/O operation failed. type[%d]", event->GetType());
+	InterlockedIncrement64(&Server::Instance()->m_NumCompletions);
+
+	// OnCompletion() destroys the event, so keep the client for releasing the I/O reference.
+	Client* client = event->GetClient();
+
+	Server::Instance()->OnCompletion(event, IoResult, static_cast<DWORD>(NumberOfBytesTransferred));
 
-		Server::Instance()->OnClose(event);
+	if(client != NULL && client->Release() == 0)
+	{
+		// Destroying the client waits for the callbacks of its I/O, which this one may be.
+		DisassociateCurrentThreadFromCallback(Instance);
+		Client::Destroy(client);
 	}
-	else
-	{	
-		switch(event->GetType())
+}
+
+
+/* static */ DWORD WINAPI Server::IOThreadMain(LPVOID param)
+{
+	IOShard* shard = static_cast<IOShard*>(param);
+	assert(shard);
+
+	Server* server = Server::Instance();
+	assert(server);
+
+	LOG("[%d] I/O thread started.", GetCurrentThreadId());
+
+	const ULONG batchSize = static_cast<ULONG>(server->m_Config.completionBatchSize);
+	std::vector<OVERLAPPED_ENTRY> entries(batchSize);
+
+	// With timeouts, wake up at least every tick to move the timer wheel on. A shard of its own checks its clients as often.
+	const DWORD waitTime = shard->timers != NULL || server->m_Config.sharedNothing ? TIMER_TICK : INFINITE;
+
+	// Busy polling trades a core for never being put to sleep and woken up between messages.
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	const LONGLONG spinCounts = server->m_Config.busyPollSpin * frequency.QuadPart / 1000000;
+	LONGLONG spinUntil = 0;
+
+	bool quit = false;
+	while(!quit)
+	{
+		ULONG numEntries = 0;
+
+		// Poll without waiting until the port has been quiet for the spin budget, then block as usual.
+		DWORD timeout = waitTime;
+		LARGE_INTEGER now;
+		if(spinCounts > 0)
 		{
-		case IOEvent::ACCEPT:	
-			Server::Instance()->OnAccept(event);
+			QueryPerformanceCounter(&now);
+			if(now.QuadPart < spinUntil)
+			{
+				timeout = 0;
+			}
+		}
+
+		// Reap as many completions as are ready with a single call instead of one call per completion.
+		if(FALSE == GetQueuedCompletionStatusEx(shard->completionPort, &entries[0], batchSize, &numEntries, timeout, FALSE))
+		{
+			if(GetLastError() == WAIT_TIMEOUT)
+			{
+				if(timeout == 0)
+				{
+					YieldProcessor();
+				}
+
+				if(shard->timers != NULL)
+				{
+					server->AdvanceTimers(shard->timers);
+				}
+				if(server->m_Config.sharedNothing)
+				{
+					server->UpdateShard(shard);
+				}
+				continue;
+			}
+
+			ERROR_CODE(GetLastError(), "GetQueuedCompletionStatusEx() failed.");
 			break;
+		}
 
-		case IOEvent::RECV:		
-			if(NumberOfBytesTransferred > 0)
+		if(spinCounts > 0)
+		{
+			QueryPerformanceCounter(&now);
+			spinUntil = now.QuadPart + spinCounts;
+		}
+
+		InterlockedIncrement64(&server->m_NumDequeueCalls);
+		InterlockedExchangeAdd64(&server->m_NumCompletions, numEntries);
+		InterlockedExchangeAdd64(&shard->numCompletions, numEntries);
+
+		for(ULONG i = 0 ; i < numEntries ; ++i)
+		{
+			if(entries[i].lpCompletionKey == SHARD_MESSAGE_KEY)
 			{
-				Server::Instance()->OnRecv(event, NumberOfBytesTransferred);
+				server->OnShardMessage(shard, reinterpret_cast<ShardMessage*>(entries[i].lpOverlapped));
+				continue;
 			}
-			else
+
+			// A NULL overlapped is the quit signal posted by Shutdown(). Finish the batch first.
+			if(entries[i].lpOverlapped == NULL)
 			{
-				Server::Instance()->OnClose(event);
+				quit = true;
+				continue;
 			}
-			break;
 
-		case IOEvent::SEND:
-			Server::Instance()->OnSend(event, NumberOfBytesTransferred);
-			break;
+			IOEvent* event = CONTAINING_RECORD(entries[i].lpOverlapped, IOEvent, GetOverlapped());
+			assert(event);
 
-		default: assert(false); break;
+			// Internal holds the NTSTATUS of the operation. Negative values are failures.
+			LONG status = static_cast<LONG>(entries[i].lpOverlapped->Internal);
+			ULONG ioResult = ERROR_SUCCESS;
+			if(status < 0)
+			{
+				ioResult = s_RtlNtStatusToDosError != NULL ? s_RtlNtStatusToDosError(status) : static_cast<ULONG>(status);
+			}
+
+			// OnCompletion() destroys the event, so keep the client for releasing the I/O reference.
+			Client* client = event->GetClient();
+
+			server->OnCompletion(event, ioResult, entries[i].dwNumberOfBytesTransferred);
+
+			// Datagram I/O has no client to release.
+			if(client != NULL)
+			{
+				server->EndIO(client);
+			}
+		}
+
+		if(shard->timers != NULL)
+		{
+			server->AdvanceTimers(shard->timers);
+		}
+		if(server->m_Config.sharedNothing)
+		{
+			server->UpdateShard(shard);
 		}
 	}
 
-	IOEvent::Destroy(event);
+	LOG("[%d] I/O thread stopped.", GetCurrentThreadId());
+
+	return 0;
 }
 
 
-void CALLBACK Server::WorkerPostAccept(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_WORK /* Work */)
+void CALLBACK Server::WorkerRetryAccept(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_TIMER /* Timer */)
 {
 	Server* server = static_cast<Server*>(Context);
 	assert(server);
 
-	while(!server->m_ShuttingDown)
-	{
-		server->PostAccept();
-	}
+	server->PostAccept();
+}
+
+
+void CALLBACK Server::WorkerTimers(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_TIMER /* Timer */)
+{
+	Server* server = static_cast<Server*>(Context);
+	assert(server);
+
+	server->AdvanceTimers(server->m_Timers[0]);
 }
 
 
@@ -107,13 +334,29 @@ void CALLBACK Server::WorkerRemoveClient(PTP_CALLBACK_INSTANCE /* Instance */, P
 //---------------------------------------------------------------------------------//
 //---------------------------------------------------------------------------------//
 Server::Server(void)
-: m_ListenTPIO(NULL),
-  m_AcceptTPWORK(NULL),
-  m_listenSocket(INVALID_SOCKET),
+: m_AcceptRetryTPTIMER(NULL),
+  m_Port(0),
+  m_HandedOff(0),
   m_MaxPostAccept(0),
-  m_NumPostAccept(0),
+  m_NumAccepts(0),
   m_ServiceTPWORK(NULL),
   m_ClientTPCLEAN(NULL),
+  m_NumCommonShards(1),
+  m_NextShard(0),
+  m_NumIOCalls(0),
+  m_NumDequeueCalls(0),
+  m_NumCompletions(0),
+  m_NumSendCalls(0),
+  m_NumSentPackets(0),
+  m_NumZeroCopySends(0),
+  m_NumZeroCopyBytes(0),
+  m_NumDatagramsReceived(0),
+  m_NumDatagramsSent(0),
+  m_NumDatagramsDropped(0),
+  m_TimersTPTIMER(NULL),
+  m_NumTimeouts(0),
+  m_NumBlockedSends(0),
+  m_NumBlockedDrops(0),
   m_ShuttingDown(true)
 {
 }
@@ -124,17 +367,66 @@ Server::~Server(void)
 }
 
 
-bool Server::Init(unsigned short port, int maxPostAccept)
+bool Server::Init(unsigned short port, int maxPostAccept, const Config& config)
 {	
 	assert(maxPostAccept > 0);
+	assert(config.numIOThreads >= 0);
+	assert(config.completionBatchSize > 0);
+	assert(config.sendHighWatermark == 0 || config.sendLowWatermark < config.sendHighWatermark);
+	assert(config.recvBacklogLimit == 0 || config.recvBacklogLimit >= Client::MAX_DATA_SIZE);
+	assert(config.datagramPort == 0 || config.datagramRecvDepth > 0);
+
+	m_Config = config;
+
+	// The thread pool can't be told to spin, so busy polling needs our own I/O threads.
+	if(m_Config.busyPollSpin > 0 && m_Config.backend != IO_THREADS)
+	{
+		ERROR_MSG("Busy polling needs the IO_THREADS backend.");
+		return false;
+	}
+
+	// A shard owns its clients and games only if a thread of ours runs it and nothing else does.
+	if(m_Config.sharedNothing && m_Config.backend != IO_THREADS)
+	{
+		ERROR_MSG("Shared-nothing mode needs the IO_THREADS backend.");
+		return false;
+	}
+
+	// Thread pool threads run on any node, so only our own threads can be kept on the node of their memory.
+	if(m_Config.numaAware && m_Config.backend != IO_THREADS)
+	{
+		ERROR_MSG("NUMA-aware shards need the IO_THREADS backend.");
+		return false;
+	}
+
+	// Both place the I/O threads, so they can't be given together.
+	if(m_Config.numaAware && !m_Config.ioCores.empty())
+	{
+		ERROR_MSG("NUMA-aware shards place their threads on their nodes. Give either cores or numa, not both.");
+		return false;
+	}
 
-	Client::Init();
+	// The pools take their memory from the nodes, so the nodes come first.
+	if(!Numa::Init(m_Config.numaAware))
+	{
+		return false;
+	}
+
+	// Every pending accept holds a client and a receive buffer, so have those ready before the first accept.
+	int warmClients = config.warmClients > 0 ? config.warmClients : maxPostAccept * 2;
+	RecvBufferPool::Init(warmClients);
+	Client::Init(warmClients);
+	if(!TlsSession::Init(config.tlsCertificate))
+	{
+		return false;
+	}
 	IOEvent::Init();
 	Packet::Init();
 
 	// Create Service
 	EchoService::Init();
 	TicTacToeService::Init();
+	UpstreamPool::Init();
 	InitializeCriticalSection(&m_CSForServices);
 	m_ServiceTPWORK = CreateThreadpoolWork(Server::WorkerServiceUpdate, this, NULL);
 	if(m_ServiceTPWORK == NULL)
@@ -154,66 +446,113 @@ bool Server::Init(unsigned short port, int maxPostAccept)
 	}
 	SetThreadpoolCallbackCleanupGroup(&m_ClientTPENV, m_ClientTPCLEAN, NULL);
 
-	// Create Listen Socket
+	// Create Listen Sockets. On a restart, they are the ones of the running server in the order it created them.
 	m_MaxPostAccept = maxPostAccept;
-	m_listenSocket = Network::CreateSocket(true, port);
-	if(m_listenSocket == INVALID_SOCKET)
+	m_Port = port;
+	if(m_Config.takeOver && !HotRestart::Receive(HotRestart::GetPipeName(port), m_InheritedSockets))
 	{
+		Destroy();
 		return false;
 	}
 
-	// Make the address re-usable to re-run the same server instantly.
-	bool reuseAddr = true;
-	if(setsockopt(m_listenSocket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuseAddr), sizeof(reuseAddr)) == SOCKET_ERROR)
+	int family = m_Config.dualStack ? AF_INET6 : AF_INET;
+	if(!CreateTcpListener(NULL, port, family, m_Config.dualStack, 0, *m_Config.socketProfile))
 	{
-		ERROR_CODE(WSAGetLastError(), "setsockopt() failed with SO_REUSEADDR.");
 		Destroy();
 		return false;
 	}
 
-	// We will use AcceptEx() so we need to enalbe conditional accpet to avoid listen() accepts a connection which shuold be completed by normal 'accept()' func.
-	bool conditionalAccept = true;
-	if( setsockopt(m_listenSocket, SOL_SOCKET, SO_CONDITIONAL_ACCEPT, reinterpret_cast<const char*>(&conditionalAccept), sizeof(conditionalAccept)) == SOCKET_ERROR )
+	for(size_t i = 0 ; i < m_Config.listenAddresses.size() ; ++i)
+	{
+		const ListenAddress& address = m_Config.listenAddresses[i];
+		const Network::SocketProfile* profile = address.socketProfile != NULL ? address.socketProfile : m_Config.socketProfile;
+		if(!CreateTcpListener(address.host.c_str(), address.port, AF_UNSPEC, true, address.numShards, *profile))
+		{
+			Destroy();
+			return false;
+		}
+	}
+
+	if(!m_Config.unixPath.empty() && !CreateUnixListener(m_Config.unixPath))
 	{
-		ERROR_CODE(WSAGetLastError(), "setsockopt() failed with SO_CONDITIONAL_ACCEPT.");
 		Destroy();
 		return false;
 	}
 
-	// Create & Start ThreaddPool for socket IO
-	m_ListenTPIO = CreateThreadpoolIo(reinterpret_cast<HANDLE>(m_listenSocket), Server::IoCompletionCallback, NULL, NULL);
-	if( m_ListenTPIO == NULL )
+	if(!m_InheritedSockets.empty())
 	{
-		ERROR_CODE(WSAGetLastError(), "Could not assign the listen socket to the IOCP handle.");
+		ERROR_MSG("The running server has more listeners than configured. Run the new server with the same listen options.");
 		Destroy();
 		return false;
 	}
 
-	// Start listening
-	StartThreadpoolIo( m_ListenTPIO );
-	if(listen(m_listenSocket, SOMAXCONN) == SOCKET_ERROR)
+	// Create our own completion ports and I/O threads if the thread pool is not used.
+	if(m_Config.backend == IO_THREADS && !CreateShards())
 	{
-		ERROR_CODE(WSAGetLastError(), "listen() failed.");
 		return false;
 	}
 
+	// The thread pool has no threads of ours to tick the timer wheel, so a thread pool timer does.
+	if(m_Config.backend == THREAD_POOL && HasTimeouts())
+	{
+		CreateTimers();
+
+		m_TimersTPTIMER = CreateThreadpoolTimer(Server::WorkerTimers, this, NULL);
+		if(m_TimersTPTIMER == NULL)
+		{
+			ERROR_CODE(GetLastError(), "Could not create the timer for timeouts.");
+			Destroy();
+			return false;
+		}
+
+		LONGLONG dueTime = -static_cast<LONGLONG>(TIMER_TICK) * 10000LL; // relative in 100ns units.
+		FILETIME fileTime;
+		fileTime.dwLowDateTime = static_cast<DWORD>(dueTime & 0xFFFFFFFF);
+		fileTime.dwHighDateTime = static_cast<DWORD>(dueTime >> 32);
+		SetThreadpoolTimer(m_TimersTPTIMER, &fileTime, TIMER_TICK, TIMER_TICK / 2);
+	}
+
+	for(ListenerList::iterator itor = m_Listeners.begin() ; itor != m_Listeners.end() ; ++itor)
+	{
+		if(!StartListener(*itor))
+		{
+			Destroy();
+			return false;
+		}
+	}
+
 	// Create critical sections for m_Clients
 	InitializeCriticalSection(&m_CSForClients);
 
-	// Create Accept worker
-	m_AcceptTPWORK = CreateThreadpoolWork(Server::WorkerPostAccept, this, NULL);
-	if(m_AcceptTPWORK == NULL)
+	// Datagram sockets need the shards to be associated with.
+	InitializeCriticalSection(&m_CSForDatagramSessions);
+	if(m_Config.datagramPort != 0 && !CreateDatagramSockets())
+	{
+		Destroy();
+		return false;
+	}
+
+	// Create the timer for re-posting accepts when a client could not be created.
+	// Otherwise accepts are re-posted by their own completions, so no thread is dedicated to accepting.
+	m_AcceptRetryTPTIMER = CreateThreadpoolTimer(Server::WorkerRetryAccept, this, NULL);
+	if(m_AcceptRetryTPTIMER == NULL)
 	{
-		ERROR_CODE(GetLastError(), "Could not create AcceptEx worker TPIO.");
+		ERROR_CODE(GetLastError(), "Could not create AcceptEx retry timer.");
 		Destroy();
 		return false;
 	}	
 
 	m_ShuttingDown = false;
 
-	SubmitThreadpoolWork(m_AcceptTPWORK);
+	PostAccept();
 	SubmitThreadpoolWork(m_ServiceTPWORK);	
 
+	// The previous server stops accepting only now, so that connections never go unaccepted.
+	if(m_Config.takeOver)
+	{
+		HotRestart::Acknowledge();
+	}
+
 	return true;
 }
 
@@ -222,26 +561,21 @@ void Server::Shutdown()
 {
 	m_ShuttingDown = true;
 
-	if( m_AcceptTPWORK != NULL )
+	if( m_AcceptRetryTPTIMER != NULL )
 	{
-		WaitForThreadpoolWorkCallbacks( m_AcceptTPWORK, true );
-		CloseThreadpoolWork( m_AcceptTPWORK );
-		m_AcceptTPWORK = NULL;
+		SetThreadpoolTimer( m_AcceptRetryTPTIMER, NULL, 0, 0 );
+		WaitForThreadpoolTimerCallbacks( m_AcceptRetryTPTIMER, true );
+		CloseThreadpoolTimer( m_AcceptRetryTPTIMER );
+		m_AcceptRetryTPTIMER = NULL;
 	}
 
-	if( m_listenSocket != INVALID_SOCKET )
-	{
-		Network::CloseSocket(m_listenSocket);
-		CancelIoEx(reinterpret_cast<HANDLE>(m_listenSocket), NULL);
-		m_listenSocket = INVALID_SOCKET;
-	}
+	CloseListeners();
 
-	if( m_ListenTPIO != NULL )
-	{
-		WaitForThreadpoolIoCallbacks( m_ListenTPIO, true );
-		CloseThreadpoolIo( m_ListenTPIO );
-		m_ListenTPIO = NULL;
-	}
+	// Stop I/O threads before destroying clients so that no completion touches a destroyed client.
+	StopShards();
+	StopTimers();
+
+	DestroyDatagramSockets();
 
 	if (m_ClientTPCLEAN != NULL)
 	{
@@ -260,6 +594,17 @@ void Server::Shutdown()
 		m_Clients.clear();
 	}
 
+	// In shared-nothing mode, clients are on the lists of their shards instead.
+	for(ShardList::iterator itor = m_Shards.begin() ; itor != m_Shards.end() ; ++itor)
+	{
+		IOShard* shard = *itor;
+		for(ClientList::iterator client = shard->clients.begin() ; client != shard->clients.end() ; ++client)
+		{
+			Client::Destroy(*client);
+		}
+		shard->clients.clear();
+	}
+
 	if (m_ServiceTPWORK != NULL)
 	{
 		WaitForThreadpoolWorkCallbacks( m_ServiceTPWORK, true );
@@ -271,344 +616,2366 @@ void Server::Shutdown()
 		CSLocker lock(&m_CSForServices);
 		EchoService::Shutdown();
 		TicTacToeService::Shutdown();
+		for(ShardList::iterator itor = m_Shards.begin() ; itor != m_Shards.end() ; ++itor)
+		{
+			TicTacToeService::Shutdown((*itor)->games);
+		}
+		UpstreamPool::Shutdown();
 	}
 
+	DestroyTimers();
+
 	DeleteCriticalSection(&m_CSForServices);
 	DeleteCriticalSection(&m_CSForClients);
+	DeleteCriticalSection(&m_CSForDatagramSessions);
 
-	Packet::Shutdown();
-	IOEvent::Shutdown();
+	DestroyShards();
+
+	for(ListenerList::iterator itor = m_Listeners.begin() ; itor != m_Listeners.end() ; ++itor)
+	{
+		delete *itor;
+	}
+	m_Listeners.clear();
+
+	// Clients destroy their queued packets and return their buffers, so they go first.
 	Client::Shutdown();
+	TlsSession::Shutdown();
+	IOEvent::Shutdown();
+	Packet::Shutdown();
+	RecvBufferPool::Shutdown();
 }
 
 
-void Server::PostAccept()
+bool Server::CreateTcpListener(const char* host, u_short port, int family, bool dualStack, int numShards, const Network::SocketProfile& profile)
 {
-	// If the number of clients is too big, we can just stop posting aceept.
-	// That's one of the benefits from AcceptEx.
-	int count = m_MaxPostAccept - m_NumPostAccept;
-	if( count > 0 )
+	bool inherited = m_Config.takeOver;
+	SOCKET socket = inherited ? TakeInheritedSocket() : Network::CreateSocket(true, port, family, host, dualStack);
+	if(socket == INVALID_SOCKET)
 	{
-		int i = 0;
-		for(  ; i < count ; ++i )
-		{
-			Client* client = Client::Create();			
-			if( !client )
-			{
-				break;
-			}
-
-			IOEvent* event = IOEvent::Create(IOEvent::ACCEPT, client);
-			assert(event);
+		return false;
+	}
 
-			StartThreadpoolIo( m_ListenTPIO );
-			if ( FALSE == Network::AcceptEx(m_listenSocket, client->GetSocket(), &event->GetOverlapped()))
-			{
-				int error = WSAGetLastError();
+	Listener* listener = new Listener;
+	listener->index = static_cast<int>(m_Listeners.size());
+	listener->profile = &profile;
+	listener->socket = socket;
+	listener->tpio = NULL;
+	listener->addressSize = Network::ACCEPTEX_ADDRESS_SIZE;
+	listener->numPostAccept = 0;
+	listener->numDedicatedShards = numShards;
+	listener->firstShard = 0;
+	listener->numShards = 1;
+	m_Listeners.push_back(listener);
+
+	// Sockets accepted on it have to be of the family it has been bound to.
+	listener->family = Network::GetAddressFamily(socket);
+	if(listener->family == AF_UNSPEC)
+	{
+		return false;
+	}
 
-				if(error != ERROR_IO_PENDING)
-				{
-					CancelThreadpoolIo( m_ListenTPIO );
+	std::stringstream name;
+	name << "tcp:";
+	if(host != NULL)
+	{
+		name << "[" << host << "]:";
+	}
+	else if(listener->family == AF_INET6)
+	{
+		name << "[::]:";
+	}
+	name << port << "/" << profile.name;
+	listener->name = name.str();
 
-					ERROR_CODE(error, "AcceptEx() failed.");
-					Client::Destroy(client);
-					IOEvent::Destroy(event);
-					break;
-				}
-			}
-			else
-			{
-				OnAccept(event);
-				IOEvent::Destroy(event);
-			}
-		}
+	// A handed over socket is already set up and bound.
+	if(inherited)
+	{
+		return true;
+	}
 
-		InterlockedExchangeAdd(&m_NumPostAccept, i);	
+	// Make the address re-usable to re-run the same server instantly.
+	bool reuseAddr = true;
+	if(setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuseAddr), sizeof(reuseAddr)) == SOCKET_ERROR)
+	{
+		ERROR_CODE(WSAGetLastError(), "setsockopt() failed with SO_REUSEADDR.");
+		return false;
+	}
 
-		LOG("[%d] Post AcceptEx : %d", GetCurrentThreadId(), m_NumPostAccept);
+	// We will use AcceptEx() so we need to enalbe conditional accpet to avoid listen() accepts a connection which shuold be completed by normal 'accept()' func.
+	bool conditionalAccept = true;
+	if( setsockopt(socket, SOL_SOCKET, SO_CONDITIONAL_ACCEPT, reinterpret_cast<const char*>(&conditionalAccept), sizeof(conditionalAccept)) == SOCKET_ERROR )
+	{
+		ERROR_CODE(WSAGetLastError(), "setsockopt() failed with SO_CONDITIONAL_ACCEPT.");
+		return false;
 	}
+
+	return Network::ApplySocketProfile(socket, profile, true);
 }
 
 
-void Server::PostRecv(Client* client)
+bool Server::CreateUnixListener(const std::string& path)
 {
-	assert(client);
-
-	if (client->GetState() != Client::ACCEPTED)
+	// Co-located processes skip the whole TCP stack. The socket profile is TCP only, so it does not apply here.
+	// A handed over socket must not be re-created, as that would delete the path the running server is bound to.
+	SOCKET socket = m_Config.takeOver ? TakeInheritedSocket() : Network::CreateUnixSocket(path);
+	if(socket == INVALID_SOCKET)
 	{
-		return;
+		return false;
 	}
 
-	WSABUF recvBufferDescriptor;
-	recvBufferDescriptor.buf = reinterpret_cast<char*>(client->GetRecvCallBuff());
-	recvBufferDescriptor.len = Client::MAX_DATA_SIZE;
-
-	DWORD numberOfBytes = 0;
-	DWORD recvFlags = 0;
+	Listener* listener = new Listener;
+	listener->index = static_cast<int>(m_Listeners.size());
+	listener->family = AF_UNIX;
+	listener->name = "unix:" + path;
+	listener->profile = NULL;
+	listener->socket = socket;
+	listener->tpio = NULL;
+	listener->addressSize = Network::ACCEPTEX_UNIX_ADDRESS_SIZE;
+	listener->numPostAccept = 0;
+	listener->numDedicatedShards = 0;
+	listener->firstShard = 0;
+	listener->numShards = 1;
+	m_Listeners.push_back(listener);
 
-	IOEvent* event = IOEvent::Create(IOEvent::RECV, client);
-	assert(event);
+	return true;
+}
 
-	StartThreadpoolIo(client->GetTPIO());
 
-	if(WSARecv(client->GetSocket(), &recvBufferDescriptor, 1, &numberOfBytes, &recvFlags, &event->GetOverlapped(), NULL) == SOCKET_ERROR)
+SOCKET Server::TakeInheritedSocket()
+{
+	if(m_InheritedSockets.empty())
 	{
-		int error = WSAGetLastError();
+		ERROR_MSG("The running server has fewer listeners than configured. Run the new server with the same listen options.");
+		return INVALID_SOCKET;
+	}
 
-		if(error != ERROR_IO_PENDING)
-		{
-			CancelThreadpoolIo(client->GetTPIO());
+	SOCKET socket = m_InheritedSockets.front();
+	m_InheritedSockets.erase(m_InheritedSockets.begin());
+	return socket;
+}
 
-			ERROR_CODE(error, "WSARecv() failed.");
-			
-			OnClose(event);
-			IOEvent::Destroy(event);
-		}
-	}
+
+bool Server::StartListener(Listener* listener)
+{
+	assert(listener);
+
+	// Create & Start ThreaddPool for socket IO
+	if(!AssociateIO(listener->socket, 0, &listener->tpio))
+	{
+		ERROR_CODE(WSAGetLastError(), "Could not assign the listen socket to the IOCP handle. listener[%s]", listener->name.c_str());
+		return false;
+	}
+
+	// Start listening
+	int backlog = listener->profile == NULL ? SOMAXCONN : listener->profile->backlog;
+	if(listen(listener->socket, backlog) == SOCKET_ERROR)
+	{
+		ERROR_CODE(WSAGetLastError(), "listen() failed. listener[%s]", listener->name.c_str());
+		return false;
+	}
+
+	// The accepts of the listener take clients with sockets of its family.
+	Client::KeepWarm(listener->family);
+
+	LOG("Listening on %s", listener->name.c_str());
+
+	return true;
+}
+
+
+void Server::CloseListeners()
+{
+	for(ListenerList::iterator itor = m_Listeners.begin() ; itor != m_Listeners.end() ; ++itor)
+	{
+		Listener* listener = *itor;
+
+		if( listener->socket != INVALID_SOCKET )
+		{
+			Network::CloseSocket(listener->socket);
+			CancelIoEx(reinterpret_cast<HANDLE>(listener->socket), NULL);
+			listener->socket = INVALID_SOCKET;
+		}
+
+		if( listener->tpio != NULL )
+		{
+			WaitForThreadpoolIoCallbacks( listener->tpio, true );
+			CloseThreadpoolIo( listener->tpio );
+			listener->tpio = NULL;
+		}
+	}
+
+	// Clients keep the index of their listener only, so the listeners themselves stay until the server goes.
+
+	for(size_t i = 0 ; i < m_InheritedSockets.size() ; ++i)
+	{
+		Network::CloseSocket(m_InheritedSockets[i]);
+	}
+	m_InheritedSockets.clear();
+}
+
+
+bool Server::HandOff()
+{
+	if(m_HandedOff || m_Listeners.empty())
+	{
+		return false;
+	}
+
+	std::vector<SOCKET> sockets;
+	for(ListenerList::iterator itor = m_Listeners.begin() ; itor != m_Listeners.end() ; ++itor)
+	{
+		sockets.push_back((*itor)->socket);
+	}
+
+	if(!HotRestart::Send(HotRestart::GetPipeName(m_Port), sockets))
+	{
+		return false;
+	}
+
+	// Stop accepting. Our handles stay open until Shutdown(), since an accept completing right now still needs its listener's socket.
+	// Cancelling our accepts leaves the connections in the backlog to the accepts of the new server.
+	// Accepts which already hold a connection waiting for its first data are left to complete, as cancelling them would reset it.
+	// No accept is posted once the flag is set, as PostAcceptOne() checks it under the same lock.
+	InterlockedExchange(&m_HandedOff, 1);
+	for(ListenerList::iterator itor = m_Listeners.begin() ; itor != m_Listeners.end() ; ++itor)
+	{
+		Listener* listener = *itor;
+		CSLocker lock(&listener->cs);
+
+		for(std::set<IOEvent*>::iterator event = listener->pendingAccepts.begin() ; event != listener->pendingAccepts.end() ; ++event)
+		{
+			// SO_CONNECT_TIME is 0xFFFFFFFF while the accept is still waiting for a connection.
+			DWORD seconds = 0xFFFFFFFF;
+			int size = sizeof(seconds);
+			getsockopt((*event)->GetClient()->GetSocket(), SOL_SOCKET, SO_CONNECT_TIME, reinterpret_cast<char*>(&seconds), &size);
+
+			if(seconds == 0xFFFFFFFF)
+			{
+				CancelIoEx(reinterpret_cast<HANDLE>(listener->socket), &(*event)->GetOverlapped());
+			}
+		}
+	}
+
+	LOG("Handed the listeners over. Draining %Iu clients.", GetNumClients());
+
+	return true;
+}
+
+
+void Server::PostAccept()
+{
+	for(ListenerList::iterator itor = m_Listeners.begin() ; itor != m_Listeners.end() ; ++itor)
+	{
+		PostAccept(*itor);
+	}
+}
+
+
+void Server::PostAccept(Listener* listener)
+{
+	assert(listener);
+
+	// If the number of clients is too big, we can just stop posting aceept.
+	// That's one of the benefits from AcceptEx.
+	// This is called from accept completions concurrently, so reserve a slot before posting to never exceed m_MaxPostAccept.
+	int count = 0;
+	while(!m_ShuttingDown && !m_HandedOff)
+	{
+		if(InterlockedIncrement(&listener->numPostAccept) > m_MaxPostAccept)
+		{
+			InterlockedDecrement(&listener->numPostAccept);
+			break;
+		}
+
+		if(!PostAcceptOne(listener))
+		{
+			InterlockedDecrement(&listener->numPostAccept);
+
+			if(m_HandedOff)
+			{
+				break;
+			}
+
+			// Try again a bit later rather than spinning. Completions of the accepts still posted will also top it up.
+			LONGLONG dueTime = -100 * 10000LL; // 100ms, relative in 100ns units.
+			FILETIME fileTime;
+			fileTime.dwLowDateTime = static_cast<DWORD>(dueTime & 0xFFFFFFFF);
+			fileTime.dwHighDateTime = static_cast<DWORD>(dueTime >> 32);
+			SetThreadpoolTimer(m_AcceptRetryTPTIMER, &fileTime, 0, 0);
+			break;
+		}
+
+		++count;
+	}
+
+	if(count > 0)
+	{
+		LOG("[%d] Post AcceptEx : %d, listener[%s]", GetCurrentThreadId(), listener->numPostAccept, listener->name.c_str());
+	}
+}
+
+
+bool Server::PostAcceptOne(Listener* listener)
+{
+	assert(listener);
+
+	Client* client = Client::Create(listener->family);			
+	if( !client )
+	{
+		return false;
+	}
+
+	client->SetListener(listener->index);
+
+	// Each accept has its own buffer for the addresses, preceded by the first data with ACCEPT_WITH_DATA.
+	client->SetRecvCallBuff(RecvBufferPool::Create());
+	DWORD receiveDataLength = 0;
+	if(m_Config.acceptMode == ACCEPT_WITH_DATA)
+	{
+		receiveDataLength = RecvBufferPool::BUFF_SIZE - listener->addressSize * 2;
+	}
+
+	IOEvent* event = IOEvent::Create(IOEvent::ACCEPT, client);
+	assert(event);
+
+	// Armed before posting, since the accept may complete before AcceptEx() returns.
+	if(m_Config.acceptMode == ACCEPT_WITH_DATA)
+	{
+		ArmAcceptTimeout(client, &event->GetOverlapped());
+	}
+
+	CSLocker lock(&listener->cs);
+
+	if(m_HandedOff)
+	{
+		CancelTimeout(client);
+		Client::Destroy(client);
+		IOEvent::Destroy(event);
+		return false;
+	}
+
+	StartIO(client, listener->tpio);
+	InterlockedIncrement64(&m_NumIOCalls);
+	if ( FALSE == Network::AcceptEx(listener->socket, client->GetSocket(), client->GetRecvCallBuff(), receiveDataLength, listener->addressSize, &event->GetOverlapped()))
+	{
+		int error = WSAGetLastError();
+
+		if(error != ERROR_IO_PENDING)
+		{
+			CancelIO(client, listener->tpio);
+			CancelTimeout(client);
+
+			ERROR_CODE(error, "AcceptEx() failed. listener[%s]", listener->name.c_str());
+			Client::Destroy(client);
+			IOEvent::Destroy(event);
+			return false;
+		}
+	}
+	else
+	{
+		// In this case, the completion will have already been queued, so OnAccept() is called from there.
+	}
+
+	// The completion waits for the lock to take it out again.
+	listener->pendingAccepts.insert(event);
+
+	return true;
+}
+
+
+void Server::OnAcceptDone(IOEvent* event)
+{
+	assert(event);
+	assert(event->GetType() == IOEvent::ACCEPT);
+
+	Listener* listener = m_Listeners[event->GetClient()->GetListener()];
+	{
+		CSLocker lock(&listener->cs);
+		listener->pendingAccepts.erase(event);
+	}
+
+	CancelTimeout(event->GetClient());
+
+	// Replace this accept with a new one right away.
+	InterlockedDecrement(&listener->numPostAccept);
+	PostAccept(listener);
+}
+
+
+void Server::PostRecv(Client* client)
+{
+	assert(client);
+
+	if (client->GetState() != Client::ACCEPTED)
+	{
+		return;
+	}
+
+	// With RECV_SHARED, post a zero-byte receive so that an idle client pins no buffer while waiting.
+	bool shared = m_Config.recvMode == RECV_SHARED;
+
+	WSABUF recvBufferDescriptor;
+	recvBufferDescriptor.buf = shared ? NULL : reinterpret_cast<char*>(client->GetRecvCallBuff());
+	recvBufferDescriptor.len = shared ? 0 : RecvBufferPool::BUFF_SIZE;
+
+	DWORD numberOfBytes = 0;
+	DWORD recvFlags = 0;
+
+	IOEvent* event = IOEvent::Create(shared ? IOEvent::RECV_NOTIFY : IOEvent::RECV, client);
+	assert(event);
+
+	StartIO(client, client->GetTPIO());
+	InterlockedIncrement64(&m_NumIOCalls);
+
+	if(WSARecv(client->GetSocket(), &recvBufferDescriptor, 1, &numberOfBytes, &recvFlags, &event->GetOverlapped(), NULL) == SOCKET_ERROR)
+	{
+		int error = WSAGetLastError();
+
+		if(error != ERROR_IO_PENDING)
+		{
+			CancelIO(client, client->GetTPIO());
+
+			ERROR_CODE(error, "WSARecv() failed.");
+			
+			OnClose(event);
+			IOEvent::Destroy(event);
+		}
+	}
+	else
+	{
+		// In this case, the completion callback will have already been scheduled to be called.
+	}
+}
+
+
+void Server::PostSend(Client* client, Packet* packet)
+{
+	assert(client);
+
+	// Packet::Create() has logged why it failed.
+	if (packet == NULL)
+	{
+		return;
+	}
+
+	if (client->GetState() != Client::ACCEPTED)
+	{
+		Packet::Destroy(packet);
+		return;
+	}
+
+	// TLS queues the encrypted records itself.
+	if (client->GetTls() != NULL)
+	{
+		bool startSend = false;
+		bool result = client->GetTls()->Send(client, packet, startSend);
+		if (startSend)
+		{
+			FlushSend(client);
+		}
+		if (!result)
+		{
+			RequestRemoveClient(client);
+		}
+		return;
+	}
+
+	// Queue it. If a send is already in flight, its completion sends this packet with any others queued meanwhile.
+	if (client->PushSendPacket(packet))
+	{
+		FlushSend(client);
+	}
+}
+
+
+void Server::FlushSend(Client* client)
+{
+	assert(client);
+
+	// Gather all queued packets into one WSASend().
+	WSABUF sendBufferDescriptors[MAX_SEND_BUFFERS];
+	bool zeroCopy = false;
+	DWORD numBuffers = client->BeginSend(sendBufferDescriptors, MAX_SEND_BUFFERS, m_Config.zeroCopyThreshold, zeroCopy);
+	if (numBuffers == 0)
+	{
+		return;
+	}
+
+	// Only one send is in flight, so the send buffer can be switched safely between sends.
+	if (zeroCopy != client->IsZeroCopySend())
+	{
+		SetZeroCopySend(client, zeroCopy);
+	}
+
+	if (zeroCopy)
+	{
+		InterlockedIncrement64(&m_NumZeroCopySends);
+		InterlockedExchangeAdd64(&m_NumZeroCopyBytes, client->GetSendingSize());
+	}
+
+	DWORD sendFlags = 0;
+
+	IOEvent* event = IOEvent::Create(IOEvent::SEND, client);
+	assert(event);
+	
+	StartIO(client, client->GetTPIO());
+	InterlockedIncrement64(&m_NumIOCalls);
+	InterlockedIncrement64(&m_NumSendCalls);
+	InterlockedExchangeAdd64(&m_NumSentPackets, numBuffers);
+
+	if(WSASend(client->GetSocket(), sendBufferDescriptors, numBuffers, NULL, sendFlags, &event->GetOverlapped(), NULL) == SOCKET_ERROR)
+	{
+		int error = WSAGetLastError();
+
+		if(error != ERROR_IO_PENDING)
+		{
+			CancelIO(client, client->GetTPIO());
+
+			ERROR_CODE(error, "WSASend() failed.");
+
+			IOEvent::Destroy(event);
+			RequestRemoveClient(client);
+		}
+	}
+	else
+	{
+		// In this case, the completion callback will have already been scheduled to be called.
+	}
+}
+
+
+void Server::PostConnect(Client* client, const sockaddr* address, int addressLength)
+{
+	assert(client);
+	assert(address);
+
+	// ConnectEx() requires a bound socket. Any address and port of the target's family, which the socket has been created with.
+	sockaddr_storage localAddress;
+	ZeroMemory(&localAddress, sizeof(localAddress));
+	int localAddressLength = 0;
+	if(address->sa_family == AF_INET6)
+	{
+		sockaddr_in6* localAddress6 = reinterpret_cast<sockaddr_in6*>(&localAddress);
+		localAddress6->sin6_family = AF_INET6;	// the zeroed sin6_addr is in6addr_any.
+		localAddressLength = sizeof(sockaddr_in6);
+	}
+	else
+	{
+		sockaddr_in* localAddress4 = reinterpret_cast<sockaddr_in*>(&localAddress);
+		localAddress4->sin_family = AF_INET;
+		localAddress4->sin_addr.s_addr = INADDR_ANY;
+		localAddressLength = sizeof(sockaddr_in);
+	}
+
+	if(bind(client->GetSocket(), reinterpret_cast<const sockaddr*>(&localAddress), localAddressLength) == SOCKET_ERROR)
+	{
+		ERROR_CODE(WSAGetLastError(), "bind() for ConnectEx() failed.");
+
+		RequestRemoveClient(client);
+		return;
+	}
+
+	int shard = SelectShard(client->GetSocket(), 0, m_NumCommonShards);
+	client->SetShard(shard);
+
+	TP_IO* pTPIO = NULL;
+	if(!AssociateIO(client->GetSocket(), shard, &pTPIO))
+	{
+		ERROR_CODE(GetLastError(), "Could not associate an upstream socket with IOCP.");
+
+		RequestRemoveClient(client);
+		return;
+	}
+	client->SetTPIO(pTPIO);
+
+	if(m_Config.recvMode == RECV_PER_CLIENT)
+	{
+		client->SetRecvCallBuff(RecvBufferPool::Create());
+	}
+
+	IOEvent* event = IOEvent::Create(IOEvent::CONNECT, client);
+	assert(event);
+
+	StartIO(client, pTPIO);
+	InterlockedIncrement64(&m_NumIOCalls);
+
+	if(FALSE == Network::ConnectEx(client->GetSocket(), const_cast<sockaddr*>(address), addressLength, &event->GetOverlapped()))
+	{
+		int error = WSAGetLastError();
+
+		if(error != ERROR_IO_PENDING)
+		{
+			CancelIO(client, pTPIO);
+
+			ERROR_CODE(error, "ConnectEx() failed.");
+
+			IOEvent::Destroy(event);
+			RequestRemoveClient(client);
+		}
+	}
+	else
+	{
+		// In this case, the completion will have already been queued, so OnConnect() is called from there.
+	}
+}
+
+
+void Server::SendDatagram(Client* client, Packet* packet)
+{
+	assert(client);
+
+	// Packet::Create() has logged why it failed.
+	if(packet == NULL)
+	{
+		return;
+	}
+
+	sockaddr_storage address;
+	int addressLength = 0;
+	if(m_DatagramSockets.empty() || client->GetState() != Client::ACCEPTED || !client->GetDatagramAddress(address, addressLength))
+	{
+		Packet::Destroy(packet);
+		return;
+	}
+
+	// Reply from the socket of the client's shard, which its datagrams are sent to.
+	DatagramSocket* datagramSocket = m_DatagramSockets[client->GetShard() % m_DatagramSockets.size()];
+
+	WSABUF sendBufferDescriptors[Packet::MAX_SEGMENTS];
+	DWORD numBuffers = 0;
+	for(Packet* segment = packet ; segment != NULL ; segment = segment->GetNext())
+	{
+		sendBufferDescriptors[numBuffers].buf = reinterpret_cast<char*>(segment->GetSegmentData());
+		sendBufferDescriptors[numBuffers].len = segment->GetSegmentSize();
+		++numBuffers;
+	}
+
+	// The packet is kept by the event until the send completes.
+	IOEvent* event = IOEvent::Create(IOEvent::DATAGRAM_SEND, NULL, packet);
+	assert(event);
+
+	if(m_Config.backend == THREAD_POOL)
+	{
+		StartThreadpoolIo(datagramSocket->tpio);
+	}
+	InterlockedIncrement64(&m_NumIOCalls);
+
+	if(WSASendTo(datagramSocket->socket, sendBufferDescriptors, numBuffers, NULL, 0, reinterpret_cast<const sockaddr*>(&address), addressLength, &event->GetOverlapped(), NULL) == SOCKET_ERROR)
+	{
+		int error = WSAGetLastError();
+
+		if(error != ERROR_IO_PENDING)
+		{
+			if(m_Config.backend == THREAD_POOL)
+			{
+				CancelThreadpoolIo(datagramSocket->tpio);
+			}
+
+			ERROR_CODE(error, "WSASendTo() failed.");
+
+			InterlockedIncrement64(&m_NumDatagramsDropped);
+			Packet::Destroy(packet);
+			IOEvent::Destroy(event);
+		}
+	}
+	else
+	{
+		// In this case, the completion callback will have already been scheduled to be called.
+	}
+}
+
+
+bool Server::CreateDatagramSockets()
+{
+	// One socket per shard on consecutive ports, so that each shard receives the datagrams of its own clients.
+	int numSockets = m_Shards.empty() ? 1 : static_cast<int>(m_Shards.size());
+
+	// Of the family of the port's listener, so that every client which can connect to it can send datagrams too.
+	int family = m_Listeners.front()->family;
+
+	for(int i = 0 ; i < numSockets ; ++i)
+	{
+		DatagramSocket* datagramSocket = new DatagramSocket;
+		datagramSocket->index = i;
+		datagramSocket->tpio = NULL;
+		datagramSocket->socket = Network::CreateDatagramSocket(static_cast<u_short>(m_Config.datagramPort + i), family);
+		m_DatagramSockets.push_back(datagramSocket);
+
+		if(datagramSocket->socket == INVALID_SOCKET)
+		{
+			return false;
+		}
+
+		if(!AssociateIO(datagramSocket->socket, i, &datagramSocket->tpio))
+		{
+			ERROR_CODE(GetLastError(), "Could not associate a datagram socket with IOCP.");
+			return false;
+		}
+
+		// Keep several receives posted so that a burst is picked up by one batch of completions.
+		for(int j = 0 ; j < m_Config.datagramRecvDepth ; ++j)
+		{
+			DatagramSlot* slot = new DatagramSlot;
+			slot->owner = datagramSocket;
+			m_DatagramSlots.push_back(slot);
+
+			PostRecvFrom(slot);
+		}
+	}
+
+	LOG("Created %d datagram sockets from port %d. family[%d]", numSockets, m_Config.datagramPort, family);
+
+	return true;
+}
+
+
+void Server::DestroyDatagramSockets()
+{
+	for(DatagramSocketList::iterator itor = m_DatagramSockets.begin() ; itor != m_DatagramSockets.end() ; ++itor)
+	{
+		DatagramSocket* datagramSocket = *itor;
+
+		if(datagramSocket->socket != INVALID_SOCKET)
+		{
+			Network::CloseSocket(datagramSocket->socket);
+			CancelIoEx(reinterpret_cast<HANDLE>(datagramSocket->socket), NULL);
+		}
+
+		if(datagramSocket->tpio != NULL)
+		{
+			WaitForThreadpoolIoCallbacks(datagramSocket->tpio, true);
+			CloseThreadpoolIo(datagramSocket->tpio);
+		}
+
+		delete datagramSocket;
+	}
+	m_DatagramSockets.clear();
+
+	// No completion can touch the slots any more. I/O threads have been stopped or the callbacks have been waited for.
+	for(DatagramSlotList::iterator itor = m_DatagramSlots.begin() ; itor != m_DatagramSlots.end() ; ++itor)
+	{
+		delete *itor;
+	}
+	m_DatagramSlots.clear();
+}
+
+
+void Server::PostRecvFrom(DatagramSlot* slot)
+{
+	assert(slot);
+
+	DatagramSocket* datagramSocket = slot->owner;
+
+	WSABUF recvBufferDescriptor;
+	recvBufferDescriptor.buf = reinterpret_cast<char*>(slot->buffer);
+	recvBufferDescriptor.len = sizeof(slot->buffer);
+
+	slot->fromLength = sizeof(slot->from);
+	slot->flags = 0;
+
+	IOEvent* event = IOEvent::Create(IOEvent::DATAGRAM_RECV, NULL);
+	assert(event);
+	event->SetContext(slot);
+
+	if(m_Config.backend == THREAD_POOL)
+	{
+		StartThreadpoolIo(datagramSocket->tpio);
+	}
+	InterlockedIncrement64(&m_NumIOCalls);
+
+	if(WSARecvFrom(datagramSocket->socket, &recvBufferDescriptor, 1, NULL, &slot->flags, 
+		reinterpret_cast<sockaddr*>(&slot->from), &slot->fromLength, &event->GetOverlapped(), NULL) == SOCKET_ERROR)
+	{
+		int error = WSAGetLastError();
+
+		if(error != ERROR_IO_PENDING)
+		{
+			if(m_Config.backend == THREAD_POOL)
+			{
+				CancelThreadpoolIo(datagramSocket->tpio);
+			}
+
+			// The slot stays idle, which only makes this socket receive with one less buffer.
+			ERROR_CODE(error, "WSARecvFrom() failed.");
+
+			IOEvent::Destroy(event);
+		}
+	}
+	else
+	{
+		// In this case, the completion callback will have already been scheduled to be called.
+	}
+}
+
+
+void Server::OnDatagram(IOEvent* event, ULONG ioResult, DWORD dwNumberOfBytesTransfered)
+{
+	assert(event);
+
+	if(event->GetType() == IOEvent::DATAGRAM_SEND)
+	{
+		if(ioResult == ERROR_SUCCESS)
+		{
+			InterlockedIncrement64(&m_NumDatagramsSent);
+		}
+		else
+		{
+			InterlockedIncrement64(&m_NumDatagramsDropped);
+		}
+
+		Packet::Destroy(event->GetPacket());
+		return;
+	}
+
+	DatagramSlot* slot = static_cast<DatagramSlot*>(event->GetContext());
+	assert(slot);
+
+	if(m_ShuttingDown)
+	{
+		return;
+	}
+
+	// WSAEMSGSIZE, for one, fails just this datagram. The socket keeps working.
+	if(ioResult != ERROR_SUCCESS)
+	{
+		ERROR_CODE(ioResult, "WSARecvFrom() completed with an error.");
+		InterlockedIncrement64(&m_NumDatagramsDropped);
+	}
+	else
+	{
+		OnDatagramRecv(slot, dwNumberOfBytesTransfered);
+	}
+
+	PostRecvFrom(slot);
+}
+
+
+void Server::OnDatagramRecv(DatagramSlot* slot, DWORD dwNumberOfBytesTransfered)
+{
+	assert(slot);
+
+	// A message has to be there and be null-terminated, so that it can be parsed in place later.
+	if(dwNumberOfBytesTransfered <= DATAGRAM_HEADER_SIZE || slot->buffer[dwNumberOfBytesTransfered - 1] != '\0')
+	{
+		InterlockedIncrement64(&m_NumDatagramsDropped);
+		return;
+	}
+
+	u_long token = 0;
+	CopyMemory(&token, slot->buffer, DATAGRAM_HEADER_SIZE);
+	token = ntohl(token);
+
+	Client* client = NULL;
+	{
+		// The client can't be removed while the session lock is held. See RemoveDatagramSession().
+		CSLocker lock(&m_CSForDatagramSessions);
+
+		DatagramSessionMap::iterator itor = m_DatagramSessions.find(token);
+		if(itor == m_DatagramSessions.end())
+		{
+			InterlockedIncrement64(&m_NumDatagramsDropped);
+			return;
+		}
+
+		client = itor->second;
+		client->SetDatagramAddress(slot->from, slot->fromLength);
+
+		if(!client->PushDatagram(slot->buffer + DATAGRAM_HEADER_SIZE, dwNumberOfBytesTransfered - DATAGRAM_HEADER_SIZE))
+		{
+			InterlockedIncrement64(&m_NumDatagramsDropped);
+			return;
+		}
+
+		InterlockedIncrement64(&m_NumDatagramsReceived);
+
+		// In shared-nothing mode the datagram is served right here if the client has sent it to the port of its shard, as it has
+		// been told to. Otherwise the next check of the shard's clients picks it up.
+		if(!m_Config.sharedNothing || client->GetShard() != slot->owner->index)
+		{
+			return;
+		}
+
+		client->AddRef();
+	}
+
+	ProcessClient(m_Shards[client->GetShard()], client);
+	EndIO(client);
+}
+
+
+void Server::OnDatagramSessionRequest(Client* client, rapidjson::Document& data)
+{
+	assert(client);
+
+	if(!data["type"].IsString() || std::string(data["type"].GetString()) != "udp_session" || m_DatagramSockets.empty())
+	{
+		return;
+	}
+
+	DWORD token = client->GetDatagramToken();
+	if(token == 0)
+	{
+		CSLocker lock(&m_CSForDatagramSessions);
+
+		// The token is all that binds a datagram to the client, so it must not be guessable from the others.
+		unsigned int value = 0;
+		do
+		{
+			if(rand_s(&value) != 0)
+			{
+				ERROR_MSG("rand_s() failed. no datagram session for client(%p)", client);
+				return;
+			}
+		}
+		while(value == 0 || m_DatagramSessions.find(value) != m_DatagramSessions.end());
+
+		token = value;
+		m_DatagramSessions[token] = client;
+		client->SetDatagramToken(token);
+	}
+
+	rapidjson::Document response;
+	response.SetObject();
+	response.AddMember("type", "udp_session", response.GetAllocator());
+	response.AddMember("token", static_cast<unsigned>(token), response.GetAllocator());
+	response.AddMember("port", static_cast<unsigned>(m_Config.datagramPort + client->GetShard() % m_DatagramSockets.size()), response.GetAllocator());
+
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	response.Accept(writer);
+
+	PostSend(client, Packet::Create(client, (const BYTE*)buffer.GetString(), buffer.Size()+1));
+}
+
+
+void Server::RemoveDatagramSession(Client* client)
+{
+	assert(client);
+
+	if(client->GetDatagramToken() == 0)
+	{
+		return;
+	}
+
+	CSLocker lock(&m_CSForDatagramSessions);
+	m_DatagramSessions.erase(client->GetDatagramToken());
+}
+
+
+void Server::SetZeroCopySend(Client* client, bool zeroCopy)
+{
+	assert(client);
+
+	if (client->GetDefaultSendBufferSize() < 0)
+	{
+		int size = 0;
+		int optionLength = sizeof(size);
+		if (getsockopt(client->GetSocket(), SOL_SOCKET, SO_SNDBUF, reinterpret_cast<char*>(&size), &optionLength) == SOCKET_ERROR)
+		{
+			ERROR_CODE(WSAGetLastError(), "getsockopt() failed with SO_SNDBUF.");
+			return;
+		}
+		client->SetDefaultSendBufferSize(size);
+	}
+
+	// With no send buffer, WSASend() sends directly from the packet, which is kept until the send completes anyway.
+	int size = zeroCopy ? 0 : client->GetDefaultSendBufferSize();
+	if (setsockopt(client->GetSocket(), SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&size), sizeof(size)) == SOCKET_ERROR)
+	{
+		ERROR_CODE(WSAGetLastError(), "setsockopt() failed with SO_SNDBUF.");
+		return;
+	}
+
+	client->SetZeroCopySend(zeroCopy);
+}
+
+
+void Server::OnCompletion(IOEvent* event, ULONG ioResult, DWORD dwNumberOfBytesTransfered)
+{
+	assert(event);
+
+	// Datagram sockets are shared by all clients, so their failures never close anything.
+	if(event->GetType() == IOEvent::DATAGRAM_RECV || event->GetType() == IOEvent::DATAGRAM_SEND)
+	{
+		OnDatagram(event, ioResult, dwNumberOfBytesTransfered);
+	}
+	else if(ioResult != ERROR_SUCCESS)
+	{
+		ERROR_CODE(ioResult, "I/O operation failed. type[%d]", event->GetType());
+
+		OnClose(event);
+	}
+	else
+	{	
+		switch(event->GetType())
+		{
+		case IOEvent::ACCEPT:	
+			OnAccept(event, dwNumberOfBytesTransfered);
+			break;
+
+		case IOEvent::RECV:		
+			if(dwNumberOfBytesTransfered > 0)
+			{
+				OnRecv(event, dwNumberOfBytesTransfered);
+			}
+			else
+			{
+				OnClose(event);
+			}
+			break;
+
+		case IOEvent::RECV_NOTIFY:
+			OnRecvNotify(event);
+			break;
+
+		case IOEvent::SEND:
+			OnSend(event, dwNumberOfBytesTransfered);
+			break;
+
+		case IOEvent::CONNECT:
+			OnConnect(event);
+			break;
+
+		default: assert(false); break;
+		}
+	}
+
+	IOEvent::Destroy(event);
+}
+
+
+void Server::OnAccept(IOEvent* event, DWORD dwNumberOfBytesTransfered)
+{
+	assert(event);
+
+	LOG("[%d] Enter OnAccept()", GetCurrentThreadId());
+	assert(event->GetType() == IOEvent::ACCEPT);
+
+	InterlockedIncrement64(&m_NumAccepts);
+	OnAcceptDone(event);
+
+	// With ACCEPT_WITH_DATA, the first request is already here, so add the client and hand the data over right in this thread.
+	// It saves a thread hop and a receive before the first response.
+	if(m_Config.acceptMode == ACCEPT_WITH_DATA)
+	{
+		if(!m_ShuttingDown)
+		{
+			AddClient(event->GetClient(), dwNumberOfBytesTransfered);
+		}
+	}
+	// A busy polling thread has the core to itself, so a hop to another thread would only add a wakeup.
+	else if(m_Config.busyPollSpin > 0)
+	{
+		if(!m_ShuttingDown)
+		{
+			AddClient(event->GetClient());
+		}
+	}
+	// Add client in a different thread.
+	// It is because we need to return this function ASAP so that this IO worker thread can process the other IO notifications.
+	// If adding client is fast enough, we can call it here but I assume it's slow.	
+	else if(!m_ShuttingDown && TrySubmitThreadpoolCallback(Server::WorkerAddClient, event->GetClient(), &m_ClientTPENV) == false)
+	{
+		ERROR_CODE(GetLastError(), "Could not start `.");
+
+		AddClient(event->GetClient());
+	}
+
+	LOG("[%d] Leave OnAccept()", GetCurrentThreadId());
+}
+
+
+void Server::OnRecv(IOEvent* event, DWORD dwNumberOfBytesTransfered)
+{
+	assert(event);
+
+	LOG("[%d] Enter OnRecv()", GetCurrentThreadId());
+
+	Client* client = event->GetClient();
+	assert(client);
+
+	// If the backlog is full, the receive is posted again by UpdateServices() once it has drained.
+	if (OnRecvData(client, client->GetRecvCallBuff(), dwNumberOfBytesTransfered))
+	{
+		PostRecv(client);
+	}
+
+	// In shared-nothing mode, the thread of the client's shard serves its messages as they come in.
+	if (m_Config.sharedNothing && !client->IsUpstream())
+	{
+		ProcessClient(m_Shards[client->GetShard()], client);
+	}
+
+	LOG("[%d] Leave OnRecv()", GetCurrentThreadId());
+}
+
+
+void Server::OnRecvNotify(IOEvent* event)
+{
+	assert(event);
+
+	Client* client = event->GetClient();
+	assert(client);
+
+	// Borrow a shared buffer only while draining the socket.
+	BYTE* buffer = RecvBufferPool::Create();
+	bool closed = false;
+	bool paused = false;
+
+	while(true)
+	{
+		int size = recv(client->GetSocket(), reinterpret_cast<char*>(buffer), RecvBufferPool::BUFF_SIZE, 0);
+		if(size > 0)
+		{
+			if(!OnRecvData(client, buffer, size))
+			{
+				paused = true;
+				break;
+			}
+
+			// A short read means the socket is most likely drained. If not, the next zero-byte receive completes at once.
+			if(size < RecvBufferPool::BUFF_SIZE)
+			{
+				break;
+			}
+		}
+		else if(size == 0)
+		{
+			closed = true;
+			break;
+		}
+		else
+		{
+			int error = WSAGetLastError();
+			if(error != WSAEWOULDBLOCK)
+			{
+				ERROR_CODE(error, "recv() failed.");
+				closed = true;
+			}
+			break;
+		}
+	}
+
+	RecvBufferPool::Destroy(buffer);
+
+	if(m_Config.sharedNothing && !client->IsUpstream())
+	{
+		ProcessClient(m_Shards[client->GetShard()], client);
+	}
+
+	if(closed)
+	{
+		OnClose(event);
+	}
+	else if(!paused)
+	{
+		PostRecv(client);
+	}
+}
+
+
+void Server::OnSend(IOEvent* event, DWORD dwNumberOfBytesTransfered)
+{
+	assert(event);
+
+	LOG("[%d] OnSend : %d, client(%p)", GetCurrentThreadId(), dwNumberOfBytesTransfered, event->GetClient());
+
+	Client* client = event->GetClient();
+	assert(client);
+
+	// An overlapped send on a stream socket completes partially only when the connection is broken.
+	if (dwNumberOfBytesTransfered < client->GetSendingSize())
+	{
+		ERROR_MSG("WSASend() completed partially. %d / %d", dwNumberOfBytesTransfered, client->GetSendingSize());
+
+		RequestRemoveClient(client);
+		return;
+	}
+
+	// This should be fast enough to do in this I/O thread.
+	// if not, we need to queue it like what we do in OnRecv().
+	if (client->EndSend())
+	{
+		FlushSend(client);
+	}
+}
+
+
+void Server::OnConnect(IOEvent* event)
+{
+	assert(event);
+
+	Client* client = event->GetClient();
+	assert(client);
+
+	// Like SO_UPDATE_ACCEPT_CONTEXT, the socket is not fully set up until this is set. e.g. getpeername() or shutdown() fail.
+	if(setsockopt(client->GetSocket(), SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, NULL, 0) == SOCKET_ERROR)
+	{
+		ERROR_CODE(WSAGetLastError(), "setsockopt() for ConnectEx() failed.");
+
+		RequestRemoveClient(client);
+		return;
+	}
+
+	if(!Network::ApplySocketProfile(client->GetSocket(), *m_Config.socketProfile, false) || !SetupRecv(client))
+	{
+		RequestRemoveClient(client);
+		return;
+	}
+
+	client->SetState(Client::ACCEPTED);
+
+	UpstreamPool::OnConnected(client);
+
+	PostRecv(client);
+}
+
+
+void Server::OnClose(IOEvent* event)
+{
+	assert(event);
+
+	LOG("Client's socket has been closed.");
+
+	if (event->GetPacket())
+	{
+		Packet::Destroy(event->GetPacket());
+	}
+
+	// A failed accept (e.g. reset before it completed) still has to be replaced.
+	if (event->GetType() == IOEvent::ACCEPT)
+	{
+		OnAcceptDone(event);
+	}
+
+	// we should remove this client in a different thread as client will wait i/o for its socket.
+	RequestRemoveClient(event->GetClient());
+}
+
+
+bool Server::SetupRecv(Client* client)
+{
+	assert(client);
+
+	if(m_Config.recvMode == RECV_SHARED)
+	{
+		// Data is read with non-blocking recv() after a zero-byte receive completes. See OnRecvNotify().
+		u_long nonBlocking = 1;
+		if(ioctlsocket(client->GetSocket(), FIONBIO, &nonBlocking) == SOCKET_ERROR)
+		{
+			ERROR_CODE(WSAGetLastError(), "ioctlsocket() failed with FIONBIO.");
+			return false;
+		}
+
+		client->SetReleaseIdleRecvBuffer(true);
+	}
+
+	return true;
+}
+
+
+bool Server::OnRecvData(Client* client, const BYTE* data, int size)
+{
+	assert(client);
+
+	// A paused client is waiting for the services rather than the other way round, so it has no timeout until it resumes.
+	if(!PushRecvData(client, data, size))
+	{
+		CancelTimeout(client);
+		return false;
+	}
+
+	UpdateTimeout(client);
+	return true;
+}
+
+
+bool Server::PushRecvData(Client* client, const BYTE* data, int size)
+{
+	assert(client);
+
+	TlsSession* tls = client->GetTls();
+	if(tls == NULL)
+	{
+		return client->OnRecvComplete(data, size);
+	}
+
+	// Handshake replies are queued during decryption, so a send may have to be started here.
+	std::string plaintext;
+	bool startSend = false;
+	bool result = tls->OnRecv(client, data, size, plaintext, startSend);
+	if(startSend)
+	{
+		FlushSend(client);
+	}
+
+	if(!result)
+	{
+		RequestRemoveClient(client);
+		return false;
+	}
+
+	if(plaintext.empty())
+	{
+		return true;
+	}
+
+	return client->OnRecvComplete(reinterpret_cast<const BYTE*>(plaintext.data()), static_cast<int>(plaintext.size()));
+}
+
+
+void Server::AddClient(Client* client, DWORD firstDataSize)
+{
+	assert(client);
+
+	Listener* listener = m_Listeners[client->GetListener()];
+
+	// The socket sAcceptSocket does not inherit the properties of the socket associated with sListenSocket parameter until SO_UPDATE_ACCEPT_CONTEXT is set on the socket.
+	if (setsockopt(client->GetSocket(), SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, reinterpret_cast<const char *>(&listener->socket), sizeof(listener->socket)) == SOCKET_ERROR)
+	{
+		ERROR_CODE(WSAGetLastError(), "setsockopt() for AcceptEx() failed.");
+
+		RequestRemoveClient(client);
+	}		
+	else if(listener->profile != NULL && !Network::ApplySocketProfile(client->GetSocket(), *listener->profile, false))
+	{
+		RequestRemoveClient(client);
+	}
+	else
+	{
+		client->SetState(Client::ACCEPTED);
+
+		// Connect the socket to IOCP. With several shards, the client stays on the selected shard from now on.
+		int shard = SelectShard(client->GetSocket(), listener->firstShard, listener->numShards);
+		client->SetShard(shard);
+
+		TP_IO* pTPIO = NULL;
+		if(!AssociateIO(client->GetSocket(), shard, &pTPIO))
+		{
+			ERROR_CODE(GetLastError(), "Could not associate a client socket with IOCP.");
+
+			RequestRemoveClient(client);
+		}
+		else
+		{
+			std::string ip;
+			u_short port = 0;
+			Network::GetRemoteAddress(client->GetSocket(), ip, port);
+			LOG("[%d] Accept succeeded. client address : ip[%s], port[%d]", GetCurrentThreadId(), ip.c_str(), port);
+
+			client->SetTPIO(pTPIO);
+
+			if(!SetupRecv(client))
+			{
+				RequestRemoveClient(client);
+				return;
+			}
+
+			if(TlsSession::IsEnabled())
+			{
+				client->SetTls(TlsSession::Create());
+			}
+
+			client->SetSendWatermarks(m_Config.sendHighWatermark, m_Config.sendLowWatermark);
+			client->SetRecvBacklogLimit(m_Config.recvBacklogLimit);
+
+			// A shard of its own keeps its clients itself. It gets the client ahead of its first receive completion.
+			if(m_Config.sharedNothing)
+			{
+				PostShardMessage(shard, new ShardMessage(ShardMessage::ADD_CLIENT, client));
+			}
+			else
+			{
+				CSLocker lock(&m_CSForClients);
+				m_Clients.push_back(client);
+			}
+
+			// The accept buffer holds the first data received by AcceptEx() at its beginning.
+			bool receiving = true;
+			if(firstDataSize > 0)
+			{
+				receiving = OnRecvData(client, client->GetRecvCallBuff(), firstDataSize);
+			}
+
+			// The accept buffer is kept as the receive buffer with RECV_PER_CLIENT only.
+			if(m_Config.recvMode == RECV_SHARED)
+			{
+				RecvBufferPool::Destroy(client->GetRecvCallBuff());
+				client->SetRecvCallBuff(NULL);
+			}
+
+			if(m_Config.backend == IO_THREADS)
+			{
+				InterlockedIncrement(&m_Shards[shard]->numClients);
+			}
+
+	
+			if(receiving)
+			{
+				UpdateTimeout(client);
+				PostRecv(client);
+			}
+		}
+	}
+}
+
+
+void Server::RemoveClient(Client* client)
+{
+	assert(client);
+
+	CancelTimeout(client);
+
+	// Several failed I/O, timeouts and stalls can request removal of the same client. Only the first one removes it.
+	if(!client->Close())
+	{
+		EndIO(client);
+		return;
+	}
+
+	{
+		CSLocker lock(&m_CSForClients);
+		ClientList::iterator itor = std::remove(m_Clients.begin(), m_Clients.end(), client);
+
+		if(itor != m_Clients.end())
+		{
+			m_Clients.erase(itor);
+
+			if(m_Config.backend == IO_THREADS)
+			{
+				InterlockedDecrement(&m_Shards[client->GetShard()]->numClients);
+			}
+		}
+	}
+
+	if(client->IsUpstream())
+	{
+		UpstreamPool::OnDisconnected(client);
+	}
+
+	RemoveDatagramSession(client);
+
+	// The shard of the client takes it out of its list and its games, and drops the references then.
+	if(m_Config.sharedNothing && !client->IsUpstream())
+	{
+		PostShardMessage(client->GetShard(), new ShardMessage(ShardMessage::REMOVE_CLIENT, client));
+		return;
+	}
+
+	RemoveClientFromServices(client);
+
+	// Drop the reference taken by RequestRemoveClient() and the one owned since creation.
+	// The client is destroyed and recycled by whichever of this and the last pending I/O comes last.
+	client->Release();
+	EndIO(client);
+}
+
+void Server::PostBoradcast(Packet* packet)
+{
+	assert(packet);
+	assert(packet->GetSender());
+
+	// Each shard sends to its own clients.
+	if(m_Config.sharedNothing)
+	{
+		for(size_t i = 0 ; i < m_Shards.size() ; ++i)
+		{
+			ShardMessage* message = new ShardMessage(ShardMessage::BROADCAST, NULL);
+			packet->AddRef();
+			message->packet = packet;
+			PostShardMessage(static_cast<int>(i), message);
+		}
+	}
 	else
 	{
-		// In this case, the completion callback will have already been scheduled to be called.
+		CSLocker lock(&m_CSForClients);
+
+		for(ClientList::iterator itor = m_Clients.begin() ; itor != m_Clients.end() ; ++itor)
+		{
+			// Each client's send holds its own reference.
+			packet->AddRef();
+			PostSend(*itor, packet);
+		}
+	}
+
+	Packet::Destroy(packet);
+}
+
+void Server::RequestRemoveClient(Client* client)
+{
+	// Keep the client alive until the removal runs even if its pending I/O completes in the meantime.
+	client->AddRef();
+
+	if(!m_ShuttingDown && TrySubmitThreadpoolCallback(Server::WorkerRemoveClient, client, &m_ClientTPENV) == false)
+	{
+		ERROR_CODE(GetLastError(), "can't start WorkerRemoveClient. call it directly.");
+
+		RemoveClient(client);
+	}
+}
+
+bool Server::CreateShards()
+{
+	// Of all processor groups, as GetSystemInfo() counts the group of the calling thread only.
+	int numProcessors = static_cast<int>(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+
+	m_NumCommonShards = m_Config.numShards > 0 ? m_Config.numShards : 1;
+	int numIOThreads = m_Config.numIOThreads > 0 ? m_Config.numIOThreads : numProcessors;
+	int numThreadsPerShard = numIOThreads > m_NumCommonShards ? numIOThreads / m_NumCommonShards : 1;
+
+	// Shared-nothing shards are run by one thread each, as the thread is all that keeps their clients and games consistent.
+	if(m_Config.sharedNothing)
+	{
+		m_NumCommonShards = numIOThreads;
+		numThreadsPerShard = 1;
+	}
+
+	m_ProcessorShards.assign(numProcessors, -1);
+
+	// Listeners with shards of their own get them after the common ones.
+	int numShards = m_NumCommonShards;
+	for(ListenerList::iterator itor = m_Listeners.begin() ; itor != m_Listeners.end() ; ++itor)
+	{
+		Listener* listener = *itor;
+		if(listener->numDedicatedShards > 0)
+		{
+			listener->firstShard = numShards;
+			listener->numShards = listener->numDedicatedShards;
+			numShards += listener->numDedicatedShards;
+		}
+		else
+		{
+			listener->firstShard = 0;
+			listener->numShards = m_NumCommonShards;
+		}
+
+		LOG("Listener %s : shards %d - %d", listener->name.c_str(), listener->firstShard, listener->firstShard + listener->numShards - 1);
+	}
+
+	for(int i = 0 ; i < numShards ; ++i)
+	{
+		IOShard* shard = new IOShard;
+		shard->index = i;
+		shard->numClients = 0;
+		shard->numCompletions = 0;
+		shard->timers = HasTimeouts() ? CreateTimers() : NULL;
+		shard->nextUpdate = 0;
+		shard->numMessages = 0;
+		shard->node = i % Numa::GetNumNodes();
+		m_Shards.push_back(shard);
+
+		shard->completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, numThreadsPerShard);
+		if(shard->completionPort == NULL)
+		{
+			ERROR_CODE(GetLastError(), "Could not create the completion port for shard %d.", i);
+			return false;
+		}
+
+		for(int j = 0 ; j < numThreadsPerShard ; ++j)
+		{
+			// Started only once it is on its processor. Its first allocation from a pool ties its cache to the node it runs on then.
+			HANDLE thread = CreateThread(NULL, 0, Server::IOThreadMain, shard, CREATE_SUSPENDED, NULL);
+			if(thread == NULL)
+			{
+				ERROR_CODE(GetLastError(), "Could not create an I/O thread for shard %d.", i);
+				return false;
+			}
+
+			// SelectShard() sends the connections RSS delivers on the processor to this shard. The first shard on it keeps it.
+			GROUP_AFFINITY affinity = GetIOThreadAffinity(i, shard->node, j, numShards, numThreadsPerShard);
+			int processor = GetProcessorIndex(affinity);
+			if(processor >= 0)
+			{
+				if(!SetThreadGroupAffinity(thread, &affinity, NULL))
+				{
+					ERROR_CODE(GetLastError(), "SetThreadGroupAffinity() failed for shard %d on processor %d.", i, processor);
+				}
+				else if(processor < numProcessors && m_ProcessorShards[processor] < 0)
+				{
+					m_ProcessorShards[processor] = i;
+				}
+			}
+
+			// A spinning thread should not lose its core to anything that wakes up on it.
+			if(m_Config.busyPollSpin > 0 && !SetThreadPriority(thread, THREAD_PRIORITY_HIGHEST))
+			{
+				ERROR_CODE(GetLastError(), "SetThreadPriority() failed for shard %d.", i);
+			}
+
+			shard->threads.push_back(thread);
+			ResumeThread(thread);
+		}
+	}
+
+	LOG("Created %d shards with %d I/O threads each. busy poll : %d us, shared-nothing : %d, NUMA nodes : %d", 
+		numShards, numThreadsPerShard, m_Config.busyPollSpin, m_Config.sharedNothing, Numa::GetNumNodes());
+
+	return true;
+}
+
+
+GROUP_AFFINITY Server::GetIOThreadAffinity(int shard, int node, int thread, int numShards, int numThreadsPerShard)
+{
+	// Given cores are meant to be kept free of anything else, so every thread gets one of its own.
+	if(!m_Config.ioCores.empty())
+	{
+		int core = m_Config.ioCores[(shard * numThreadsPerShard + thread) % m_Config.ioCores.size()];
+		return GetProcessorAffinity(core);
+	}
+
+	// Shards take turns over the nodes, and their threads take the processors of their node in turn.
+	// Whatever a thread allocates from the pools is then in the memory of its node.
+	if(Numa::IsEnabled())
+	{
+		return Numa::GetNodeProcessor(node, (shard / Numa::GetNumNodes()) * numThreadsPerShard + thread);
+	}
+
+	// Otherwise every thread gets a core of its own too, and the threads of a shard get neighbouring ones,
+	// so that the connections of the shard stay warm in the caches those cores share.
+	if(numShards > 1)
+	{
+		return GetProcessorAffinity(shard * numThreadsPerShard + thread);
+	}
+
+	// A single shard is left to the scheduler.
+	GROUP_AFFINITY affinity;
+	ZeroMemory(&affinity, sizeof(affinity));
+	return affinity;
+}
+
+
+void Server::StopShards()
+{
+	for(ShardList::iterator itor = m_Shards.begin() ; itor != m_Shards.end() ; ++itor)
+	{
+		IOShard* shard = *itor;
+
+		for(size_t i = 0 ; i < shard->threads.size() ; ++i)
+		{
+			PostQueuedCompletionStatus(shard->completionPort, 0, 0, NULL);
+		}
+
+		for(ThreadList::iterator thread = shard->threads.begin() ; thread != shard->threads.end() ; ++thread)
+		{
+			WaitForSingleObject(*thread, INFINITE);
+			CloseHandle(*thread);
+		}
+		shard->threads.clear();
+	}
+}
+
+
+void Server::DestroyShards()
+{
+	for(ShardList::iterator itor = m_Shards.begin() ; itor != m_Shards.end() ; ++itor)
+	{
+		IOShard* shard = *itor;
+
+		if(shard->completionPort != NULL)
+		{
+			// Messages nobody has handled since the thread stopped. Their clients have been destroyed with the others.
+			DWORD bytes = 0;
+			ULONG_PTR key = 0;
+			OVERLAPPED* overlapped = NULL;
+			while(GetQueuedCompletionStatus(shard->completionPort, &bytes, &key, &overlapped, 0) || overlapped != NULL)
+			{
+				if(key == SHARD_MESSAGE_KEY)
+				{
+					ShardMessage* message = reinterpret_cast<ShardMessage*>(overlapped);
+					if(message->packet != NULL)
+					{
+						Packet::Destroy(message->packet);
+					}
+					delete message;
+				}
+			}
+
+			CloseHandle(shard->completionPort);
+		}
+		delete shard;
+	}
+	m_Shards.clear();
+}
+
+
+int Server::SelectShard(SOCKET socket, int firstShard, int numShards)
+{
+	if(numShards <= 1)
+	{
+		return firstShard;
+	}
+
+	// Use the processor RSS delivered this connection on, so that the connection is handled where its packets arrive.
+	SOCKET_PROCESSOR_AFFINITY affinity;
+	DWORD bytes = 0;
+	if(WSAIoctl(socket, SIO_QUERY_RSS_PROCESSOR_INFO, NULL, 0, &affinity, sizeof(affinity), &bytes, NULL, NULL) == 0)
+	{
+		// The shard with a thread on that very processor, as CreateShards() has pinned them.
+		int processor = GetProcessorIndex(affinity.Processor);
+		int shard = processor < static_cast<int>(m_ProcessorShards.size()) ? m_ProcessorShards[processor] : -1;
+		bool found = shard >= firstShard && shard < firstShard + numShards;
+
+		// Otherwise keep the connection on the node of its NIC queue, so that its packets and its state are in the same memory.
+		if(Numa::IsEnabled())
+		{
+			int node = Numa::GetProcessorNode(affinity.Processor);
+
+			int numLocalShards = 0;
+			for(int i = firstShard ; i < firstShard + numShards ; ++i)
+			{
+				numLocalShards += m_Shards[i]->node == node ? 1 : 0;
+			}
+
+			Numa::CountConnection(node, found || numLocalShards > 0);
+
+			if(!found && numLocalShards > 0)
+			{
+				int turn = static_cast<int>(static_cast<unsigned long>(InterlockedIncrement(&m_NextShard)) % numLocalShards);
+				for(int i = firstShard, local = 0 ; i < firstShard + numShards ; ++i)
+				{
+					if(m_Shards[i]->node == node && local++ == turn)
+					{
+						return i;
+					}
+				}
+			}
+		}
+
+		if(found)
+		{
+			return shard;
+		}
+	}
+
+	// RSS is not available (e.g. loopback), or no shard runs on the processor. Spread connections evenly instead.
+	return firstShard + static_cast<int>(static_cast<unsigned long>(InterlockedIncrement(&m_NextShard)) % numShards);
+}
+
+
+bool Server::AssociateIO(SOCKET socket, int shard, TP_IO** outTPIO)
+{
+	assert(outTPIO);
+
+	if(m_Config.backend == IO_THREADS)
+	{
+		assert(shard >= 0 && shard < static_cast<int>(m_Shards.size()));
+
+		*outTPIO = NULL;
+		return CreateIoCompletionPort(reinterpret_cast<HANDLE>(socket), m_Shards[shard]->completionPort, 0, 0) != NULL;
+	}
+
+	*outTPIO = CreateThreadpoolIo(reinterpret_cast<HANDLE>(socket), Server::IoCompletionCallback, NULL, NULL);
+	return *outTPIO != NULL;
+}
+
+
+void Server::StartIO(Client* client, TP_IO* pTPIO)
+{
+	// Every pending I/O holds a reference so that the client outlives its completions and is never recycled under them.
+	client->AddRef();
+
+	if(m_Config.backend == THREAD_POOL)
+	{
+		StartThreadpoolIo(pTPIO);
+	}
+}
+
+
+void Server::CancelIO(Client* client, TP_IO* pTPIO)
+{
+	if(m_Config.backend == THREAD_POOL)
+	{
+		CancelThreadpoolIo(pTPIO);
+	}
+
+	EndIO(client);
+}
+
+
+void Server::EndIO(Client* client)
+{
+	if(client->Release() == 0)
+	{
+		Client::Destroy(client);
+	}
+}
+
+
+size_t Server::GetNumClients()
+{
+	if(m_Config.sharedNothing)
+	{
+		size_t numClients = 0;
+		for(ShardList::iterator itor = m_Shards.begin() ; itor != m_Shards.end() ; ++itor)
+		{
+			numClients += (*itor)->numClients;
+		}
+		return numClients;
+	}
+
+	CSLocker lock(&m_CSForClients);
+
+	return m_Clients.size();
+}
+
+long Server::GetNumPostAccepts()
+{
+	long numPostAccept = 0;
+	for(ListenerList::const_iterator itor = m_Listeners.begin() ; itor != m_Listeners.end() ; ++itor)
+	{
+		numPostAccept += (*itor)->numPostAccept;
+	}
+	return numPostAccept;
+}
+
+long long Server::GetNumAccepts()
+{
+	return m_NumAccepts;
+}
+
+void Server::GetIOStats(IOStats& outStats)
+{
+	outStats.numIOCalls = m_NumIOCalls;
+	outStats.numDequeueCalls = m_NumDequeueCalls;
+	outStats.numCompletions = m_NumCompletions;
+	outStats.numSendCalls = m_NumSendCalls;
+	outStats.numSentPackets = m_NumSentPackets;
+	outStats.numZeroCopySends = m_NumZeroCopySends;
+	outStats.numZeroCopyBytes = m_NumZeroCopyBytes;
+	outStats.numDatagramsReceived = m_NumDatagramsReceived;
+	outStats.numDatagramsSent = m_NumDatagramsSent;
+	outStats.numDatagramsDropped = m_NumDatagramsDropped;
+	outStats.numTimeouts = m_NumTimeouts;
+	outStats.numBlockedSends = m_NumBlockedSends;
+	outStats.numBlockedDrops = m_NumBlockedDrops;
+}
+
+void Server::CountBlockedSend(bool dropped)
+{
+	InterlockedIncrement64(dropped ? &m_NumBlockedDrops : &m_NumBlockedSends);
+}
+
+size_t Server::GetNumShards()
+{
+	return m_Shards.size();
+}
+
+void Server::GetShardStats(size_t shard, ShardStats& outStats)
+{
+	assert(shard < m_Shards.size());
+
+	outStats.numClients = m_Shards[shard]->numClients;
+	outStats.numCompletions = m_Shards[shard]->numCompletions;
+	outStats.numMessages = m_Shards[shard]->numMessages;
+	outStats.node = m_Shards[shard]->node;
+}
+
+
+bool Server::HasTimeouts()
+{
+	return m_Config.idleTimeout > 0 || m_Config.firstMessageTimeout > 0 || m_Config.partialMessageTimeout > 0;
+}
+
+
+Server::ClientTimers* Server::CreateTimers()
+{
+	ClientTimers* timers = new ClientTimers;
+	timers->wheel = new TimerWheel(TIMER_TICK, GetTickCount64());
+	InitializeCriticalSection(&timers->cs);
+	timers->nextTick = 0;
+	m_Timers.push_back(timers);
+	return timers;
+}
+
+
+void Server::StopTimers()
+{
+	if( m_TimersTPTIMER != NULL )
+	{
+		SetThreadpoolTimer( m_TimersTPTIMER, NULL, 0, 0 );
+		WaitForThreadpoolTimerCallbacks( m_TimersTPTIMER, true );
+		CloseThreadpoolTimer( m_TimersTPTIMER );
+		m_TimersTPTIMER = NULL;
+	}
+
+	// Clients are destroyed without being removed when shutting down, so their timers are dropped here.
+	for(ClientTimersList::iterator itor = m_Timers.begin() ; itor != m_Timers.end() ; ++itor)
+	{
+		CSLocker lock(&(*itor)->cs);
+		(*itor)->wheel->CancelAll();
 	}
 }
 
 
-void Server::PostSend(Client* client, Packet* packet)
+void Server::DestroyTimers()
+{
+	for(ClientTimersList::iterator itor = m_Timers.begin() ; itor != m_Timers.end() ; ++itor)
+	{
+		ClientTimers* timers = *itor;
+		timers->wheel->CancelAll();
+		delete timers->wheel;
+		DeleteCriticalSection(&timers->cs);
+		delete timers;
+	}
+	m_Timers.clear();
+}
+
+
+void Server::ArmAcceptTimeout(Client* client, OVERLAPPED* overlapped)
 {
 	assert(client);
-	assert(packet);
 
-	if (client->GetState() != Client::ACCEPTED)
+	if(m_Timers.empty() || m_Config.firstMessageTimeout == 0)
 	{
 		return;
 	}
 
-	WSABUF recvBufferDescriptor;
-	recvBufferDescriptor.buf = reinterpret_cast<char*>(packet->GetData());
-	recvBufferDescriptor.len = packet->GetSize();
+	// Accepts complete on the first shard, as the listeners are bound to it.
+	ClientTimers* timers = m_Timers[0];
+	CSLocker lock(&timers->cs);
 
-	DWORD sendFlags = 0;
+	client->GetTimer().context = client;
+	client->SetTimeout(Client::TIMEOUT_ACCEPT, 0, overlapped);
+	timers->wheel->Arm(&client->GetTimer(), m_Config.firstMessageTimeout);
+}
 
-	IOEvent* event = IOEvent::Create(IOEvent::SEND, client, packet);
-	assert(event);
-	
-	StartThreadpoolIo(client->GetTPIO());
 
-	if(WSASend(client->GetSocket(), &recvBufferDescriptor, 1, NULL, sendFlags, &event->GetOverlapped(), NULL) == SOCKET_ERROR)
+void Server::UpdateTimeout(Client* client)
+{
+	assert(client);
+
+	// Upstream connections have timeouts of their own in UpstreamPool.
+	if(m_Timers.empty() || m_ShuttingDown || client->IsUpstream())
 	{
-		int error = WSAGetLastError();
+		return;
+	}
 
-		if(error != ERROR_IO_PENDING)
-		{
-			CancelThreadpoolIo(client->GetTPIO());
+	Client::Timeout timeout = Client::TIMEOUT_IDLE;
+	DWORD delay = m_Config.idleTimeout;
+	if(!client->HasReceivedMessage() && m_Config.firstMessageTimeout > 0)
+	{
+		timeout = Client::TIMEOUT_FIRST_MESSAGE;
+		delay = m_Config.firstMessageTimeout;
+	}
+	else if(m_Config.partialMessageTimeout > 0 && client->HasPartialMessage())
+	{
+		timeout = Client::TIMEOUT_PARTIAL_MESSAGE;
+		delay = m_Config.partialMessageTimeout;
+	}
 
-			ERROR_CODE(error, "WSASend() failed.");
+	int wheel = client->GetShard() % static_cast<int>(m_Timers.size());
+	if(client->GetTimer().IsArmed() && client->GetTimerWheel() != wheel)
+	{
+		CancelTimeout(client);
+	}
 
-			RequestRemoveClient(client);
-		}
+	ClientTimers* timers = m_Timers[wheel];
+	CSLocker lock(&timers->cs);
+
+	// The deadlines of the first message and of a partial message run from when they started.
+	// More data do not push them back, so that a client trickling bytes in can't keep its connection.
+	if(timeout != Client::TIMEOUT_IDLE && client->GetTimer().IsArmed() && client->GetTimeout() == timeout)
+	{
+		return;
 	}
-	else
+
+	if(delay == 0)
 	{
-		// In this case, the completion callback will have already been scheduled to be called.
+		timers->wheel->Cancel(&client->GetTimer());
+		client->SetTimeout(Client::TIMEOUT_NONE, wheel);
+		return;
 	}
+
+	client->GetTimer().context = client;
+	client->SetTimeout(timeout, wheel);
+	timers->wheel->Arm(&client->GetTimer(), delay);
 }
 
 
-void Server::OnAccept(IOEvent* event)
+void Server::CancelTimeout(Client* client)
 {
-	assert(event);
+	assert(client);
 
-	LOG("[%d] Enter OnAccept()", GetCurrentThreadId());
-	assert(event->GetType() == IOEvent::ACCEPT);
+	if(m_Timers.empty())
+	{
+		return;
+	}
 
-	// Check if we need to post more accept requests.
-	InterlockedDecrement(&m_NumPostAccept);
+	ClientTimers* timers = m_Timers[client->GetTimerWheel()];
+	CSLocker lock(&timers->cs);
 
-	// Add client in a different thread.
-	// It is because we need to return this function ASAP so that this IO worker thread can process the other IO notifications.
-	// If adding client is fast enough, we can call it here but I assume it's slow.	
-	if(!m_ShuttingDown && TrySubmitThreadpoolCallback(Server::WorkerAddClient, event->GetClient(), &m_ClientTPENV) == false)
+	timers->wheel->Cancel(&client->GetTimer());
+	client->SetTimeout(Client::TIMEOUT_NONE, client->GetTimerWheel());
+}
+
+
+void Server::AdvanceTimers(ClientTimers* timers)
+{
+	assert(timers);
+
+	// Called after every batch of completions, so keep it cheap when there is nothing to do.
+	ULONGLONG now = GetTickCount64();
+	if(now < timers->nextTick)
 	{
-		ERROR_CODE(GetLastError(), "Could not start `.");
+		return;
+	}
 
-		AddClient(event->GetClient());
+	// Another thread of the shard is at it.
+	if(!TryEnterCriticalSection(&timers->cs))
+	{
+		return;
 	}
 
-	LOG("[%d] Leave OnAccept()", GetCurrentThreadId());
-}
+	timers->nextTick = now + TIMER_TICK;
+	timers->expired.clear();
+	timers->wheel->Advance(now, timers->expired);
 
+	// Handled under the lock, as clients cancel their timers under it before they are destroyed.
+	for(size_t i = 0 ; i < timers->expired.size() ; ++i)
+	{
+		OnTimeout(static_cast<Client*>(timers->expired[i]->context));
+	}
 
-void Server::OnRecv(IOEvent* event, DWORD dwNumberOfBytesTransfered)
-{
-	assert(event);
+	LeaveCriticalSection(&timers->cs);
+}
 
-	LOG("[%d] Enter OnRecv()", GetCurrentThreadId());
 
-	Client* client = event->GetClient();
+void Server::OnTimeout(Client* client)
+{
 	assert(client);
 
-	LOG("[%d] OnRecv : %s", GetCurrentThreadId(), client->GetRecvCallBuff());
+	Client::Timeout timeout = client->GetTimeout();
+	int wheel = client->GetTimerWheel();
+	client->SetTimeout(Client::TIMEOUT_NONE, wheel);
+
+	if(timeout == Client::TIMEOUT_ACCEPT)
+	{
+		// SO_CONNECT_TIME is the number of seconds connected, or 0xFFFFFFFF while the accept is still waiting for a connection.
+		DWORD seconds = 0xFFFFFFFF;
+		int size = sizeof(seconds);
+		getsockopt(client->GetSocket(), SOL_SOCKET, SO_CONNECT_TIME, reinterpret_cast<char*>(&seconds), &size);
 
-	client->OnRecvComplete(dwNumberOfBytesTransfered);
+		DWORD connected = seconds != 0xFFFFFFFF ? seconds * 1000 : 0;
+		if(connected < m_Config.firstMessageTimeout)
+		{
+			client->SetTimeout(Client::TIMEOUT_ACCEPT, wheel, client->GetTimeoutData());
+			m_Timers[wheel]->wheel->Arm(&client->GetTimer(), seconds != 0xFFFFFFFF ? m_Config.firstMessageTimeout - connected : m_Config.firstMessageTimeout);
+			return;
+		}
 
-	PostRecv(event->GetClient());
+		// Cancelling the accept fails it through OnClose(), which removes the client and replaces the accept.
+		LOG("Client(%p) connected but sent nothing for %d seconds.", client, seconds);
+		InterlockedIncrement64(&m_NumTimeouts);
+		CancelIoEx(reinterpret_cast<HANDLE>(m_Listeners[client->GetListener()]->socket), static_cast<OVERLAPPED*>(client->GetTimeoutData()));
+		return;
+	}
 
-	LOG("[%d] Leave OnRecv()", GetCurrentThreadId());
+	LOG("Client(%p) timed out. timeout[%d]", client, timeout);
+	InterlockedIncrement64(&m_NumTimeouts);
+	RequestRemoveClient(client);
 }
 
 
-void Server::OnSend(IOEvent* event, DWORD dwNumberOfBytesTransfered)
+void Server::UpdateServices()
 {
-	assert(event);
+	CSLocker lock(&m_CSForServices);
 
-	LOG("[%d] OnSend : %d, client(%p)", GetCurrentThreadId(), dwNumberOfBytesTransfered, event->GetClient());
+	ClientList stalledClients;
+	ClientList resumedClients;
+	ULONGLONG now = m_Config.sendStallTimeout > 0 ? GetTickCount64() : 0;
 
-	// This should be fast enough to do in this I/O thread.
-	// if not, we need to queue it like what we do in OnRecv().
-	Packet::Destroy(event->GetPacket());
-}
+	{
+		CSLocker lockClients(&m_CSForClients);
+		for(ClientList::iterator itor = m_Clients.begin() ; itor != m_Clients.end() ; ++itor)
+		{
+			Client* client = *itor;
+			rapidjson::Document data;
+
+			if (client->PopRecvData(data))
+			{
+				OnDatagramSessionRequest(client, data);
+				EchoService::OnRecv(client, data);
+				TicTacToeService::OnRecv(client, data);
+			}
 
+			// Datagrams go to the same services. They tell them apart by type if they need to.
+			rapidjson::Document datagram;
+			if (client->PopDatagram(datagram))
+			{
+				EchoService::OnRecv(client, datagram);
+				TicTacToeService::OnRecv(client, datagram);
+			}
 
-void Server::OnClose(IOEvent* event)
-{
-	assert(event);
+			CheckClientFlow(client, now, stalledClients, resumedClients);
+		}
+	}
 
-	LOG("Client's socket has been closed.");
+	// Removal can happen right here when shutting down, so do it after iterating m_Clients.
+	// Clients can't be destroyed meanwhile as RemoveClientFromServices() waits for m_CSForServices.
+	for(ClientList::iterator itor = resumedClients.begin() ; itor != resumedClients.end() ; ++itor)
+	{
+		UpdateTimeout(*itor);
+		PostRecv(*itor);
+	}
 
-	if (event->GetPacket())
+	for(ClientList::iterator itor = stalledClients.begin() ; itor != stalledClients.end() ; ++itor)
 	{
-		Packet::Destroy(event->GetPacket());
+		RequestRemoveClient(*itor);
 	}
 
-	// we should remove this client in a different thread as client will wait i/o for its socket.
-	RequestRemoveClient(event->GetClient());
+	TicTacToeService::Update();
+	UpstreamPool::Update();
+
 }
 
+void Server::RemoveClientFromServices(Client* client)
+{
+	CSLocker lock(&m_CSForServices);
+	TicTacToeService::RemoveClient(client);
+}
 
-void Server::AddClient(Client* client)
+void Server::CheckClientFlow(Client* client, ULONGLONG now, ClientList& outStalled, ClientList& outResumed)
 {
-	assert(client);
+	// A client which does not read what we send would keep holding packets.
+	if (m_Config.sendStallTimeout > 0 && client->CheckSendStalled(now, m_Config.sendStallTimeout))
+	{
+		LOG("Client(%p) has been blocked on sending for too long. pending[%d]", client, client->GetPendingSendBytes());
+		outStalled.push_back(client);
+	}
+	// Receiving paused on a full backlog resumes once it has drained.
+	else if (client->CheckRecvResume())
+	{
+		outResumed.push_back(client);
+	}
+	else if (client->CheckRecvStuck())
+	{
+		LOG("Client(%p) filled its receive backlog without a complete message.", client);
+		outStalled.push_back(client);
+	}
+}
 
-	// The socket sAcceptSocket does not inherit the properties of the socket associated with sListenSocket parameter until SO_UPDATE_ACCEPT_CONTEXT is set on the socket.
-	if (setsockopt(client->GetSocket(), SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT, reinterpret_cast<const char *>(&m_listenSocket), sizeof(m_listenSocket)) == SOCKET_ERROR)
+
+void Server::PostShardMessage(int shard, ShardMessage* message)
+{
+	assert(shard >= 0 && shard < static_cast<int>(m_Shards.size()));
+	assert(message);
+
+	if(FALSE == PostQueuedCompletionStatus(m_Shards[shard]->completionPort, 0, SHARD_MESSAGE_KEY, reinterpret_cast<OVERLAPPED*>(message)))
 	{
-		ERROR_CODE(WSAGetLastError(), "setsockopt() for AcceptEx() failed.");
+		// The references the message holds are lost with it, so its client is only freed by Shutdown().
+		ERROR_CODE(GetLastError(), "Could not post a message to shard %d. type[%d]", shard, message->type);
 
-		RequestRemoveClient(client);
-	}		
-	else
+		if(message->packet != NULL)
+		{
+			Packet::Destroy(message->packet);
+		}
+		delete message;
+	}
+}
+
+
+void Server::OnShardMessage(IOShard* shard, ShardMessage* message)
+{
+	assert(shard);
+	assert(message);
+
+	InterlockedIncrement64(&shard->numMessages);
+
+	Client* client = message->client;
+
+	switch(message->type)
 	{
-		client->SetState(Client::ACCEPTED);
+	case ShardMessage::ADD_CLIENT:
+		shard->clients.push_back(client);
 
-		// Connect the socket to IOCP
-		TP_IO* pTPIO = CreateThreadpoolIo(reinterpret_cast<HANDLE>(client->GetSocket()), Server::IoCompletionCallback, NULL, NULL);
-		if(pTPIO == NULL)
+		// Data which have come with the accept.
+		ProcessClient(shard, client);
+		break;
+
+	case ShardMessage::REMOVE_CLIENT:
 		{
-			ERROR_CODE(GetLastError(), "CreateThreadpoolIo failed for a client.");
+			ClientList::iterator itor = std::find(shard->clients.begin(), shard->clients.end(), client);
+			if(itor != shard->clients.end())
+			{
+				shard->clients.erase(itor);
+				InterlockedDecrement(&shard->numClients);
+			}
 
-			RequestRemoveClient(client);
+			// From now on, no shard takes the client into a game.
+			long serviceShard = client->UnbindServiceShard();
+			if(serviceShard >= 0 && serviceShard != shard->index)
+			{
+				// The shard of its games lets it go in turn, with the references.
+				message->type = ShardMessage::SERVICE_REMOVE;
+				PostShardMessage(serviceShard, message);
+				return;
+			}
+
+			TicTacToeService::RemoveClient(shard->games, client);
+			client->Release();
+			EndIO(client);
 		}
-		else
-		{
-			std::string ip;
-			u_short port = 0;
-			Network::GetRemoteAddress(client->GetSocket(), ip, port);
-			LOG("[%d] Accept succeeded. client address : ip[%s], port[%d]", GetCurrentThreadId(), ip.c_str(), port);
+		break;
 
-			client->SetTPIO(pTPIO);
+	case ShardMessage::SERVICE_REMOVE:
+		TicTacToeService::RemoveClient(shard->games, client);
+		client->Release();
+		EndIO(client);
+		break;
 
+	case ShardMessage::SERVICE_DATA:
+		{
+			rapidjson::Document data;
+			data.Parse<0>(message->data.c_str());
+			if(!data.HasParseError())
 			{
-				CSLocker lock(&m_CSForClients);
-				m_Clients.push_back(client);
+				TicTacToeService::OnRecv(shard->games, client, data);
 			}
+			EndIO(client);
+		}
+		break;
 
-	
-			PostRecv(client);
+	case ShardMessage::MATCH:
+		// Back on the shard of the client, no other shard has had a game waiting.
+		MatchClient(shard, client, message->origin, message->origin == shard->index);
+		EndIO(client);
+		break;
+
+	case ShardMessage::BROADCAST:
+		for(ClientList::iterator itor = shard->clients.begin() ; itor != shard->clients.end() ; ++itor)
+		{
+			message->packet->AddRef();
+			PostSend(*itor, message->packet);
 		}
+		Packet::Destroy(message->packet);
+		break;
+
+	default:
+		assert(0);
+		break;
 	}
+
+	delete message;
 }
 
 
-void Server::RemoveClient(Client* client)
+void Server::ProcessClient(IOShard* shard, Client* client)
 {
+	assert(shard);
 	assert(client);
 
+	// Run every message to completion, rather than one per client in turn as UpdateServices() does.
+	while(true)
 	{
-		CSLocker lock(&m_CSForClients);
-		ClientList::iterator itor = std::remove(m_Clients.begin(), m_Clients.end(), client);
-
-		if(itor != m_Clients.end())
+		rapidjson::Document data;
+		if (!client->PopRecvData(data))
 		{
-			m_Clients.erase(itor);
+			break;
 		}
+
+		OnDatagramSessionRequest(client, data);
+		EchoService::OnRecv(client, data);
+		OnServiceData(shard, client, data);
 	}
 
-	RemoveClientFromServices(client);
+	while(true)
+	{
+		rapidjson::Document datagram;
+		if (!client->PopDatagram(datagram))
+		{
+			break;
+		}
 
-	Client::Destroy(client);
+		EchoService::OnRecv(client, datagram);
+		OnServiceData(shard, client, datagram);
+	}
 }
 
-void Server::PostBoradcast(Packet* packet)
-{
-	assert(packet);
-	assert(packet->GetSender());
 
-	CSLocker lock(&m_CSForClients);
+void Server::OnServiceData(IOShard* shard, Client* client, rapidjson::Document& data)
+{
+	long serviceShard = client->GetServiceShard();
 
-	for(ClientList::iterator itor = m_Clients.begin() ; itor != m_Clients.end() ; ++itor)
+	if(serviceShard == shard->index)
+	{
+		TicTacToeService::OnRecv(shard->games, client, data);
+	}
+	else if(serviceShard >= 0)
 	{
-		PostSend(*itor, packet);
+		// The client plays on another shard, so the message goes there.
+		rapidjson::StringBuffer buffer;
+		rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+		data.Accept(writer);
+
+		ShardMessage* message = new ShardMessage(ShardMessage::SERVICE_DATA, client);
+		message->data.assign(buffer.GetString(), buffer.Size());
+		client->AddRef();
+		PostShardMessage(serviceShard, message);
+	}
+	else if(serviceShard == Client::SERVICE_SHARD_NONE && TicTacToeService::IsCreateRequest(data))
+	{
+		MatchClient(shard, client, shard->index, false);
 	}
 }
 
-void Server::RequestRemoveClient(Client* client)
+
+void Server::MatchClient(IOShard* shard, Client* client, int origin, bool open)
 {
-	if(!m_ShuttingDown && TrySubmitThreadpoolCallback(Server::WorkerRemoveClient, client, &m_ClientTPENV) == false)
+	// Ask the next shard if there is no game to enter here. Back on the client's shard, it opens one.
+	if(!open && m_Shards.size() > 1 && !TicTacToeService::CanEnter(shard->games))
 	{
-		ERROR_CODE(GetLastError(), "can't start WorkerRemoveClient. call it directly.");
+		ShardMessage* message = new ShardMessage(ShardMessage::MATCH, client);
+		message->origin = origin;
+		client->AddRef();
+		PostShardMessage((shard->index + 1) % static_cast<int>(m_Shards.size()), message);
+		return;
+	}
 
-		RemoveClient(client);
+	// Bound before it enters, so that its removal, whenever it comes, finds this shard and takes it out of the game here.
+	// A client which has left in the meantime is not taken in.
+	if(client->BindServiceShard(shard->index))
+	{
+		TicTacToeService::Enter(shard->games, client);
 	}
 }
 
-size_t Server::GetNumClients()
-{
-	CSLocker lock(&m_CSForClients);
-
-	return m_Clients.size();
-}
 
-long Server::GetNumPostAccepts()
+void Server::UpdateShard(IOShard* shard)
 {
-	return m_NumPostAccept;
-}
+	assert(shard);
 
+	TicTacToeService::Update(shard->games);
 
-void Server::UpdateServices()
-{
-	CSLocker lock(&m_CSForServices);
+	// Checking every client is for the timer tick, not for every batch of completions.
+	ULONGLONG now = GetTickCount64();
+	if(now < shard->nextUpdate)
+	{
+		return;
+	}
+	shard->nextUpdate = now + TIMER_TICK;
 
+	ClientList stalledClients;
+	ClientList resumedClients;
+
+	for(ClientList::iterator itor = shard->clients.begin() ; itor != shard->clients.end() ; ++itor)
 	{
-		CSLocker lockClients(&m_CSForClients);
-		for(ClientList::iterator itor = m_Clients.begin() ; itor != m_Clients.end() ; ++itor)
-		{
-			Client* client = *itor;
-			rapidjson::Document data;
+		Client* client = *itor;
 
-			if (client->PopRecvData(data))
-			{
-				EchoService::OnRecv(client, data);
-				TicTacToeService::OnRecv(client, data);
-			}
-		}
-	}
+		// Messages left behind by a parse error, and datagrams sent to the port of another shard.
+		ProcessClient(shard, client);
 
-	TicTacToeService::Update();
+		CheckClientFlow(client, now, stalledClients, resumedClients);
+	}
 
-}
+	for(ClientList::iterator itor = resumedClients.begin() ; itor != resumedClients.end() ; ++itor)
+	{
+		UpdateTimeout(*itor);
+		PostRecv(*itor);
+	}
 
-void Server::RemoveClientFromServices(Client* client)
-{
-	CSLocker lock(&m_CSForServices);
-	TicTacToeService::RemoveClient(client);
+	for(ClientList::iterator itor = stalledClients.begin() ; itor != stalledClients.end() ; ++itor)
+	{
+		RequestRemoveClient(*itor);
+	}
 }
 
@@ -1,10 +1,16 @@
 #pragma once
 
 #include <winsock2.h>
+#include <mstcpip.h>
 #include <vector>
+#include <map>
+#include <set>
+#include <string>
 #include <rapidjson\document.h>
 
 #include "TSingleton.h"
+#include "Network.h"
+#include "TimerWheel.h"
 
 class Client;
 class Packet;
@@ -14,69 +20,365 @@ class TicTacToeService;
 
 class Server :  public TSingleton<Server>
 {
+private:
+	enum
+	{
+		MAX_SEND_BUFFERS = 64, // max packet segments gathered into one WSASend(). at least Packet::MAX_SEGMENTS.
+		DATAGRAM_HEADER_SIZE = 4, // session token in network byte order, followed by a null-terminated message.
+	};
+
 private:
 	// Callback Routine
 	static void CALLBACK IoCompletionCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context, PVOID Overlapped, ULONG IoResult, ULONG_PTR NumberOfBytesTransferred, PTP_IO Io);
 
+	// I/O Thread Function (used instead of the thread pool with IO_THREADS). param is the IOShard of the thread.
+	static DWORD WINAPI IOThreadMain(LPVOID param);
+
 	// Worker Thread Functions
-	static void CALLBACK WorkerPostAccept(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_WORK /* Work */);
+	static void CALLBACK WorkerRetryAccept(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_TIMER /* Timer */);
+	// Ticks the timer wheel with the thread pool backend. I/O threads tick the wheels of their shards.
+	static void CALLBACK WorkerTimers(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_TIMER /* Timer */);
 	static void CALLBACK WorkerServiceUpdate(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_WORK /* Work */);
 
 	static void CALLBACK WorkerAddClient(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
 	static void CALLBACK WorkerRemoveClient(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
 
+public:
+	enum Backend
+	{
+		THREAD_POOL,	// completions are dispatched by the Windows thread pool.
+		IO_THREADS,		// a fixed set of I/O threads dequeue completions from our own completion port in batches.
+	};
+
+	enum RecvMode
+	{
+		RECV_PER_CLIENT,	// each client keeps a receive buffer posted with WSARecv() while connected.
+		RECV_SHARED,		// zero-byte WSARecv() then non-blocking recv() into a buffer borrowed from RecvBufferPool.
+	};
+
+	enum AcceptMode
+	{
+		ACCEPT_ONLY,		// AcceptEx() completes on connection. the client is added in a worker thread and its first receive is posted.
+		ACCEPT_WITH_DATA,	// AcceptEx() completes with the first data, which is handed to the client in the I/O thread.
+	};
+
+	// An extra TCP address to listen on besides the port given to Init().
+	struct ListenAddress
+	{
+		ListenAddress() : port(0), numShards(0), socketProfile(NULL) {}
+
+		std::string host;	// an interface address, "::" or "0.0.0.0". IPv6 addresses without brackets.
+		u_short port;
+		int numShards;		// IO_THREADS only. shards of its own for the clients of this address. 0 shares the common shards.
+		const Network::SocketProfile* socketProfile;	// for this address and the sockets it accepts. NULL uses Config::socketProfile.
+	};
+
+	struct Config
+	{
+		Config() : backend(THREAD_POOL), numIOThreads(0), numShards(1), completionBatchSize(64), recvMode(RECV_PER_CLIENT), acceptMode(ACCEPT_ONLY), 
+			zeroCopyThreshold(0), sendHighWatermark(0), sendLowWatermark(0), sendStallTimeout(0), 
+			recvBacklogLimit(0), socketProfile(&Network::GetDefaultSocketProfile()), warmClients(0), 
+			datagramPort(0), datagramRecvDepth(32), dualStack(false), takeOver(false), drainTimeout(0), 
+			idleTimeout(0), firstMessageTimeout(0), partialMessageTimeout(0), busyPollSpin(0), sharedNothing(false), numaAware(false) {}
+
+		Backend backend;
+		int numIOThreads;			// IO_THREADS only. 0 means the number of processors. split evenly over the shards.
+		int numShards;				// IO_THREADS only. each shard has its own completion port and core.
+		int completionBatchSize;	// IO_THREADS only. max completions dequeued by one GetQueuedCompletionStatusEx().
+		DWORD busyPollSpin;			// IO_THREADS only. us an I/O thread keeps polling its port after the last completion before it sleeps. 0 disables it.
+		std::vector<int> ioCores;	// IO_THREADS only. processors the I/O threads are pinned to, a thread each in turn, numbered over all processor groups. empty pins each thread to a core of its own, shard by shard.
+		bool sharedNothing;			// IO_THREADS only. a shard per I/O thread, which serves its own clients with its own games. see ShardMessage.
+		bool numaAware;				// IO_THREADS only. shards spread over the NUMA nodes, with their threads and pools on their node. not with ioCores. see Numa.
+		RecvMode recvMode;
+		AcceptMode acceptMode;
+		DWORD zeroCopyThreshold;	// packets of at least this size are sent with no socket send buffer. 0 disables it.
+		DWORD sendHighWatermark;	// outbound bytes per client at which Client::IsSendBlocked() turns on. 0 disables it.
+		DWORD sendLowWatermark;		// outbound bytes per client at which Client::IsSendBlocked() turns off again.
+		DWORD sendStallTimeout;		// ms a client may stay blocked before it is disconnected. 0 never disconnects.
+		size_t recvBacklogLimit;	// unparsed bytes per client at which receiving pauses. 0 disables it. at least Client::MAX_DATA_SIZE.
+		const Network::SocketProfile* socketProfile;	// applied to the listen socket, every accepted socket and upstream connections. see ListenAddress.
+		int warmClients;			// clients kept ready with their sockets. 0 means twice maxPostAccept.
+		u_short datagramPort;		// first port of the datagram sockets, one per shard on consecutive ports, of the family of the port. 0 disables datagrams.
+		int datagramRecvDepth;		// WSARecvFrom() kept posted on each datagram socket.
+		std::string tlsCertificate;	// subject of the certificate in the local machine's MY store. empty disables TLS.
+		std::string unixPath;		// AF_UNIX path to listen on as well as the TCP port. '@' starts an abstract name. empty disables it.
+		bool dualStack;				// listen on the port of Init() with IPv6 and IPv4 on one socket.
+		std::vector<ListenAddress> listenAddresses;
+		bool takeOver;				// take the listening sockets over from the server running on the same port. see HotRestart.
+		DWORD drainTimeout;			// ms to wait for clients to leave after handing the listeners over. 0 waits for all of them.
+		DWORD idleTimeout;			// ms a client may send nothing before it is disconnected. 0 disables it.
+		DWORD firstMessageTimeout;	// ms from connecting to the first complete message, including the TLS handshake. 0 disables it.
+		DWORD partialMessageTimeout;	// ms from the first byte of a message to its end. 0 disables it.
+	};
+
+	struct ShardStats
+	{
+		long numClients;
+		long long numCompletions;
+		long long numMessages;		// handled ShardMessages. shared-nothing mode only.
+		int node;					// NUMA node of its threads.
+	};
+
+	struct IOStats
+	{
+		long long numIOCalls;		// AcceptEx, WSARecv, WSASend calls.
+		long long numDequeueCalls;	// GetQueuedCompletionStatusEx calls which returned completions. IO_THREADS only.
+		long long numCompletions;
+		long long numSendCalls;		// WSASend calls.
+		long long numSentPackets;	// packets sent by those calls.
+		long long numZeroCopySends;	// WSASend calls with no socket send buffer.
+		long long numZeroCopyBytes;
+		long long numDatagramsReceived;
+		long long numDatagramsSent;
+		long long numDatagramsDropped;	// no session, malformed or too many waiting.
+		long long numTimeouts;		// clients disconnected by Config's timeouts.
+		long long numBlockedSends;	// messages sent anyway to clients blocked on sending.
+		long long numBlockedDrops;	// messages dropped for clients blocked on sending.
+	};
+
 public:
 	Server();
 	virtual ~Server();
 
-	bool Init(unsigned short port, int maxPostAccept);
+	bool Init(unsigned short port, int maxPostAccept, const Config& config = Config());
 	void Shutdown();
 
 	size_t GetNumClients();
 	long GetNumPostAccepts();
+	long long GetNumAccepts();
+	void GetIOStats(IOStats& outStats);
+
+	size_t GetNumShards();
+	void GetShardStats(size_t shard, ShardStats& outStats);
 
+	// Both take over the caller's reference to the packet.
+	// A broadcast packet is serialized once and shared by all clients until the last send completes.
 	void PostSend(Client* client, Packet* packet);
 	void PostBoradcast(Packet* packet);
 
+	// Unreliable. Takes over the caller's reference to the packet and drops it if the client has no datagram session yet.
+	// A client gets its session by sending {"type":"udp_session"} over TCP, and binds its address with its first datagram.
+	void SendDatagram(Client* client, Packet* packet);
+
+	// Services count each message to a client which is blocked on sending here, rather than logging every one.
+	void CountBlockedSend(bool dropped);
+
 	void RequestRemoveClient(Client* client);
 
+	// Hands the listening sockets over to a new server started with Config::takeOver and stops accepting.
+	// Connected clients are served until they leave. Returns false if no new server took them, in which case accepting goes on.
+	bool HandOff();
+	bool IsHandedOff() { return m_HandedOff != 0; }
+
+	// Connects an upstream client. The result is reported to UpstreamPool, a failure through RemoveClient().
+	void PostConnect(Client* client, const sockaddr* address, int addressLength);
+
 private:
+	typedef std::vector<Client*> ClientList;
+
+	struct Listener;
+	bool CreateTcpListener(const char* host, u_short port, int family, bool dualStack, int numShards, const Network::SocketProfile& profile);
+	bool CreateUnixListener(const std::string& path);
+	SOCKET TakeInheritedSocket();
+	bool StartListener(Listener* listener);
+	void CloseListeners();
+
 	void PostAccept();
+	void PostAccept(Listener* listener);
+	bool PostAcceptOne(Listener* listener);
+	// Called when an accept completes or fails, before its event is destroyed.
+	void OnAcceptDone(IOEvent* event);
 	void PostRecv(Client* client);
+	void FlushSend(Client* client);
+	void SetZeroCopySend(Client* client, bool zeroCopy);
 
-	void OnAccept(IOEvent* event);
+	void OnCompletion(IOEvent* event, ULONG ioResult, DWORD dwNumberOfBytesTransfered);
+
+	void OnAccept(IOEvent* event, DWORD dwNumberOfBytesTransfered);
 	void OnRecv(IOEvent* event, DWORD dwNumberOfBytesTransfered);
+	void OnRecvNotify(IOEvent* event);
 	void OnSend(IOEvent* event, DWORD dwNumberOfBytesTransfered);
+	void OnConnect(IOEvent* event);
+	void OnDatagram(IOEvent* event, ULONG ioResult, DWORD dwNumberOfBytesTransfered);
 	void OnClose(IOEvent* event);
 
-	void AddClient(Client* client);
+	bool CreateShards();
+	// The processor the thread-th I/O thread of the shard on the node is pinned to. An empty mask leaves it to the scheduler.
+	GROUP_AFFINITY GetIOThreadAffinity(int shard, int node, int thread, int numShards, int numThreadsPerShard);
+	void StopShards();
+	void DestroyShards();
+	// Picks one of numShards shards from firstShard.
+	int SelectShard(SOCKET socket, int firstShard, int numShards);
+
+	struct DatagramSlot;
+	bool CreateDatagramSockets();
+	void DestroyDatagramSockets();
+	void PostRecvFrom(DatagramSlot* slot);
+	void OnDatagramRecv(DatagramSlot* slot, DWORD dwNumberOfBytesTransfered);
+	void OnDatagramSessionRequest(Client* client, rapidjson::Document& data);
+	void RemoveDatagramSession(Client* client);
+
+	bool AssociateIO(SOCKET socket, int shard, TP_IO** outTPIO);
+	void StartIO(Client* client, TP_IO* pTPIO);
+	void CancelIO(Client* client, TP_IO* pTPIO);
+	void EndIO(Client* client);
+
+	bool SetupRecv(Client* client);
+	// Hands received bytes to the client, through TLS if it has it. Returns false if receiving has to stop.
+	bool OnRecvData(Client* client, const BYTE* data, int size);
+	bool PushRecvData(Client* client, const BYTE* data, int size);
+	void AddClient(Client* client, DWORD firstDataSize = 0);
 	void RemoveClient(Client* client);
 
+	// timeouts
+	struct ClientTimers;
+	bool HasTimeouts();
+	ClientTimers* CreateTimers();
+	void StopTimers();
+	void DestroyTimers();
+	void ArmAcceptTimeout(Client* client, OVERLAPPED* overlapped);
+	// Arms the timeout for what the client is waiting for now.
+	void UpdateTimeout(Client* client);
+	void CancelTimeout(Client* client);
+	void AdvanceTimers(ClientTimers* timers);
+	void OnTimeout(Client* client);
+
 	void UpdateServices();
 	void RemoveClientFromServices(Client* client);
+	// Disconnects clients stalled on sending or receiving, and collects the ones whose receiving can resume.
+	void CheckClientFlow(Client* client, ULONGLONG now, ClientList& outStalled, ClientList& outResumed);
+
+	// shared-nothing mode
+	struct IOShard;
+	struct ShardMessage;
+	void PostShardMessage(int shard, ShardMessage* message);
+	void OnShardMessage(IOShard* shard, ShardMessage* message);
+	// Serves the messages the client has received. Runs in the thread of the client's shard.
+	void ProcessClient(IOShard* shard, Client* client);
+	void OnServiceData(IOShard* shard, Client* client, rapidjson::Document& data);
+	// Finds a waiting game for the client on this shard or on the next ones, or opens one on origin, its own shard.
+	void MatchClient(IOShard* shard, Client* client, int origin, bool open);
+	void UpdateShard(IOShard* shard);
 
 private:
 	Server& operator=(Server& rhs);
 	Server(const Server& rhs);
 
 private:
-	TP_IO* m_ListenTPIO;
-	SOCKET m_listenSocket;
+	// A listening socket with its own accepts. All listeners share the clients and services.
+	// Its clients go to the common shards or to shards of its own, so that busy addresses can be kept apart.
+	struct Listener
+	{
+		Listener() { InitializeCriticalSection(&cs); }
+		~Listener() { DeleteCriticalSection(&cs); }
 
-	TP_WORK* m_AcceptTPWORK; 
+		int index;
+		int family;			// AF_INET, AF_INET6 or AF_UNIX.
+		std::string name;	// the address, for logs.
+		const Network::SocketProfile* profile;	// NULL for AF_UNIX, which has no transport options.
+		SOCKET socket;
+		TP_IO* tpio;
+		DWORD addressSize;	// each address buffer of AcceptEx().
+		volatile long numPostAccept;
+		int numDedicatedShards;	// requested. 0 shares the common shards.
+		int firstShard;		// the shards its clients are spread over. set by CreateShards().
+		int numShards;
 
-	int	m_MaxPostAccept;
-	volatile long m_NumPostAccept;
+		// Accepts are posted under the lock and stay in pendingAccepts until they complete, so that HandOff() finds them all.
+		std::set<IOEvent*> pendingAccepts;
+		CRITICAL_SECTION cs;
+	};
+
+	typedef std::vector<Listener*> ListenerList;
+	ListenerList m_Listeners;
+	u_short m_Port;
+	std::vector<SOCKET> m_InheritedSockets;	// handed over by the previous server, not taken by a listener yet.
+	volatile long m_HandedOff;
+
+	TP_TIMER* m_AcceptRetryTPTIMER; 
+
+	int	m_MaxPostAccept;	// per listener.
+	volatile LONGLONG m_NumAccepts;
 
 	TP_CALLBACK_ENVIRON m_ClientTPENV;
 	TP_CLEANUP_GROUP* m_ClientTPCLEAN;
 
-	typedef std::vector<Client*> ClientList;
 	ClientList m_Clients;
 	CRITICAL_SECTION m_CSForClients;
 
 	TP_WORK* m_ServiceTPWORK; 
 	CRITICAL_SECTION m_CSForServices;
 
+	Config m_Config;
+
+	typedef std::vector<HANDLE> ThreadList;
+	struct IOShard
+	{
+		int index;
+		HANDLE completionPort;
+		ThreadList threads;
+		volatile long numClients;
+		volatile LONGLONG numCompletions;
+		ClientTimers* timers;	// ticked by the threads of this shard. NULL without timeouts.
+		int node;				// NUMA node its threads are bound to. 0 without Config::numaAware.
+
+		// Shared-nothing mode only. Touched by nothing but the one thread of the shard, so there is no lock.
+		ClientList clients;
+		std::vector<TicTacToeService*> games;
+		ULONGLONG nextUpdate;	// of the clients.
+		volatile LONGLONG numMessages;
+	};
+
+	typedef std::vector<IOShard*> ShardList;
+	ShardList m_Shards;
+	int m_NumCommonShards;		// shards from 0 shared by listeners without their own and by upstream connections.
+	volatile long m_NextShard;
+	std::vector<int> m_ProcessorShards;	// by processor, numbered over all groups. the shard with a thread pinned to it, or -1.
+
+	volatile LONGLONG m_NumIOCalls;
+	volatile LONGLONG m_NumDequeueCalls;
+	volatile LONGLONG m_NumCompletions;
+	volatile LONGLONG m_NumSendCalls;
+	volatile LONGLONG m_NumSentPackets;
+	volatile LONGLONG m_NumZeroCopySends;
+	volatile LONGLONG m_NumZeroCopyBytes;
+
+	struct DatagramSocket
+	{
+		int index;
+		SOCKET socket;
+		TP_IO* tpio;
+	};
+
+	typedef std::vector<DatagramSocket*> DatagramSocketList;
+	typedef std::vector<DatagramSlot*> DatagramSlotList;
+	typedef std::map<DWORD, Client*> DatagramSessionMap;
+	DatagramSocketList m_DatagramSockets;
+	DatagramSlotList m_DatagramSlots;
+	DatagramSessionMap m_DatagramSessions;
+	CRITICAL_SECTION m_CSForDatagramSessions;
+
+	volatile LONGLONG m_NumDatagramsReceived;
+	volatile LONGLONG m_NumDatagramsSent;
+	volatile LONGLONG m_NumDatagramsDropped;
+
+	// A timer wheel per shard, in the order of m_Shards, or just one with the thread pool backend.
+	// A client's timer is on the wheel of its shard, except while its accept is pending, when it is on the first one.
+	struct ClientTimers
+	{
+		TimerWheel* wheel;
+		CRITICAL_SECTION cs;
+		volatile ULONGLONG nextTick;
+		TimerWheel::TimerList expired;
+	};
+
+	typedef std::vector<ClientTimers*> ClientTimersList;
+	ClientTimersList m_Timers;
+	TP_TIMER* m_TimersTPTIMER;
+	volatile LONGLONG m_NumTimeouts;
+
+	volatile LONGLONG m_NumBlockedSends;
+	volatile LONGLONG m_NumBlockedDrops;
+
 	volatile bool m_ShuttingDown;
 };
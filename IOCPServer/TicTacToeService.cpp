@@ -22,49 +22,67 @@
 {
 	LOG("TicTacToeService::Shutdown()");
 
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
-	{
-		delete sServices[i];
-	}
-	sServices.clear();
+	Shutdown(sServices);
 }
 
 
 /*static*/ void TicTacToeService::Update()
 {
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
+	Update(sServices);
+}
+
+/*static*/ void TicTacToeService::OnRecv(Client* client, rapidjson::Document& data)
+{
+	OnRecv(sServices, client, data);
+}
+
+/*static*/ void TicTacToeService::RemoveClient(Client* client)
+{
+	RemoveClient(sServices, client);
+}
+
+/*static*/ void TicTacToeService::Shutdown(ServiceList& services)
+{
+	for (size_t i = 0 ; i < services.size() ; ++i)
 	{
-		sServices[i]->UpdateInternal();
+		delete services[i];
 	}
+	services.clear();
+}
 
-	Flush();
+/*static*/ void TicTacToeService::Update(ServiceList& services)
+{
+	for (size_t i = 0 ; i < services.size() ; ++i)
+	{
+		services[i]->UpdateInternal();
+	}
+
+	Flush(services);
 }
 
-/*static*/ void TicTacToeService::OnRecv(Client* client, rapidjson::Document& data)
+/*static*/ void TicTacToeService::OnRecv(ServiceList& services, Client* client, rapidjson::Document& data)
 {
-	if (CreateOrEnter(client, data))
+	if (CreateOrEnter(services, client, data))
 	{
 		return;
 	}
 
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
+	for (size_t i = 0 ; i < services.size() ; ++i)
 	{
-		sServices[i]->OnRecvInternal(client, data);
+		services[i]->OnRecvInternal(client, data);
 	}
 }
 
-/*static*/ void TicTacToeService::RemoveClient(Client* client)
+/*static*/ void TicTacToeService::RemoveClient(ServiceList& services, Client* client)
 {
-	for (size_t i = 0 ; i < sServices.size() ; ++i)
+	// The client may be gone from its memory right after, so no game may keep it.
+	for (size_t i = 0 ; i < services.size() ; ++i)
 	{
-		if (!sServices[i]->RemoveClientInternal(client))
-		{
-			return;
-		}
+		services[i]->RemoveClientInternal(client);
 	}
 }
 
-/*static*/ bool TicTacToeService::CreateOrEnter(Client* client, rapidjson::Document& data)
+/*static*/ bool TicTacToeService::IsCreateRequest(rapidjson::Document& data)
 {
 	assert(data["type"].IsString());
 	std::string type(data["type"].GetString());
@@ -73,38 +91,63 @@
 		assert(data["name"].IsString());
 		std::string name(data["name"].GetString());
 
-		if (name == "tictactoe")
-		{
-			for (size_t i = 0 ; i < sServices.size() ; ++i)
-			{
-				TicTacToeService* service = sServices[i];
+		return name == "tictactoe";
+	}
+	return false;
+}
 
-				if (service->mFSM.GetState() == kStateWait && service->m_Clients.size() < 2)
-				{
-					service->AddClient(client);
-					return true;
-				}
-			}
+/*static*/ bool TicTacToeService::CanEnter(ServiceList& services)
+{
+	for (size_t i = 0 ; i < services.size() ; ++i)
+	{
+		TicTacToeService* service = services[i];
 
-			TicTacToeService* newService = new TicTacToeService;
-			newService->AddClient(client);
-			sServices.push_back(newService);
+		if (service->mFSM.GetState() == kStateWait && service->m_Clients.size() < 2)
+		{
 			return true;
 		}
 	}
 	return false;
 }
 
-/*static*/ void TicTacToeService::Flush()
+/*static*/ void TicTacToeService::Enter(ServiceList& services, Client* client)
 {
-	for (auto itor = sServices.begin() ; itor != sServices.end() ; )
+	for (size_t i = 0 ; i < services.size() ; ++i)
+	{
+		TicTacToeService* service = services[i];
+
+		if (service->mFSM.GetState() == kStateWait && service->m_Clients.size() < 2)
+		{
+			service->AddClient(client);
+			return;
+		}
+	}
+
+	TicTacToeService* newService = new TicTacToeService;
+	newService->AddClient(client);
+	services.push_back(newService);
+}
+
+/*static*/ bool TicTacToeService::CreateOrEnter(ServiceList& services, Client* client, rapidjson::Document& data)
+{
+	if (IsCreateRequest(data))
+	{
+		Enter(services, client);
+		return true;
+	}
+	return false;
+}
+
+/*static*/ void TicTacToeService::Flush(ServiceList& services)
+{
+	for (auto itor = services.begin() ; itor != services.end() ; )
 	{
 		TicTacToeService* service = *itor;
 
 		if (service->mFSM.GetState() == kStateWait && service->m_Clients.empty())
 		{
 			delete service;
-			itor = sServices.erase(itor);
+			itor = services.erase(itor);
 		}
 		else
 		{
@@ -229,6 +272,12 @@ void TicTacToeService::CheckPlayerConnection()
 
 void TicTacToeService::Send(Client* client, rapidjson::Document& data)
 {
+	// Game messages can't be dropped. A client which stays blocked is disconnected by Server, which cancels the game.
+	if (client->IsSendBlocked())
+	{
+		Server::Instance()->CountBlockedSend(false);
+	}
+
 	rapidjson::StringBuffer buffer;
 	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
 	data.Accept(writer);
@@ -241,10 +290,29 @@ void TicTacToeService::Send(Client* client, rapidjson::Document& data)
 
 void TicTacToeService::Broadcast(rapidjson::Document& data)
 {
+	if (m_Clients.empty())
+	{
+		return;
+	}
+
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	data.Accept(writer);
+
+	// Serialize once and share the packet between players.
+	Packet* packet = Packet::Create(NULL, (const BYTE*)buffer.GetString(), buffer.Size()+1); // includnig null.
+	if (packet == NULL)
+	{
+		return;
+	}
+
 	for (size_t i = 0 ; i < m_Clients.size() ; ++i)
 	{
-		Send(m_Clients[i], data);
+		packet->AddRef();
+		Server::Instance()->PostSend(m_Clients[i], packet);
 	}
+
+	Packet::Destroy(packet);
 }
 
 void TicTacToeService::SetPlayerName(Player& player, rapidjson::Document& data)
@@ -10,6 +10,8 @@ class Client;
 class TicTacToeService
 {
 public:
+	typedef std::vector<TicTacToeService*> ServiceList;
+
 	static void Init();
 	static void Shutdown();
 
@@ -18,12 +20,24 @@ public:
 
 	static void RemoveClient(Client* client);
 
+	// The same on a list of games kept by the caller. Server keeps one per shard in shared-nothing mode.
+	static void Shutdown(ServiceList& services);
+	static void Update(ServiceList& services);
+	static void OnRecv(ServiceList& services, Client* client, rapidjson::Document& data);
+	static void RemoveClient(ServiceList& services, Client* client);
+
+	// Matchmaking, for callers which look for a game over several lists.
+	static bool IsCreateRequest(rapidjson::Document& data);
+	// Whether a game of the list waits for a player.
+	static bool CanEnter(ServiceList& services);
+	// Puts the client in a waiting game, or in a new one if none is waiting.
+	static void Enter(ServiceList& services, Client* client);
+
 private:
-	static bool CreateOrEnter(Client* client, rapidjson::Document& data);
-	static void Flush();
+	static bool CreateOrEnter(ServiceList& services, Client* client, rapidjson::Document& data);
+	static void Flush(ServiceList& services);
 
 private:
-	typedef std::vector<TicTacToeService*> ServiceList;
 	static ServiceList sServices;
 
 private:
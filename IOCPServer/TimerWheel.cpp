@@ -0,0 +1,162 @@
+#include "TimerWheel.h"
+
+#include <cassert>
+
+
+namespace
+{
+	const ULONGLONG SLOT_MASK = TimerWheel::NUM_SLOTS - 1;
+	const ULONGLONG MAX_DELAY = (1ULL << (TimerWheel::SLOT_BITS * TimerWheel::NUM_LEVELS)) - 1;	// in ticks.
+
+	void Unlink(TimerWheel::Timer* timer)
+	{
+		timer->prev->next = timer->next;
+		timer->next->prev = timer->prev;
+		timer->next = NULL;
+		timer->prev = NULL;
+	}
+}
+
+
+TimerWheel::TimerWheel(DWORD tickMs, ULONGLONG now)
+: m_TickMs(tickMs > 0 ? tickMs : 1),
+  m_StartTime(now),
+  m_CurrentTick(0),
+  m_NumArmed(0)
+{
+	for(int level = 0 ; level < NUM_LEVELS ; ++level)
+	{
+		for(int slot = 0 ; slot < NUM_SLOTS ; ++slot)
+		{
+			m_Slots[level][slot].next = &m_Slots[level][slot];
+			m_Slots[level][slot].prev = &m_Slots[level][slot];
+		}
+	}
+}
+
+
+TimerWheel::~TimerWheel()
+{
+	// Owners cancel their timers before they go, so there should be none left.
+	assert(m_NumArmed == 0);
+}
+
+
+void TimerWheel::Arm(Timer* timer, DWORD delayMs)
+{
+	assert(timer);
+
+	if(timer->IsArmed())
+	{
+		Cancel(timer);
+	}
+
+	// Round up, so that a timer never expires early. It expires at the earliest on the next tick.
+	ULONGLONG delay = (static_cast<ULONGLONG>(delayMs) + m_TickMs - 1) / m_TickMs;
+	if(delay == 0)
+	{
+		delay = 1;
+	}
+	else if(delay > MAX_DELAY)
+	{
+		delay = MAX_DELAY;
+	}
+
+	timer->expires = m_CurrentTick + delay;
+	Insert(timer);
+	++m_NumArmed;
+}
+
+
+void TimerWheel::Cancel(Timer* timer)
+{
+	assert(timer);
+
+	if(!timer->IsArmed())
+	{
+		return;
+	}
+
+	Unlink(timer);
+	--m_NumArmed;
+}
+
+
+void TimerWheel::CancelAll()
+{
+	for(int level = 0 ; level < NUM_LEVELS ; ++level)
+	{
+		for(int slot = 0 ; slot < NUM_SLOTS ; ++slot)
+		{
+			Timer* head = &m_Slots[level][slot];
+			while(head->next != head)
+			{
+				Unlink(head->next);
+			}
+		}
+	}
+	m_NumArmed = 0;
+}
+
+
+void TimerWheel::Advance(ULONGLONG now, TimerList& outExpired)
+{
+	ULONGLONG target = now > m_StartTime ? (now - m_StartTime) / m_TickMs : 0;
+
+	while(m_CurrentTick < target)
+	{
+		++m_CurrentTick;
+
+		// Each time a level wraps around, the next slot of the level above is spread over the levels below.
+		for(int level = 1 ; level < NUM_LEVELS ; ++level)
+		{
+			if(((m_CurrentTick >> (SLOT_BITS * (level - 1))) & SLOT_MASK) != 0)
+			{
+				break;
+			}
+			Cascade(level, static_cast<size_t>((m_CurrentTick >> (SLOT_BITS * level)) & SLOT_MASK));
+		}
+
+		Timer* head = &m_Slots[0][m_CurrentTick & SLOT_MASK];
+		while(head->next != head)
+		{
+			Timer* timer = head->next;
+			Unlink(timer);
+			--m_NumArmed;
+			outExpired.push_back(timer);
+		}
+	}
+}
+
+
+void TimerWheel::Insert(Timer* timer)
+{
+	ULONGLONG expires = timer->expires;
+	ULONGLONG delay = expires > m_CurrentTick ? expires - m_CurrentTick : 0;
+
+	// The lowest level whose range covers the delay. A timer due now goes to the current slot of level 0,
+	// which only happens while cascading, right before that slot expires.
+	int level = 0;
+	while(level < NUM_LEVELS - 1 && delay >= (1ULL << (SLOT_BITS * (level + 1))))
+	{
+		++level;
+	}
+
+	Timer* head = &m_Slots[level][(expires >> (SLOT_BITS * level)) & SLOT_MASK];
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+
+void TimerWheel::Cascade(int level, size_t slot)
+{
+	Timer* head = &m_Slots[level][slot];
+	while(head->next != head)
+	{
+		Timer* timer = head->next;
+		Unlink(timer);
+		Insert(timer);
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+
+// Hierarchical timing wheel. Arming and cancelling are O(1), and advancing costs O(1) per tick plus the timers expiring.
+// Each of NUM_LEVELS levels has NUM_SLOTS slots. A slot of level 0 is one tick and a slot of level n spans all of level n-1,
+// so timers far away wait in upper levels and move down as their time comes closer.
+// Timers are embedded in their owners, so the wheel never allocates. Not thread safe. The owner of the wheel locks it.
+
+class TimerWheel
+{
+public:
+	enum
+	{
+		SLOT_BITS = 6,
+		NUM_SLOTS = 1 << SLOT_BITS,
+		NUM_LEVELS = 4,
+	};
+
+	struct Timer
+	{
+		Timer() : next(NULL), prev(NULL), expires(0), context(NULL) {}
+
+		bool IsArmed() const { return next != NULL; }
+
+		Timer* next;
+		Timer* prev;
+		ULONGLONG expires;	// in ticks.
+		void* context;		// for the owner.
+	};
+
+	typedef std::vector<Timer*> TimerList;
+
+public:
+	TimerWheel(DWORD tickMs, ULONGLONG now);
+	~TimerWheel();
+
+	// Re-arms the timer if it is armed already. Delays beyond the range of the wheel are cut to the range.
+	void Arm(Timer* timer, DWORD delayMs);
+	void Cancel(Timer* timer);
+	void CancelAll();
+
+	// Moves the wheel on to now and appends the timers which have expired. They are no longer armed.
+	void Advance(ULONGLONG now, TimerList& outExpired);
+
+	DWORD GetTickMs() { return m_TickMs; }
+	size_t GetNumArmed() { return m_NumArmed; }
+
+private:
+	TimerWheel(const TimerWheel& rhs);
+	TimerWheel& operator=(const TimerWheel& rhs);
+
+	void Insert(Timer* timer);
+	void Cascade(int level, size_t slot);
+
+private:
+	Timer m_Slots[NUM_LEVELS][NUM_SLOTS];	// heads of circular lists.
+	DWORD m_TickMs;
+	ULONGLONG m_StartTime;
+	ULONGLONG m_CurrentTick;
+	size_t m_NumArmed;
+};
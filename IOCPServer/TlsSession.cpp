@@ -0,0 +1,392 @@
+#include "TlsSession.h"
+#include "Client.h"
+#include "Packet.h"
+#include "CSLocker.h"
+#include "Log.h"
+
+#include <algorithm>
+#include <cassert>
+
+/* static */ TlsSession::PoolType TlsSession::sPool;
+/* static */ CRITICAL_SECTION TlsSession::sPoolCS;
+/* static */ CredHandle TlsSession::sCredentials;
+/* static */ bool TlsSession::sEnabled = false;
+/* static */ volatile LONGLONG TlsSession::sNumHandshakes = 0;
+
+
+/* static */ bool TlsSession::Init(const std::string& certificateSubject)
+{
+	InitializeCriticalSection(&sPoolCS);
+	SecInvalidateHandle(&sCredentials);
+
+	if(certificateSubject.empty())
+	{
+		return true;
+	}
+
+	HCERTSTORE store = CertOpenStore(CERT_STORE_PROV_SYSTEM_A, 0, NULL, CERT_SYSTEM_STORE_LOCAL_MACHINE | CERT_STORE_READONLY_FLAG, "MY");
+	if(store == NULL)
+	{
+		ERROR_CODE(GetLastError(), "CertOpenStore() failed.");
+		return false;
+	}
+
+	PCCERT_CONTEXT certificate = CertFindCertificateInStore(store, X509_ASN_ENCODING | PKCS_7_ASN_ENCODING, 0, CERT_FIND_SUBJECT_STR_A, certificateSubject.c_str(), NULL);
+	if(certificate == NULL)
+	{
+		ERROR_CODE(GetLastError(), "Could not find the certificate. subject[%s]", certificateSubject.c_str());
+		CertCloseStore(store, 0);
+		return false;
+	}
+
+	SCHANNEL_CRED credentialData;
+	ZeroMemory(&credentialData, sizeof(credentialData));
+	credentialData.dwVersion = SCHANNEL_CRED_VERSION;
+	credentialData.cCreds = 1;
+	credentialData.paCred = &certificate;
+	credentialData.grbitEnabledProtocols = SP_PROT_TLS1_2_SERVER;
+	credentialData.dwFlags = SCH_USE_STRONG_CRYPTO;
+
+	TimeStamp expiry;
+	SECURITY_STATUS status = AcquireCredentialsHandle(NULL, const_cast<LPSTR>(UNISP_NAME_A), SECPKG_CRED_INBOUND, NULL, &credentialData, NULL, NULL, &sCredentials, &expiry);
+
+	// The credentials keep their own reference to the certificate.
+	CertFreeCertificateContext(certificate);
+	CertCloseStore(store, 0);
+
+	if(status != SEC_E_OK)
+	{
+		ERROR_CODE(status, "AcquireCredentialsHandle() failed.");
+		return false;
+	}
+
+	LOG("TLS enabled. certificate[%s]", certificateSubject.c_str());
+
+	sEnabled = true;
+	return true;
+}
+
+
+/* static */ void TlsSession::Shutdown()
+{
+	if(sEnabled)
+	{
+		FreeCredentialsHandle(&sCredentials);
+		sEnabled = false;
+	}
+
+	DeleteCriticalSection(&sPoolCS);
+}
+
+
+/* static */ TlsSession* TlsSession::Create()
+{
+	assert(sEnabled);
+
+	CSLocker lock(&sPoolCS);
+	return sPool.construct();
+}
+
+
+/* static */ void TlsSession::Destroy(TlsSession* session)
+{
+	CSLocker lock(&sPoolCS);
+	sPool.destroy(session);
+}
+
+
+TlsSession::TlsSession()
+: m_HasContext(false)
+, m_Established(false)
+, m_MaxRecordData(0)
+{
+	SecInvalidateHandle(&m_Context);
+	ZeroMemory(&m_StreamSizes, sizeof(m_StreamSizes));
+	InitializeCriticalSection(&m_CS);
+}
+
+
+TlsSession::~TlsSession()
+{
+	for(size_t i = 0 ; i < m_HeldPackets.size() ; ++i)
+	{
+		Packet::Destroy(m_HeldPackets[i]);
+	}
+	m_HeldPackets.clear();
+
+	if(m_HasContext)
+	{
+		DeleteSecurityContext(&m_Context);
+	}
+
+	DeleteCriticalSection(&m_CS);
+}
+
+
+bool TlsSession::OnRecv(Client* client, const BYTE* data, int size, std::string& outPlaintext, bool& outStartSend)
+{
+	CSLocker lock(&m_CS);
+
+	m_Input.insert(m_Input.end(), data, data + size);
+
+	if(!m_Established)
+	{
+		if(!Handshake(client, outStartSend))
+		{
+			return false;
+		}
+
+		// Application data may follow the last handshake message in the same receive.
+		if(!m_Established)
+		{
+			return true;
+		}
+	}
+
+	return Decrypt(outPlaintext);
+}
+
+
+bool TlsSession::Send(Client* client, Packet* packet, bool& outStartSend)
+{
+	CSLocker lock(&m_CS);
+
+	if(!m_Established)
+	{
+		m_HeldPackets.push_back(packet);
+		return true;
+	}
+
+	bool result = Encrypt(client, packet, outStartSend);
+	Packet::Destroy(packet);
+
+	return result;
+}
+
+
+bool TlsSession::Handshake(Client* client, bool& outStartSend)
+{
+	while(!m_Input.empty())
+	{
+		SecBuffer inBuffers[2];
+		inBuffers[0].cbBuffer = static_cast<ULONG>(m_Input.size());
+		inBuffers[0].BufferType = SECBUFFER_TOKEN;
+		inBuffers[0].pvBuffer = &m_Input[0];
+		inBuffers[1].cbBuffer = 0;
+		inBuffers[1].BufferType = SECBUFFER_EMPTY;
+		inBuffers[1].pvBuffer = NULL;
+		SecBufferDesc inDesc = { SECBUFFER_VERSION, 2, inBuffers };
+
+		SecBuffer outBuffers[2];
+		outBuffers[0].cbBuffer = 0;
+		outBuffers[0].BufferType = SECBUFFER_TOKEN;
+		outBuffers[0].pvBuffer = NULL;
+		outBuffers[1].cbBuffer = 0;
+		outBuffers[1].BufferType = SECBUFFER_ALERT;
+		outBuffers[1].pvBuffer = NULL;
+		SecBufferDesc outDesc = { SECBUFFER_VERSION, 2, outBuffers };
+
+		ULONG attributes = 0;
+		TimeStamp expiry;
+		SECURITY_STATUS status = AcceptSecurityContext(&sCredentials, m_HasContext ? &m_Context : NULL, &inDesc,
+			ASC_REQ_ALLOCATE_MEMORY | ASC_REQ_CONFIDENTIALITY | ASC_REQ_SEQUENCE_DETECT | ASC_REQ_REPLAY_DETECT | ASC_REQ_STREAM | ASC_REQ_EXTENDED_ERROR,
+			SECURITY_NATIVE_DREP, &m_Context, &outDesc, &attributes, &expiry);
+
+		if(status == SEC_E_INCOMPLETE_MESSAGE)
+		{
+			return true;
+		}
+
+		if(status == SEC_E_OK || status == SEC_I_CONTINUE_NEEDED)
+		{
+			m_HasContext = true;
+		}
+
+		// Send whatever has been produced. The next handshake message, or an alert on failure.
+		for(int i = 0 ; i < 2 ; ++i)
+		{
+			if(outBuffers[i].pvBuffer != NULL)
+			{
+				bool queued = QueueRaw(client, static_cast<const BYTE*>(outBuffers[i].pvBuffer), outBuffers[i].cbBuffer, outStartSend);
+				FreeContextBuffer(outBuffers[i].pvBuffer);
+				if(!queued)
+				{
+					return false;
+				}
+			}
+		}
+
+		if(status != SEC_E_OK && status != SEC_I_CONTINUE_NEEDED)
+		{
+			ERROR_CODE(status, "AcceptSecurityContext() failed.");
+			return false;
+		}
+
+		// Keep what has not been consumed. The start of the next message.
+		if(inBuffers[1].BufferType == SECBUFFER_EXTRA && inBuffers[1].cbBuffer > 0)
+		{
+			m_Input.erase(m_Input.begin(), m_Input.end() - inBuffers[1].cbBuffer);
+		}
+		else
+		{
+			m_Input.clear();
+		}
+
+		if(status == SEC_E_OK)
+		{
+			status = QueryContextAttributes(&m_Context, SECPKG_ATTR_STREAM_SIZES, &m_StreamSizes);
+			if(status != SEC_E_OK)
+			{
+				ERROR_CODE(status, "QueryContextAttributes() failed with SECPKG_ATTR_STREAM_SIZES.");
+				return false;
+			}
+
+			m_MaxRecordData = m_StreamSizes.cbMaximumMessage;
+			m_Record.resize(m_StreamSizes.cbHeader + m_StreamSizes.cbMaximumMessage + m_StreamSizes.cbTrailer);
+			m_Established = true;
+			InterlockedIncrement64(&sNumHandshakes);
+
+			bool result = true;
+			for(size_t i = 0 ; i < m_HeldPackets.size() ; ++i)
+			{
+				result = result && Encrypt(client, m_HeldPackets[i], outStartSend);
+				Packet::Destroy(m_HeldPackets[i]);
+			}
+			m_HeldPackets.clear();
+
+			return result;
+		}
+	}
+
+	return true;
+}
+
+
+bool TlsSession::Decrypt(std::string& outPlaintext)
+{
+	while(!m_Input.empty())
+	{
+		SecBuffer buffers[4];
+		buffers[0].cbBuffer = static_cast<ULONG>(m_Input.size());
+		buffers[0].BufferType = SECBUFFER_DATA;
+		buffers[0].pvBuffer = &m_Input[0];
+		for(int i = 1 ; i < 4 ; ++i)
+		{
+			buffers[i].cbBuffer = 0;
+			buffers[i].BufferType = SECBUFFER_EMPTY;
+			buffers[i].pvBuffer = NULL;
+		}
+		SecBufferDesc desc = { SECBUFFER_VERSION, 4, buffers };
+
+		SECURITY_STATUS status = DecryptMessage(&m_Context, &desc, 0, NULL);
+		if(status == SEC_E_INCOMPLETE_MESSAGE)
+		{
+			break;
+		}
+
+		if(status == SEC_I_CONTEXT_EXPIRED)
+		{
+			LOG("TLS session closed by the peer.");
+			return false;
+		}
+
+		if(status != SEC_E_OK)
+		{
+			// SEC_I_RENEGOTIATE included. Renegotiation is not supported.
+			ERROR_CODE(status, "DecryptMessage() failed.");
+			return false;
+		}
+
+		// Records are decrypted in place, so take the plaintext before the consumed bytes go away.
+		ULONG extra = 0;
+		for(int i = 1 ; i < 4 ; ++i)
+		{
+			if(buffers[i].BufferType == SECBUFFER_DATA)
+			{
+				outPlaintext.append(static_cast<const char*>(buffers[i].pvBuffer), buffers[i].cbBuffer);
+			}
+			else if(buffers[i].BufferType == SECBUFFER_EXTRA)
+			{
+				extra = buffers[i].cbBuffer;
+			}
+		}
+
+		m_Input.erase(m_Input.begin(), m_Input.end() - extra);
+	}
+
+	return true;
+}
+
+
+bool TlsSession::Encrypt(Client* client, Packet* packet, bool& outStartSend)
+{
+	// Records do not span segments. A segment is megabytes, so that costs a short record every few hundred.
+	for(Packet* segment = packet ; segment != NULL ; segment = segment->GetNext())
+	{
+		if(!Encrypt(client, segment->GetSegmentData(), segment->GetSegmentSize(), outStartSend))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+
+bool TlsSession::Encrypt(Client* client, const BYTE* data, DWORD size, bool& outStartSend)
+{
+	BYTE* record = &m_Record[0];
+
+	for(DWORD offset = 0 ; offset < size ; )
+	{
+		DWORD dataSize = std::min(size - offset, m_MaxRecordData);
+		CopyMemory(record + m_StreamSizes.cbHeader, data + offset, dataSize);
+
+		SecBuffer buffers[4];
+		buffers[0].cbBuffer = m_StreamSizes.cbHeader;
+		buffers[0].BufferType = SECBUFFER_STREAM_HEADER;
+		buffers[0].pvBuffer = record;
+		buffers[1].cbBuffer = dataSize;
+		buffers[1].BufferType = SECBUFFER_DATA;
+		buffers[1].pvBuffer = record + m_StreamSizes.cbHeader;
+		buffers[2].cbBuffer = m_StreamSizes.cbTrailer;
+		buffers[2].BufferType = SECBUFFER_STREAM_TRAILER;
+		buffers[2].pvBuffer = record + m_StreamSizes.cbHeader + dataSize;
+		buffers[3].cbBuffer = 0;
+		buffers[3].BufferType = SECBUFFER_EMPTY;
+		buffers[3].pvBuffer = NULL;
+		SecBufferDesc desc = { SECBUFFER_VERSION, 4, buffers };
+
+		SECURITY_STATUS status = EncryptMessage(&m_Context, 0, &desc, 0);
+		if(status != SEC_E_OK)
+		{
+			ERROR_CODE(status, "EncryptMessage() failed.");
+			return false;
+		}
+
+		// The trailer can come out shorter than its maximum.
+		if(!QueueRaw(client, record, buffers[0].cbBuffer + buffers[1].cbBuffer + buffers[2].cbBuffer, outStartSend))
+		{
+			return false;
+		}
+
+		offset += dataSize;
+	}
+
+	return true;
+}
+
+
+bool TlsSession::QueueRaw(Client* client, const BYTE* data, DWORD size, bool& outStartSend)
+{
+	Packet* packet = Packet::Create(client, data, size);
+	if(packet == NULL)
+	{
+		return false;
+	}
+
+	if(client->PushSendPacket(packet))
+	{
+		outStartSend = true;
+	}
+	return true;
+}
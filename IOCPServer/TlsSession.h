@@ -0,0 +1,76 @@
+#pragma once
+
+#define SECURITY_WIN32
+#include <winsock2.h>
+#include <security.h>
+#include <schannel.h>
+#include <boost/pool/object_pool.hpp>
+#include <string>
+#include <vector>
+
+// TLS of one client with SChannel.
+// Records are decrypted as they are received and encrypted as packets are sent, so Server and the services
+// only ever see plaintext. Records are as large as SChannel allows, and each goes out as one Packet.
+
+class Client;
+class Packet;
+class TlsSession
+{
+public:
+	// The certificate is looked up by subject in the "MY" store of the local machine.
+	static bool Init(const std::string& certificateSubject);
+	static void Shutdown();
+	static bool IsEnabled() { return sEnabled; }
+
+	static TlsSession* Create();
+	static void Destroy(TlsSession* session);
+
+	static long long GetNumHandshakes() { return sNumHandshakes; }
+
+public:
+	// Both return false if the connection has to be closed.
+	// outStartSend tells whether packets have been queued on an idle client, so the caller has to start a send.
+
+	// Takes received bytes. Handshake replies are queued on the client and the plaintext is appended to outPlaintext.
+	bool OnRecv(Client* client, const BYTE* data, int size, std::string& outPlaintext, bool& outStartSend);
+	// Takes over the caller's reference to the packet. Held until the handshake has finished.
+	bool Send(Client* client, Packet* packet, bool& outStartSend);
+
+	bool IsEstablished() { return m_Established; }
+
+private:
+	TlsSession();
+	~TlsSession();
+	TlsSession(const TlsSession& rhs);
+	TlsSession& operator=(const TlsSession& rhs);
+
+private:
+	bool Handshake(Client* client, bool& outStartSend);
+	bool Decrypt(std::string& outPlaintext);
+	bool Encrypt(Client* client, Packet* packet, bool& outStartSend);
+	bool Encrypt(Client* client, const BYTE* data, DWORD size, bool& outStartSend);
+	bool QueueRaw(Client* client, const BYTE* data, DWORD size, bool& outStartSend);
+
+private:
+	CtxtHandle m_Context;
+	bool m_HasContext;
+	bool m_Established;
+	SecPkgContext_StreamSizes m_StreamSizes;
+	DWORD m_MaxRecordData;			// plaintext per record.
+	std::vector<BYTE> m_Record;		// a record being encrypted in place. header, data and trailer.
+
+	std::vector<BYTE> m_Input;		// received bytes not consumed yet. an incomplete handshake message or record.
+	std::vector<Packet*> m_HeldPackets;	// sent before the handshake finished.
+
+	// Encrypting and queueing happen together, since records have to go out in the order of their sequence numbers.
+	CRITICAL_SECTION m_CS;
+
+	typedef boost::object_pool<TlsSession> PoolType;
+	friend PoolType;
+	static PoolType sPool;
+	static CRITICAL_SECTION sPoolCS;
+
+	static CredHandle sCredentials;
+	static bool sEnabled;
+	static volatile LONGLONG sNumHandshakes;
+};
@@ -0,0 +1,448 @@
+#include "UpstreamPool.h"
+#include "Server.h"
+#include "Client.h"
+#include "Packet.h"
+#include "CSLocker.h"
+#include "Log.h"
+
+#include <sstream>
+#include <cassert>
+#include <algorithm>
+
+#include <rapidjson/writer.h>
+#include <rapidjson/stringbuffer.h>
+
+/* static */ UpstreamPool::TargetList UpstreamPool::sTargets;
+/* static */ CRITICAL_SECTION UpstreamPool::sCS;
+
+
+/* static */ void UpstreamPool::Init()
+{
+	LOG("UpstreamPool::Init()");
+
+	InitializeCriticalSection(&sCS);
+}
+
+
+/* static */ void UpstreamPool::Shutdown()
+{
+	LOG("UpstreamPool::Shutdown()");
+
+	EnterCriticalSection(&sCS);
+	{
+		// No completion can run at this point, so connections are destroyed without failing their requests.
+		for(TargetList::iterator itor = sTargets.begin() ; itor != sTargets.end() ; ++itor)
+		{
+			Target* target = *itor;
+			for(ConnectionList::iterator connItor = target->connections.begin() ; connItor != target->connections.end() ; ++connItor)
+			{
+				Connection* connection = *connItor;
+				if(connection->client != NULL)
+				{
+					Client::Destroy(connection->client);
+				}
+				delete connection;
+			}
+			delete target;
+		}
+		sTargets.clear();
+	}
+	LeaveCriticalSection(&sCS);
+	DeleteCriticalSection(&sCS);
+}
+
+
+/* static */ bool UpstreamPool::AddTarget(const std::string& name, const std::string& host, u_short port, const Config& config)
+{
+	assert(config.numConnections > 0);
+	assert(config.maxPipeline > 0);
+	assert(config.minBackoff > 0 && config.minBackoff <= config.maxBackoff);
+
+	addrinfo hints;
+	ZeroMemory(&hints, sizeof(addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	std::stringstream portBuff;
+	portBuff << port;
+
+	addrinfo* infoList = NULL;
+	if(getaddrinfo(host.c_str(), portBuff.str().c_str(), &hints, &infoList) != 0 || infoList == NULL)
+	{
+		ERROR_CODE(WSAGetLastError(), "getaddrinfo() failed. upstream[%s] host[%s] port[%d]", name.c_str(), host.c_str(), port);
+		return false;
+	}
+
+	Target* target = new Target;
+	target->name = name;
+	ZeroMemory(&target->address, sizeof(target->address));
+	CopyMemory(&target->address, infoList->ai_addr, infoList->ai_addrlen);
+	target->addressLength = static_cast<int>(infoList->ai_addrlen);
+	target->config = config;
+	ZeroMemory(&target->stats, sizeof(target->stats));
+
+	freeaddrinfo(infoList);
+
+	// Connections are made by the next Update(), so that all connecting happens in one place.
+	for(int i = 0 ; i < config.numConnections ; ++i)
+	{
+		Connection* connection = new Connection;
+		connection->target = target;
+		connection->client = NULL;
+		connection->state = DISCONNECTED;
+		connection->backoff = config.minBackoff;
+		connection->retryTick = 0;
+		connection->lastActiveTick = 0;
+		target->connections.push_back(connection);
+	}
+
+	CSLocker lock(&sCS);
+	sTargets.push_back(target);
+
+	LOG("Upstream added. name[%s] host[%s] port[%d] family[%d] connections[%d]", name.c_str(), host.c_str(), port, target->address.ss_family, config.numConnections);
+
+	return true;
+}
+
+
+/* static */ bool UpstreamPool::Request(const std::string& targetName, const rapidjson::Document& request, Callback callback, void* context)
+{
+	rapidjson::StringBuffer buffer;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+	request.Accept(writer);
+
+	// The target parses with the same limit as we do.
+	if(buffer.Size() + 1 > Client::MAX_DATA_SIZE)
+	{
+		ERROR_MSG("Upstream request is too big. upstream[%s] size[%d]", targetName.c_str(), buffer.Size());
+		return false;
+	}
+
+	CSLocker lock(&sCS);
+
+	TargetList::iterator itor = sTargets.begin();
+	for( ; itor != sTargets.end() ; ++itor)
+	{
+		if((*itor)->name == targetName)
+		{
+			break;
+		}
+	}
+
+	if(itor == sTargets.end())
+	{
+		ERROR_MSG("No such upstream. upstream[%s]", targetName.c_str());
+		return false;
+	}
+
+	Target* target = *itor;
+
+	PendingRequest pendingRequest;
+	pendingRequest.data.assign(buffer.GetString(), buffer.Size());
+	pendingRequest.callback = callback;
+	pendingRequest.context = context;
+	pendingRequest.sentTick = 0;
+	pendingRequest.healthCheck = false;
+
+	// Keep the order of requests. Anything already waiting goes first.
+	Connection* connection = target->pending.empty() ? SelectConnection(target) : NULL;
+	if(connection != NULL)
+	{
+		Send(connection, pendingRequest, GetTickCount64());
+	}
+	else if(static_cast<int>(target->pending.size()) < target->config.maxPending)
+	{
+		target->pending.push_back(pendingRequest);
+	}
+	else
+	{
+		LOG("Upstream is backed up. request dropped. upstream[%s] pending[%d]", targetName.c_str(), target->pending.size());
+		return false;
+	}
+
+	return true;
+}
+
+
+/* static */ void UpstreamPool::Update()
+{
+	CSLocker lock(&sCS);
+
+	ULONGLONG now = GetTickCount64();
+	std::vector<Client*> timedOut;
+
+	for(TargetList::iterator itor = sTargets.begin() ; itor != sTargets.end() ; ++itor)
+	{
+		Target* target = *itor;
+
+		for(ConnectionList::iterator connItor = target->connections.begin() ; connItor != target->connections.end() ; ++connItor)
+		{
+			UpdateConnection(*connItor, now, timedOut);
+		}
+
+		while(!target->pending.empty())
+		{
+			Connection* connection = SelectConnection(target);
+			if(connection == NULL)
+			{
+				break;
+			}
+
+			Send(connection, target->pending.front(), now);
+			target->pending.pop_front();
+		}
+	}
+
+	// The removal reports back through OnDisconnected(), which fails the requests in flight and schedules a reconnect.
+	for(std::vector<Client*>::iterator itor = timedOut.begin() ; itor != timedOut.end() ; ++itor)
+	{
+		Server::Instance()->RequestRemoveClient(*itor);
+	}
+}
+
+
+/* static */ void UpstreamPool::UpdateConnection(Connection* connection, ULONGLONG now, std::vector<Client*>& outTimedOut)
+{
+	Target* target = connection->target;
+	const Config& config = target->config;
+
+	Fail(target, connection->failed);
+
+	switch(connection->state)
+	{
+	case DISCONNECTED:
+		if(now >= connection->retryTick)
+		{
+			Connect(connection, now);
+		}
+		break;
+
+	case CONNECTING:
+		if(now - connection->lastActiveTick > config.requestTimeout)
+		{
+			LOG("Upstream connect timed out. upstream[%s] client(%p)", target->name.c_str(), connection->client);
+			outTimedOut.push_back(connection->client);
+		}
+		break;
+
+	case CONNECTED:
+		for(;;)
+		{
+			rapidjson::Document response;
+			if(!connection->client->PopRecvData(response))
+			{
+				break;
+			}
+
+			if(connection->inFlight.empty())
+			{
+				ERROR_MSG("Upstream sent a response to no request. upstream[%s]", target->name.c_str());
+				outTimedOut.push_back(connection->client);
+				return;
+			}
+
+			// Copy it out first. The callback may make another request on this connection.
+			PendingRequest request = connection->inFlight.front();
+			connection->inFlight.pop_front();
+			connection->lastActiveTick = now;
+			++target->stats.numResponses;
+
+			if(!request.healthCheck && request.callback != NULL)
+			{
+				request.callback(&response, request.context);
+			}
+		}
+
+		if(!connection->inFlight.empty())
+		{
+			if(now - connection->inFlight.front().sentTick > config.requestTimeout)
+			{
+				LOG("Upstream request timed out. upstream[%s] client(%p) in flight[%d]", target->name.c_str(), connection->client, connection->inFlight.size());
+				outTimedOut.push_back(connection->client);
+			}
+		}
+		else if(config.healthInterval > 0 && now - connection->lastActiveTick >= config.healthInterval)
+		{
+			// An idle connection may have been dropped silently by the target or anything in between.
+			PendingRequest request;
+			request.data = config.healthRequest;
+			request.callback = NULL;
+			request.context = NULL;
+			request.sentTick = now;
+			request.healthCheck = true;
+
+			Send(connection, request, now);
+		}
+		break;
+
+	default: assert(false); break;
+	}
+}
+
+
+/* static */ void UpstreamPool::Connect(Connection* connection, ULONGLONG now)
+{
+	Target* target = connection->target;
+
+	Client* client = Client::Create(target->address.ss_family);
+	if(client == NULL)
+	{
+		connection->retryTick = now + connection->backoff;
+		return;
+	}
+
+	client->SetUpstream(true);
+
+	connection->client = client;
+	connection->state = CONNECTING;
+	connection->lastActiveTick = now;
+	++target->stats.numConnects;
+
+	// A failure is reported through OnDisconnected() as well, so nothing more to do here.
+	Server::Instance()->PostConnect(client, reinterpret_cast<const sockaddr*>(&target->address), target->addressLength);
+}
+
+
+/* static */ void UpstreamPool::Send(Connection* connection, PendingRequest& request, ULONGLONG now)
+{
+	assert(connection->state == CONNECTED);
+
+	request.sentTick = now;
+	connection->inFlight.push_back(request);
+	++connection->target->stats.numRequests;
+
+	Packet* packet = Packet::Create(connection->client, reinterpret_cast<const BYTE*>(request.data.c_str()), static_cast<DWORD>(request.data.size() + 1));
+	Server::Instance()->PostSend(connection->client, packet);
+}
+
+
+/* static */ UpstreamPool::Connection* UpstreamPool::SelectConnection(Target* target)
+{
+	// The least loaded connection with room for one more request.
+	Connection* selected = NULL;
+	for(ConnectionList::iterator itor = target->connections.begin() ; itor != target->connections.end() ; ++itor)
+	{
+		Connection* connection = *itor;
+		if(connection->state != CONNECTED || static_cast<int>(connection->inFlight.size()) >= target->config.maxPipeline)
+		{
+			continue;
+		}
+
+		if(selected == NULL || connection->inFlight.size() < selected->inFlight.size())
+		{
+			selected = connection;
+		}
+	}
+	return selected;
+}
+
+
+/* static */ UpstreamPool::Connection* UpstreamPool::FindConnection(Client* client)
+{
+	for(TargetList::iterator itor = sTargets.begin() ; itor != sTargets.end() ; ++itor)
+	{
+		ConnectionList& connections = (*itor)->connections;
+		for(ConnectionList::iterator connItor = connections.begin() ; connItor != connections.end() ; ++connItor)
+		{
+			if((*connItor)->client == client)
+			{
+				return *connItor;
+			}
+		}
+	}
+	return NULL;
+}
+
+
+/* static */ void UpstreamPool::Fail(Target* target, RequestQueue& requests)
+{
+	while(!requests.empty())
+	{
+		PendingRequest request = requests.front();
+		requests.pop_front();
+		++target->stats.numFailures;
+
+		if(!request.healthCheck && request.callback != NULL)
+		{
+			request.callback(NULL, request.context);
+		}
+	}
+}
+
+
+/* static */ void UpstreamPool::OnConnected(Client* client)
+{
+	CSLocker lock(&sCS);
+
+	Connection* connection = FindConnection(client);
+	if(connection == NULL)
+	{
+		return;
+	}
+
+	LOG("Upstream connected. upstream[%s] client(%p)", connection->target->name.c_str(), client);
+
+	connection->state = CONNECTED;
+	connection->backoff = connection->target->config.minBackoff;
+	connection->lastActiveTick = GetTickCount64();
+}
+
+
+/* static */ void UpstreamPool::OnDisconnected(Client* client)
+{
+	CSLocker lock(&sCS);
+
+	Connection* connection = FindConnection(client);
+	if(connection == NULL)
+	{
+		return;
+	}
+
+	const Config& config = connection->target->config;
+
+	LOG("Upstream disconnected. upstream[%s] client(%p) retry in %dms", connection->target->name.c_str(), client, connection->backoff);
+
+	// Callbacks are called in the service thread only, so leave failing the requests to Update().
+	connection->failed.insert(connection->failed.end(), connection->inFlight.begin(), connection->inFlight.end());
+	connection->inFlight.clear();
+
+	connection->client = NULL;
+	connection->state = DISCONNECTED;
+	connection->retryTick = GetTickCount64() + connection->backoff;
+	connection->backoff = std::min(connection->backoff * 2, config.maxBackoff);
+}
+
+
+/* static */ size_t UpstreamPool::GetNumTargets()
+{
+	CSLocker lock(&sCS);
+	return sTargets.size();
+}
+
+
+/* static */ const std::string& UpstreamPool::GetTargetName(size_t target)
+{
+	CSLocker lock(&sCS);
+	assert(target < sTargets.size());
+	return sTargets[target]->name;
+}
+
+
+/* static */ void UpstreamPool::GetStats(size_t target, Stats& outStats)
+{
+	CSLocker lock(&sCS);
+	assert(target < sTargets.size());
+
+	outStats = sTargets[target]->stats;
+	outStats.numConnected = 0;
+
+	ConnectionList& connections = sTargets[target]->connections;
+	for(ConnectionList::iterator itor = connections.begin() ; itor != connections.end() ; ++itor)
+	{
+		if((*itor)->state == CONNECTED)
+		{
+			++outStats.numConnected;
+		}
+	}
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <rapidjson/document.h>
+
+// Persistent outbound connections to backend services.
+// Each connection is a Client flagged as upstream, so its I/O goes through Server's IOEvent dispatch like any other client.
+// Requests are pipelined: they are sent as soon as they are made and responses come back in the same order.
+// All callbacks are called in the service thread, from Update().
+
+class Client;
+class UpstreamPool
+{
+public:
+	// response is NULL if the request failed. e.g. the connection has been lost or the target did not answer in time.
+	typedef void (*Callback)(rapidjson::Document* response, void* context);
+
+	struct Config
+	{
+		Config() : numConnections(2), maxPipeline(64), maxPending(1024), requestTimeout(3000),
+			healthInterval(5000), minBackoff(100), maxBackoff(10000), healthRequest("{\"type\":\"echo\"}") {}
+
+		int numConnections;
+		int maxPipeline;			// requests in flight on one connection.
+		int maxPending;				// requests waiting for a connection while none is available.
+		DWORD requestTimeout;		// ms. a connection whose oldest request is older than this is closed and reconnected.
+		DWORD healthInterval;		// ms. an idle connection sends healthRequest this often. 0 disables it.
+		DWORD minBackoff;			// ms before the first reconnect. doubled on each failure up to maxBackoff.
+		DWORD maxBackoff;
+		std::string healthRequest;	// anything the target answers with exactly one message.
+	};
+
+	struct Stats
+	{
+		int numConnected;
+		long long numRequests;
+		long long numResponses;
+		long long numFailures;
+		long long numConnects;		// ConnectEx calls.
+	};
+
+public:
+	static void Init();
+	static void Shutdown();
+
+	// host is resolved here once, so that reconnecting never resolves names. The first address of either family is used.
+	static bool AddTarget(const std::string& name, const std::string& host, u_short port, const Config& config = Config());
+
+	// Returns false if there is no such target or it is too backed up. The callback is not called in that case.
+	static bool Request(const std::string& target, const rapidjson::Document& request, Callback callback, void* context);
+
+	static void Update();
+
+	// From Server.
+	static void OnConnected(Client* client);
+	static void OnDisconnected(Client* client);
+
+	static size_t GetNumTargets();
+	static const std::string& GetTargetName(size_t target);
+	static void GetStats(size_t target, Stats& outStats);
+
+private:
+	struct Target;
+
+	struct PendingRequest
+	{
+		std::string data;
+		Callback callback;
+		void* context;
+		ULONGLONG sentTick;
+		bool healthCheck;
+	};
+
+	typedef std::deque<PendingRequest> RequestQueue;
+
+	enum State
+	{
+		DISCONNECTED,
+		CONNECTING,
+		CONNECTED,
+	};
+
+	struct Connection
+	{
+		Target* target;
+		Client* client;
+		State state;
+		RequestQueue inFlight;
+		RequestQueue failed;	// in flight when the connection was lost. failed in Update().
+		DWORD backoff;
+		ULONGLONG retryTick;
+		ULONGLONG lastActiveTick;
+	};
+
+	typedef std::vector<Connection*> ConnectionList;
+
+	struct Target
+	{
+		std::string name;
+		sockaddr_storage address;
+		int addressLength;
+		Config config;
+		ConnectionList connections;
+		RequestQueue pending;
+		Stats stats;
+	};
+
+	typedef std::vector<Target*> TargetList;
+
+private:
+	static void UpdateConnection(Connection* connection, ULONGLONG now, std::vector<Client*>& outTimedOut);
+	static void Connect(Connection* connection, ULONGLONG now);
+	static void Send(Connection* connection, PendingRequest& request, ULONGLONG now);
+	static Connection* SelectConnection(Target* target);
+	static Connection* FindConnection(Client* client);
+	static void Fail(Target* target, RequestQueue& requests);
+
+private:
+	UpstreamPool();
+	~UpstreamPool();
+	UpstreamPool(const UpstreamPool& rhs);
+	UpstreamPool& operator=(const UpstreamPool& rhs);
+
+private:
+	static TargetList sTargets;
+	static CRITICAL_SECTION sCS;
+};
@@ -1,27 +1,898 @@
 
 #include <string>
 #include <iostream>
+#include <sstream>
 using namespace std;
 
 #include "Log.h"
 #include "Network.h"
 #include "Server.h"
+#include "Client.h"
+#include "UpstreamPool.h"
+#include "TlsSession.h"
+#include "RecvBufferPool.h"
+#include "Packet.h"
+#include "TimerWheel.h"
+#include "Numa.h"
+#include "FreeListPool.h"
+#include <vector>
+#include <algorithm>
+#include <cctype>
+#include <boost/pool/object_pool.hpp>
+
+namespace
+{
+	// Parses optional "name=value" arguments following the port and the max number of accept posts.
+	// HOST:PORT[/SHARDS][/PROFILE]. An IPv6 host is in brackets. e.g. 10.0.0.5:17001, [::1]:17001/2, [::1]:17001/2/lowlatency
+	bool ParseListenAddress(const string& spec, Server::ListenAddress& address)
+	{
+		size_t slash = spec.find('/');
+		string hostPort = spec.substr(0, slash);
+		while (slash != string::npos)
+		{
+			size_t next = spec.find('/', slash+1);
+			string field = spec.substr(slash+1, next == string::npos ? string::npos : next-slash-1);
+			slash = next;
+
+			if (!field.empty() && isdigit(static_cast<unsigned char>(field[0])))
+			{
+				address.numShards = atoi(field.c_str());
+				continue;
+			}
+
+			address.socketProfile = Network::FindSocketProfile(field);
+			if (address.socketProfile == NULL)
+			{
+				return false;
+			}
+		}
+
+		size_t colon = hostPort.rfind(':');
+		if (colon == string::npos || colon == 0)
+		{
+			return false;
+		}
+
+		address.host = hostPort.substr(0, colon);
+		address.port = static_cast<u_short>(atoi(hostPort.substr(colon+1).c_str()));
+		if (address.host.size() >= 2 && address.host[0] == '[' && address.host[address.host.size()-1] == ']')
+		{
+			address.host = address.host.substr(1, address.host.size()-2);
+		}
+
+		return address.port != 0;
+	}
+
+	bool ParseOption(const string& arg, Server::Config& config)
+	{
+		size_t pos = arg.find('=');
+		if (pos == string::npos)
+		{
+			return false;
+		}
+
+		string name = arg.substr(0, pos);
+		string value = arg.substr(pos+1);
+
+		if (name == "backend")
+		{
+			if (value == "threadpool")
+			{
+				config.backend = Server::THREAD_POOL;
+			}
+			else if (value == "iothreads")
+			{
+				config.backend = Server::IO_THREADS;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		else if (name == "io_threads")
+		{
+			config.numIOThreads = atoi(value.c_str());
+		}
+		else if (name == "shards")
+		{
+			config.numShards = atoi(value.c_str());
+		}
+		else if (name == "batch")
+		{
+			config.completionBatchSize = atoi(value.c_str());
+		}
+		else if (name == "busy_poll")
+		{
+			config.busyPollSpin = static_cast<DWORD>(atoi(value.c_str()));
+		}
+		else if (name == "numa")
+		{
+			config.numaAware = atoi(value.c_str()) != 0;
+		}
+		else if (name == "shared_nothing")
+		{
+			config.sharedNothing = atoi(value.c_str()) != 0;
+		}
+		else if (name == "cores")
+		{
+			// Comma separated processor numbers.
+			size_t start = 0;
+			while (start < value.size())
+			{
+				size_t comma = value.find(',', start);
+				if (comma == string::npos)
+				{
+					comma = value.size();
+				}
+				config.ioCores.push_back(atoi(value.substr(start, comma-start).c_str()));
+				start = comma + 1;
+			}
+		}
+		else if (name == "zerocopy")
+		{
+			config.zeroCopyThreshold = static_cast<DWORD>(atoi(value.c_str()));
+		}
+		else if (name == "send_high")
+		{
+			config.sendHighWatermark = static_cast<DWORD>(atoi(value.c_str()));
+		}
+		else if (name == "send_low")
+		{
+			config.sendLowWatermark = static_cast<DWORD>(atoi(value.c_str()));
+		}
+		else if (name == "send_stall")
+		{
+			config.sendStallTimeout = static_cast<DWORD>(atoi(value.c_str()));
+		}
+		else if (name == "recv_limit")
+		{
+			config.recvBacklogLimit = static_cast<size_t>(atoi(value.c_str()));
+		}
+		else if (name == "udp_port")
+		{
+			config.datagramPort = static_cast<u_short>(atoi(value.c_str()));
+		}
+		else if (name == "udp_depth")
+		{
+			config.datagramRecvDepth = atoi(value.c_str());
+		}
+		else if (name == "tls_cert")
+		{
+			config.tlsCertificate = value;
+		}
+		else if (name == "dualstack")
+		{
+			config.dualStack = atoi(value.c_str()) != 0;
+		}
+		else if (name == "listen")
+		{
+			Server::ListenAddress address;
+			if (!ParseListenAddress(value, address))
+			{
+				return false;
+			}
+			config.listenAddresses.push_back(address);
+		}
+		else if (name == "takeover")
+		{
+			config.takeOver = atoi(value.c_str()) != 0;
+		}
+		else if (name == "drain_timeout")
+		{
+			config.drainTimeout = static_cast<DWORD>(atoi(value.c_str()));
+		}
+		else if (name == "idle_timeout")
+		{
+			config.idleTimeout = static_cast<DWORD>(atoi(value.c_str()));
+		}
+		else if (name == "first_timeout")
+		{
+			config.firstMessageTimeout = static_cast<DWORD>(atoi(value.c_str()));
+		}
+		else if (name == "message_timeout")
+		{
+			config.partialMessageTimeout = static_cast<DWORD>(atoi(value.c_str()));
+		}
+		else if (name == "unix")
+		{
+			config.unixPath = value;
+		}
+		else if (name == "warm_clients")
+		{
+			config.warmClients = atoi(value.c_str());
+		}
+		else if (name == "profile")
+		{
+			const Network::SocketProfile* profile = Network::FindSocketProfile(value);
+			if (profile == NULL)
+			{
+				return false;
+			}
+			config.socketProfile = profile;
+		}
+		else if (name == "accept")
+		{
+			if (value == "plain")
+			{
+				config.acceptMode = Server::ACCEPT_ONLY;
+			}
+			else if (value == "data")
+			{
+				config.acceptMode = Server::ACCEPT_WITH_DATA;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		else if (name == "recv")
+		{
+			if (value == "client")
+			{
+				config.recvMode = Server::RECV_PER_CLIENT;
+			}
+			else if (value == "shared")
+			{
+				config.recvMode = Server::RECV_SHARED;
+			}
+			else
+			{
+				return false;
+			}
+		}
+		else
+		{
+			return false;
+		}
+
+		return true;
+	}
+
+	// Waits for the clients left after a handoff to leave by themselves.
+	void Drain(DWORD timeout)
+	{
+		ULONGLONG start = GetTickCount64();
+		size_t numClients = Server::Instance()->GetNumClients();
+		while (numClients > 0 && (timeout == 0 || GetTickCount64() - start < timeout))
+		{
+			Sleep(1000);
+
+			size_t remaining = Server::Instance()->GetNumClients();
+			if (remaining != numClients)
+			{
+				LOG(" Draining : %Iu clients left.", remaining);
+				numClients = remaining;
+			}
+		}
+
+		LOG(" Drained in %lld ms. %Iu clients left.", GetTickCount64() - start, numClients);
+	}
+
+	double ElapsedNs(const LARGE_INTEGER& start, const LARGE_INTEGER& end, const LARGE_INTEGER& frequency, int count)
+	{
+		return static_cast<double>(end.QuadPart - start.QuadPart) * 1000000000.0 / frequency.QuadPart / count;
+	}
+
+	// Costs of the timer wheel with as many timers as connections, spread over 10 minutes like idle timeouts.
+	void BenchmarkTimers(int numTimers)
+	{
+		std::vector<TimerWheel::Timer> timers(numTimers);
+		TimerWheel wheel(100, 0);
+
+		LARGE_INTEGER frequency, start, end;
+		QueryPerformanceFrequency(&frequency);
+
+		QueryPerformanceCounter(&start);
+		for (int i = 0 ; i < numTimers ; ++i)
+		{
+			wheel.Arm(&timers[i], 1000 + (i * 7919) % 600000);
+		}
+		QueryPerformanceCounter(&end);
+		LOG(" arm : %.1f ns, armed : %d", ElapsedNs(start, end, frequency, numTimers), wheel.GetNumArmed());
+
+		// What every receive does with an idle timeout.
+		QueryPerformanceCounter(&start);
+		for (int i = 0 ; i < numTimers ; ++i)
+		{
+			wheel.Arm(&timers[i], 1000 + (i * 104729) % 600000);
+		}
+		QueryPerformanceCounter(&end);
+		LOG(" re-arm : %.1f ns", ElapsedNs(start, end, frequency, numTimers));
+
+		QueryPerformanceCounter(&start);
+		for (int i = 0 ; i < numTimers ; ++i)
+		{
+			wheel.Cancel(&timers[i]);
+		}
+		QueryPerformanceCounter(&end);
+		LOG(" cancel : %.1f ns", ElapsedNs(start, end, frequency, numTimers));
+
+		for (int i = 0 ; i < numTimers ; ++i)
+		{
+			wheel.Arm(&timers[i], 1000 + (i * 7919) % 600000);
+		}
+
+		// Tick by tick through all the expiries, as the I/O threads do.
+		TimerWheel::TimerList expired;
+		size_t numExpired = 0;
+		int numTicks = 0;
+		QueryPerformanceCounter(&start);
+		for (ULONGLONG now = 100 ; wheel.GetNumArmed() > 0 ; now += 100, ++numTicks)
+		{
+			expired.clear();
+			wheel.Advance(now, expired);
+			numExpired += expired.size();
+		}
+		QueryPerformanceCounter(&end);
+		LOG(" advance : %.1f ns per tick over %d ticks, %.1f ns per expired timer, expired : %d", 
+			ElapsedNs(start, end, frequency, numTicks), numTicks, ElapsedNs(start, end, frequency, static_cast<int>(numExpired)), numExpired);
+	}
+
+	// Pool benchmark. Each thread takes a few blocks of about the size of an IOEvent and gives them back, round after round,
+	// like the events of the I/O it has in flight.
+	enum
+	{
+		BENCH_BLOCK_SIZE = 64,
+		BENCH_HELD_BLOCKS = 8,
+		BENCH_MAX_THREADS = 32,
+	};
+
+	struct BenchBlock
+	{
+		BYTE data[BENCH_BLOCK_SIZE];
+	};
+
+	typedef boost::object_pool<BenchBlock> BenchObjectPool;
+
+	struct PoolBench
+	{
+		HANDLE start;
+		int numRounds;
+		FreeListPool* freeList;			// the lock-free pool, or
+		BenchObjectPool* objectPool;	// an object_pool behind a critical section, as IOEvent and Packet used to have.
+		CRITICAL_SECTION cs;
+		volatile LONGLONG numLockWaits;	// entries which found the critical section taken.
+	};
+
+	DWORD WINAPI PoolBenchThread(LPVOID param)
+	{
+		PoolBench* bench = static_cast<PoolBench*>(param);
+		WaitForSingleObject(bench->start, INFINITE);
+
+		void* held[BENCH_HELD_BLOCKS];
+		LONGLONG numLockWaits = 0;
+
+		for (int round = 0 ; round < bench->numRounds ; ++round)
+		{
+			for (int i = 0 ; i < BENCH_HELD_BLOCKS ; ++i)
+			{
+				if (bench->freeList != NULL)
+				{
+					held[i] = bench->freeList->Alloc();
+					continue;
+				}
+
+				if (!TryEnterCriticalSection(&bench->cs))
+				{
+					++numLockWaits;
+					EnterCriticalSection(&bench->cs);
+				}
+				held[i] = bench->objectPool->construct();
+				LeaveCriticalSection(&bench->cs);
+			}
+
+			for (int i = 0 ; i < BENCH_HELD_BLOCKS ; ++i)
+			{
+				if (bench->freeList != NULL)
+				{
+					bench->freeList->Free(held[i]);
+					continue;
+				}
+
+				if (!TryEnterCriticalSection(&bench->cs))
+				{
+					++numLockWaits;
+					EnterCriticalSection(&bench->cs);
+				}
+				bench->objectPool->destroy(static_cast<BenchBlock*>(held[i]));
+				LeaveCriticalSection(&bench->cs);
+			}
+		}
+
+		InterlockedExchangeAdd64(&bench->numLockWaits, numLockWaits);
+		return 0;
+	}
+
+	// Returns the ns all threads together took for each allocation or free.
+	double RunPoolBench(PoolBench& bench, int numThreads)
+	{
+		bench.start = CreateEvent(NULL, TRUE, FALSE, NULL);
+		bench.numLockWaits = 0;
+
+		HANDLE threads[BENCH_MAX_THREADS];
+		for (int i = 0 ; i < numThreads ; ++i)
+		{
+			threads[i] = CreateThread(NULL, 0, PoolBenchThread, &bench, 0, NULL);
+		}
+
+		LARGE_INTEGER frequency, start, end;
+		QueryPerformanceFrequency(&frequency);
+		QueryPerformanceCounter(&start);
+		SetEvent(bench.start);
+		WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+		QueryPerformanceCounter(&end);
+
+		for (int i = 0 ; i < numThreads ; ++i)
+		{
+			CloseHandle(threads[i]);
+		}
+		CloseHandle(bench.start);
+
+		return ElapsedNs(start, end, frequency, numThreads * bench.numRounds * BENCH_HELD_BLOCKS * 2);
+	}
+
+	// The same work on both pools from 1 to 32 threads. ns per operation is of the wall clock, so it falls as threads scale.
+	void BenchmarkPools(int numRounds)
+	{
+		for (int numThreads = 1 ; numThreads <= BENCH_MAX_THREADS ; numThreads *= 2)
+		{
+			int numOps = numThreads * numRounds * BENCH_HELD_BLOCKS * 2;
+
+			PoolBench locked;
+			locked.numRounds = numRounds;
+			locked.freeList = NULL;
+			BenchObjectPool objectPool;
+			locked.objectPool = &objectPool;
+			InitializeCriticalSection(&locked.cs);
+			double lockedNs = RunPoolBench(locked, numThreads);
+			DeleteCriticalSection(&locked.cs);
+
+			PoolBench lockFree;
+			lockFree.numRounds = numRounds;
+			FreeListPool freeList(BENCH_BLOCK_SIZE);
+			freeList.Init();
+			lockFree.freeList = &freeList;
+			lockFree.objectPool = NULL;
+			double lockFreeNs = RunPoolBench(lockFree, numThreads);
+			freeList.Shutdown();
+
+			// A depot transfer is the only shared write of the free list, so it stands for its contention.
+			FreeListPool::Stats stats;
+			freeList.GetStats(stats);
+
+			LOG(" threads %2d : locked %6.1f ns, %7.2f Mops/s, lock waits %5.2f%% | free list %6.1f ns, %7.2f Mops/s, depot transfers %5.2f%%", 
+				numThreads, 
+				lockedNs, 1000.0 / lockedNs, 100.0 * locked.numLockWaits / numOps, 
+				lockFreeNs, 1000.0 / lockFreeNs, 100.0 * (stats.numDepotPops + stats.numDepotPushes) / numOps);
+		}
+	}
+
+	// Round trips of echo requests sent one after another, for the latency percentiles of a target.
+	struct LatencyProbe
+	{
+		std::string target;
+		int remaining;
+		LARGE_INTEGER sent;
+		std::vector<double> samples;	// us.
+	};
+
+	LatencyProbe sLatencyProbe;
+
+	void OnLatencyEcho(rapidjson::Document* response, void* context);
+
+	bool SendLatencyProbe()
+	{
+		rapidjson::Document request;
+		request.Parse<0>("{\"type\":\"echo\",\"from\":\"latency\"}");
+
+		QueryPerformanceCounter(&sLatencyProbe.sent);
+		return UpstreamPool::Request(sLatencyProbe.target, request, OnLatencyEcho, &sLatencyProbe);
+	}
+
+	double Percentile(const std::vector<double>& sorted, double percentile)
+	{
+		size_t index = static_cast<size_t>(percentile / 100.0 * (sorted.size() - 1) + 0.5);
+		return sorted[index];
+	}
+
+	void LogLatency(const string& name, std::vector<double>& samples)
+	{
+		std::sort(samples.begin(), samples.end());
+		LOG(" Latency %s : samples : %d, p50 : %.1f us, p99 : %.1f us, p99.9 : %.1f us, max : %.1f us", name.c_str(), samples.size(),
+			Percentile(samples, 50.0), Percentile(samples, 99.0), Percentile(samples, 99.9), samples.back());
+	}
+
+	void OnLatencyEcho(rapidjson::Document* response, void* context)
+	{
+		LatencyProbe* probe = static_cast<LatencyProbe*>(context);
+
+		LARGE_INTEGER now, frequency;
+		QueryPerformanceCounter(&now);
+		QueryPerformanceFrequency(&frequency);
+
+		if (response != NULL)
+		{
+			probe->samples.push_back(static_cast<double>(now.QuadPart - probe->sent.QuadPart) * 1000000.0 / frequency.QuadPart);
+		}
+
+		if (--probe->remaining > 0 && SendLatencyProbe())
+		{
+			return;
+		}
+
+		if (probe->samples.empty())
+		{
+			LOG(" Latency %s : no response.", probe->target.c_str());
+			return;
+		}
+
+		LogLatency(probe->target, probe->samples);
+	}
+
+	// Blocking client of one of our own listeners, so that benchmarks go through the whole accept, receive and send pipeline.
+	// A wildcard listener is reached over loopback.
+	SOCKET ConnectTcp(const string& host, u_short port)
+	{
+		const char* node = host.c_str();
+		if (host.empty() || host == "0.0.0.0")
+		{
+			node = "127.0.0.1";
+		}
+		else if (host == "::")
+		{
+			node = "::1";
+		}
+
+		addrinfo hints;
+		ZeroMemory(&hints, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_protocol = IPPROTO_TCP;
+
+		char portBuff[8];
+		sprintf_s(portBuff, "%u", port);
+
+		addrinfo* infoList = NULL;
+		if (getaddrinfo(node, portBuff, &hints, &infoList) != 0)
+		{
+			ERROR_CODE(WSAGetLastError(), "getaddrinfo() failed. host : %s, port : %d", node, port);
+			return INVALID_SOCKET;
+		}
+
+		SOCKET socket = INVALID_SOCKET;
+		for (addrinfo* info = infoList ; info != NULL && socket == INVALID_SOCKET ; info = info->ai_next)
+		{
+			socket = ::socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+			if (socket != INVALID_SOCKET && connect(socket, info->ai_addr, static_cast<int>(info->ai_addrlen)) == SOCKET_ERROR)
+			{
+				ERROR_CODE(WSAGetLastError(), "connect() failed. host : %s, port : %d", node, port);
+				Network::CloseSocket(socket);
+				socket = INVALID_SOCKET;
+			}
+		}
+
+		freeaddrinfo(infoList);
+		return socket;
+	}
+
+	SOCKET ConnectUnix(const string& path)
+	{
+		SOCKADDR_UN address;
+		int addressLength = 0;
+		if (!Network::GetUnixAddress(path, address, addressLength))
+		{
+			return INVALID_SOCKET;
+		}
+
+		SOCKET socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+		if (socket == INVALID_SOCKET)
+		{
+			ERROR_CODE(WSAGetLastError(), "socket() failed. AF_UNIX path : %s", path.c_str());
+			return INVALID_SOCKET;
+		}
+
+		if (connect(socket, reinterpret_cast<const sockaddr*>(&address), addressLength) == SOCKET_ERROR)
+		{
+			ERROR_CODE(WSAGetLastError(), "connect() failed. AF_UNIX path : %s", path.c_str());
+			Network::CloseSocket(socket);
+			return INVALID_SOCKET;
+		}
+
+		return socket;
+	}
+
+	// Round trips of echo requests, one at a time, in us.
+	bool MeasureEcho(SOCKET socket, int numRequests, std::vector<double>& outSamples)
+	{
+		static const char kRequest[] = "{\"type\":\"echo\",\"from\":\"bench\"}";
+
+		// A dropped echo must not hang the console.
+		DWORD timeout = 1000;
+		setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+
+		LARGE_INTEGER frequency;
+		QueryPerformanceFrequency(&frequency);
+
+		char buffer[256];
+		for (int i = 0 ; i < numRequests ; ++i)
+		{
+			LARGE_INTEGER start, end;
+			QueryPerformanceCounter(&start);
+
+			// sizeof takes the '\0' which ends every message.
+			if (send(socket, kRequest, sizeof(kRequest), 0) != sizeof(kRequest))
+			{
+				ERROR_CODE(WSAGetLastError(), "send() failed.");
+				return false;
+			}
+
+			bool received = false;
+			while (!received)
+			{
+				int size = recv(socket, buffer, sizeof(buffer), 0);
+				if (size <= 0)
+				{
+					ERROR_CODE(WSAGetLastError(), "recv() failed. %d echoes received.", i);
+					return false;
+				}
+				received = buffer[size-1] == '\0';
+			}
+
+			QueryPerformanceCounter(&end);
+			outSamples.push_back(static_cast<double>(end.QuadPart - start.QuadPart) * 1000000.0 / frequency.QuadPart);
+		}
+
+		return true;
+	}
+
+	// The client socket is tuned by the same profile as the listener, as a client of that kind would be.
+	void BenchmarkTcpEcho(const string& host, u_short port, const Network::SocketProfile& profile, int numRequests)
+	{
+		SOCKET socket = ConnectTcp(host, port);
+		if (socket == INVALID_SOCKET)
+		{
+			return;
+		}
+
+		std::vector<double> samples;
+		if (Network::ApplySocketProfile(socket, profile, false) && MeasureEcho(socket, numRequests, samples))
+		{
+			std::stringstream name;
+			name << "tcp:[" << (host.empty() ? "*" : host) << "]:" << port << "/" << profile.name;
+			LogLatency(name.str(), samples);
+		}
+
+		Network::CloseSocket(socket);
+	}
+
+	// Run the server with a listener per profile to compare them. e.g. listen=127.0.0.1:17002/lowlatency listen=127.0.0.1:17003/bulk
+	void BenchmarkProfiles(u_short port, const Server::Config& config, int numRequests)
+	{
+		if (TlsSession::IsEnabled())
+		{
+			LOG(" The benchmark speaks plain text. Run it without tls_cert.");
+			return;
+		}
+
+		BenchmarkTcpEcho(config.dualStack ? "::" : "", port, *config.socketProfile, numRequests);
+		for (size_t i = 0 ; i < config.listenAddresses.size() ; ++i)
+		{
+			const Server::ListenAddress& address = config.listenAddresses[i];
+			const Network::SocketProfile* profile = address.socketProfile != NULL ? address.socketProfile : config.socketProfile;
+			BenchmarkTcpEcho(address.host, address.port, *profile, numRequests);
+		}
+	}
+
+	// The echo service over loopback TCP and over the AF_UNIX listener, one after the other, to see what skipping the TCP stack saves.
+	void BenchmarkUnix(u_short port, const Server::Config& config, int numRequests)
+	{
+		if (config.unixPath.empty() || TlsSession::IsEnabled())
+		{
+			LOG(" The benchmark needs unix=PATH and speaks plain text, so it runs without tls_cert.");
+			return;
+		}
+
+		BenchmarkTcpEcho(config.dualStack ? "::" : "", port, *config.socketProfile, numRequests);
+
+		SOCKET socket = ConnectUnix(config.unixPath);
+		if (socket == INVALID_SOCKET)
+		{
+			return;
+		}
+
+		std::vector<double> samples;
+		if (MeasureEcho(socket, numRequests, samples))
+		{
+			LogLatency("unix:" + config.unixPath, samples);
+		}
+
+		Network::CloseSocket(socket);
+	}
+
+	struct ChurnBench
+	{
+		string host;
+		u_short port;
+		int numConnections;		// per thread.
+		HANDLE start;
+		volatile long numFailures;
+	};
+
+	DWORD WINAPI ChurnBenchThread(LPVOID param)
+	{
+		ChurnBench* bench = static_cast<ChurnBench*>(param);
+		WaitForSingleObject(bench->start, INFINITE);
+
+		std::vector<double> samples;
+		for (int i = 0 ; i < bench->numConnections ; ++i)
+		{
+			SOCKET socket = ConnectTcp(bench->host, bench->port);
+			if (socket == INVALID_SOCKET)
+			{
+				InterlockedIncrement(&bench->numFailures);
+				continue;
+			}
+
+			// One echo makes sure the server has accepted the connection and served it, not just the kernel's backlog.
+			if (!MeasureEcho(socket, 1, samples))
+			{
+				InterlockedIncrement(&bench->numFailures);
+			}
+			samples.clear();
+
+			// Reset instead of a graceful close, so that TIME_WAIT does not use up the ephemeral ports.
+			linger reset = { 1, 0 };
+			setsockopt(socket, SOL_SOCKET, SO_LINGER, reinterpret_cast<const char*>(&reset), sizeof(reset));
+			Network::CloseSocket(socket);
+		}
+
+		return 0;
+	}
+
+	// Connections which connect, exchange one echo and disconnect, from 1 to 16 threads.
+	// Client objects should stay flat while the warm pool keeps up, as each disconnect recycles one for the next accept.
+	void BenchmarkChurn(u_short port, const Server::Config& config, int numConnections)
+	{
+		if (TlsSession::IsEnabled())
+		{
+			LOG(" The benchmark speaks plain text. Run it without tls_cert.");
+			return;
+		}
+
+		for (int numThreads = 1 ; numThreads <= 16 ; numThreads *= 4)
+		{
+			ChurnBench bench;
+			bench.host = config.dualStack ? "::" : "";
+			bench.port = port;
+			bench.numConnections = numConnections / numThreads;
+			bench.start = CreateEvent(NULL, TRUE, FALSE, NULL);
+			bench.numFailures = 0;
+
+			long numClients = Client::GetNumClients();
+
+			HANDLE threads[16];
+			for (int i = 0 ; i < numThreads ; ++i)
+			{
+				threads[i] = CreateThread(NULL, 0, ChurnBenchThread, &bench, 0, NULL);
+			}
+
+			LARGE_INTEGER frequency, start, end;
+			QueryPerformanceFrequency(&frequency);
+			QueryPerformanceCounter(&start);
+			SetEvent(bench.start);
+			WaitForMultipleObjects(numThreads, threads, TRUE, INFINITE);
+			QueryPerformanceCounter(&end);
+
+			for (int i = 0 ; i < numThreads ; ++i)
+			{
+				CloseHandle(threads[i]);
+			}
+			CloseHandle(bench.start);
+
+			double seconds = static_cast<double>(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+			LOG(" threads %2d : %8.0f connections/s, failures : %ld, client objects : %ld -> %ld, ready with a socket : %ld", 
+				numThreads, bench.numConnections * numThreads / seconds, bench.numFailures, 
+				numClients, Client::GetNumClients(), Client::GetNumFree());
+		}
+	}
+
+	// name@host:port. An IPv6 host is in brackets. e.g. db@[::1]:17002
+	bool AddUpstream(const string& spec)
+	{
+		size_t at = spec.find('@');
+		size_t colon = spec.rfind(':');
+		if (at == string::npos || colon == string::npos || colon < at)
+		{
+			return false;
+		}
+
+		string name = spec.substr(0, at);
+		string host = spec.substr(at+1, colon-at-1);
+		u_short port = static_cast<u_short>(atoi(spec.substr(colon+1).c_str()));
+		if (host.size() >= 2 && host[0] == '[' && host[host.size()-1] == ']')
+		{
+			host = host.substr(1, host.size()-2);
+		}
+
+		return UpstreamPool::AddTarget(name, host, port);
+	}
+
+	void OnUpstreamEcho(rapidjson::Document* response, void* context)
+	{
+		const char* name = static_cast<const char*>(context);
+		if (response == NULL)
+		{
+			LOG(" Upstream %s : request failed.", name);
+		}
+		else
+		{
+			LOG(" Upstream %s : response received.", name);
+		}
+	}
+}
 
 void main(int argc, char* argv[])
 {
 	Log::Init();
 
-	if( argc != 3)
+	if( argc < 3)
 	{
-		LOG("Please add port and max number of accept posts.");
+		LOG("Please add port and max number of accept posts, and optionally name=value options.");
 		LOG("(ex) 17000 100");
+		LOG("(ex) 17000 100 backend=iothreads io_threads=4 shards=4 batch=64");
+		LOG("options");
+		LOG("  backend=threadpool|iothreads : completion dispatch by the thread pool(default) or by our own I/O threads.");
+		LOG("  io_threads=N : number of I/O threads for backend=iothreads. 0 means the number of processors.");
+		LOG("  shards=N : number of I/O shards for backend=iothreads. each shard is pinned to its own core.");
+		LOG("  batch=N : max completions dequeued at once by an I/O thread.");
+		LOG("  busy_poll=US : I/O threads keep polling for US after the last completion instead of sleeping. needs backend=iothreads.");
+		LOG("  cores=N,N,... : pin the I/O threads to these processors, one each in turn. best kept free of anything else.");
+		LOG("  shared_nothing=1 : a shard per I/O thread, serving its own clients and games with no locks. needs backend=iothreads.");
+		LOG("  numa=1 : spread the shards over the NUMA nodes, with node-local pools. needs backend=iothreads and no cores. see `numa_stats.");
+		LOG("  accept=plain|data : accept completes on connection(default) or with the first data from the client.");
+		LOG("  zerocopy=N : packets of at least N bytes are sent without the socket send buffer. 0(default) disables it.");
+		LOG("  send_high=N send_low=N : per client outbound bytes at which sending gets blocked and unblocked.");
+		LOG("  send_stall=MS : disconnect a client blocked on sending for longer than MS.");
+		LOG("  recv_limit=N : pause receiving from a client while N bytes or more are waiting to be parsed.");
+		LOG("  recv=client|shared : a receive buffer per client(default) or buffers shared while reading.");
+		LOG("  profile=NAME : socket tuning profile. default, lowlatency or bulk.");
+		LOG("  warm_clients=N : clients kept ready with their sockets. 0(default) means twice the max accept posts.");
+		LOG("  udp_port=N : datagram sockets on ports from N, one per shard. IPv6 and IPv4 with dualstack=1. 0(default) disables datagrams.");
+		LOG("  udp_depth=N : receives kept posted on each datagram socket.");
+		LOG("  tls_cert=SUBJECT : TLS on the listener with the certificate of the subject in the local machine's MY store.");
+		LOG("  dualstack=1 : listen on the port with IPv6 and IPv4 on one socket.");
+		LOG("  listen=HOST:PORT[/SHARDS][/PROFILE] : also listen on the address, with shards of its own if SHARDS is given and its own socket profile if PROFILE is given. can be repeated.");
+		LOG("  idle_timeout=MS : disconnect a client which sends nothing for MS. 0(default) disables it.");
+		LOG("  first_timeout=MS : disconnect a client which has not sent a complete message MS after connecting.");
+		LOG("  message_timeout=MS : disconnect a client which takes longer than MS to send a message once it has started it.");
+		LOG("  unix=PATH : also listen on an AF_UNIX socket for local clients. @NAME for the abstract namespace.");
+		LOG("  takeover=1 : take the listeners over from the server running on the port, which then drains. see `handoff.");
+		LOG("  drain_timeout=MS : how long `handoff waits for clients to leave. 0(default) waits for all of them.");
+		LOG("  upstream=NAME@HOST:PORT : keep connections to a backend service over IPv4 or IPv6, [HOST] for an IPv6 address. can be repeated.");
 		return;
 	}
 
 	u_short port = static_cast<u_short>( atoi(argv[1]) );
 	int maxPostAccept = atoi(argv[2]);
 
-	LOG("Input : port : %d, max accept : %d", port, maxPostAccept);
+	Server::Config config;
+	vector<string> upstreams;
+	for (int i = 3 ; i < argc ; ++i)
+	{
+		// Upstreams are added once the server is up.
+		if (string(argv[i]).compare(0, 9, "upstream=") == 0)
+		{
+			upstreams.push_back(string(argv[i]).substr(9));
+		}
+		else if (!ParseOption(argv[i], config))
+		{
+			ERROR_MSG("Invalid option : %s", argv[i]);
+			return;
+		}
+	}
+
+	LOG("Input : port : %d, max accept : %d, backend : %d, I/O threads : %d, shards : %d, batch : %d, profile : %s", 
+		port, maxPostAccept, config.backend, config.numIOThreads, config.numShards, config.completionBatchSize, config.socketProfile->name);
 
 	if(Network::Init() == false)
 	{
@@ -31,12 +902,20 @@ void main(int argc, char* argv[])
 
 	Server::Create();
 	
-	if(Server::Instance()->Init(port, maxPostAccept) == false)
+	if(Server::Instance()->Init(port, maxPostAccept, config) == false)
 	{
 		ERROR_MSG("Server::Init() failed");
 		return;
 	}
 
+	for (size_t i = 0 ; i < upstreams.size() ; ++i)
+	{
+		if (!AddUpstream(upstreams[i]))
+		{
+			ERROR_MSG("Invalid upstream : %s", upstreams[i].c_str());
+		}
+	}
+
 #ifndef _DEBUG
 	Log::EnableTrace(false);
 #endif
@@ -54,6 +933,146 @@ void main(int argc, char* argv[])
 		else if (input == "`accept_size")
 		{
 			LOG(" Number of Accept posts : %d", Server::Instance()->GetNumPostAccepts());
+			LOG(" Number of Accepts : %lld", Server::Instance()->GetNumAccepts());
+		}
+		else if (input == "`io_stats")
+		{
+			Server::IOStats stats;
+			Server::Instance()->GetIOStats(stats);
+
+			LOG(" I/O calls : %lld, completions : %lld, dequeue calls : %lld", stats.numIOCalls, stats.numCompletions, stats.numDequeueCalls);
+			if (stats.numCompletions > 0)
+			{
+				// Each completion is one message moved, so this is roughly the number of system calls per message.
+				LOG(" system calls per completion : %.3f", 
+					static_cast<double>(stats.numIOCalls + stats.numDequeueCalls) / stats.numCompletions);
+			}
+			if (stats.numSendCalls > 0)
+			{
+				LOG(" send calls : %lld, packets per send call : %.3f", 
+					stats.numSendCalls, static_cast<double>(stats.numSentPackets) / stats.numSendCalls);
+				LOG(" zero-copy send calls : %lld, bytes : %lld", stats.numZeroCopySends, stats.numZeroCopyBytes);
+			}
+			LOG(" datagrams received : %lld, sent : %lld, dropped : %lld", stats.numDatagramsReceived, stats.numDatagramsSent, stats.numDatagramsDropped);
+			LOG(" timeouts : %lld", stats.numTimeouts);
+			LOG(" messages to send-blocked clients : sent : %lld, dropped : %lld", stats.numBlockedSends, stats.numBlockedDrops);
+		}
+		else if (input == "`shard_stats")
+		{
+			for (size_t i = 0 ; i < Server::Instance()->GetNumShards() ; ++i)
+			{
+				Server::ShardStats stats;
+				Server::Instance()->GetShardStats(i, stats);
+				LOG(" Shard %d : node : %d, clients : %d, completions : %lld, messages : %lld", i, stats.node, stats.numClients, stats.numCompletions, stats.numMessages);
+			}
+		}
+		else if (input == "`numa_stats")
+		{
+			// A remote free is an event or a packet released on another node than the one it was taken on.
+			for (int i = 0 ; i < Numa::GetNumNodes() ; ++i)
+			{
+				Numa::NodeStats stats;
+				Numa::GetNodeStats(i, stats);
+
+				long long numFrees = stats.numLocalFrees + stats.numRemoteFrees;
+				long long numConnections = stats.numLocalConnections + stats.numRemoteConnections;
+				LOG(" Node %d : processors : %d, remote frees : %lld / %lld (%.2f%%), remote connections : %lld / %lld (%.2f%%)", 
+					i, stats.numProcessors, 
+					stats.numRemoteFrees, numFrees, numFrees > 0 ? 100.0 * stats.numRemoteFrees / numFrees : 0.0, 
+					stats.numRemoteConnections, numConnections, numConnections > 0 ? 100.0 * stats.numRemoteConnections / numConnections : 0.0);
+			}
+		}
+		else if (input == "`recv_buffers")
+		{
+			LOG(" Receive buffers : %d, in use : %d", RecvBufferPool::GetNumBuffers(), RecvBufferPool::GetNumInUse());
+		}
+		else if (input == "`packet_stats")
+		{
+			// Slabs are never given back, so this is the high water mark of the packets in flight of each pooled size.
+			// The larger sizes are not pooled and show the blocks in use now.
+			long long numSlabBytes = 0;
+			long long numDirectBytes = 0;
+			for (int i = 0 ; i < Packet::NUM_SIZE_CLASSES ; ++i)
+			{
+				Packet::ClassStats stats;
+				Packet::GetClassStats(i, stats);
+				if (stats.numSlabs > 0)
+				{
+					LOG(" %8u bytes : slabs : %lld, %.2f MB", stats.blockSize, stats.numSlabs, stats.numSlabBytes / (1024.0 * 1024.0));
+				}
+				if (stats.numDirectBlocks > 0)
+				{
+					LOG(" %8u bytes : in use : %ld, %.2f MB", stats.blockSize, stats.numDirectBlocks, stats.numDirectBytes / (1024.0 * 1024.0));
+				}
+				numSlabBytes += stats.numSlabBytes;
+				numDirectBytes += stats.numDirectBytes;
+			}
+			LOG(" Total : %.2f MB, unpooled : %.2f MB, max packet : %u bytes", numSlabBytes / (1024.0 * 1024.0), numDirectBytes / (1024.0 * 1024.0), Packet::GetMaxSize());
+		}
+		else if (input == "`client_pool")
+		{
+			LOG(" Client objects : %d, ready with a socket : %d", Client::GetNumClients(), Client::GetNumFree());
+		}
+		else if (input == "`upstream_stats")
+		{
+			for (size_t i = 0 ; i < UpstreamPool::GetNumTargets() ; ++i)
+			{
+				UpstreamPool::Stats stats;
+				UpstreamPool::GetStats(i, stats);
+				LOG(" Upstream %s : connected : %d, requests : %lld, responses : %lld, failures : %lld, connects : %lld", 
+					UpstreamPool::GetTargetName(i).c_str(), stats.numConnected, stats.numRequests, stats.numResponses, stats.numFailures, stats.numConnects);
+			}
+		}
+		else if (input == "`upstream_echo")
+		{
+			for (size_t i = 0 ; i < UpstreamPool::GetNumTargets() ; ++i)
+			{
+				rapidjson::Document request;
+				request.Parse<0>("{\"type\":\"echo\",\"from\":\"upstream_echo\"}");
+
+				// Target names live as long as the pool.
+				const std::string& name = UpstreamPool::GetTargetName(i);
+				UpstreamPool::Request(name, request, OnUpstreamEcho, const_cast<char*>(name.c_str()));
+			}
+		}
+		else if (input == "`upstream_latency")
+		{
+			// Run the target with busy_poll on and off to compare. Callbacks run in the service thread.
+			if (UpstreamPool::GetNumTargets() > 0 && sLatencyProbe.remaining <= 0)
+			{
+				sLatencyProbe.target = UpstreamPool::GetTargetName(0);
+				sLatencyProbe.remaining = 10000;
+				sLatencyProbe.samples.clear();
+				SendLatencyProbe();
+			}
+		}
+		else if (input == "`tls_stats")
+		{
+			LOG(" TLS enabled : %d, handshakes : %lld", TlsSession::IsEnabled(), TlsSession::GetNumHandshakes());
+		}
+		else if (input == "`timer_bench")
+		{
+			BenchmarkTimers(1000000);
+		}
+		else if (input == "`pool_bench")
+		{
+			BenchmarkPools(100000);
+		}
+		else if (input == "`unix_bench")
+		{
+			BenchmarkUnix(port, config, 10000);
+		}
+		else if (input == "`churn_bench")
+		{
+			BenchmarkChurn(port, config, 10000);
+		}
+		else if (input == "`profile_bench")
+		{
+			BenchmarkProfiles(port, config, 10000);
+		}
+		else if (input == "`profiles")
+		{
+			Network::PrintSocketProfiles();
 		}
 		else if (input == "`enable_trace")
 		{
@@ -63,6 +1082,19 @@ void main(int argc, char* argv[])
 		{
 			Log::EnableTrace(false);
 		}
+		else if (input == "`handoff")
+		{
+			// Start the new server with takeover=1 first. It waits for this.
+			if (Server::Instance()->HandOff())
+			{
+				Drain(config.drainTimeout);
+				loop = false;
+			}
+			else
+			{
+				LOG(" Handoff failed. Still accepting.");
+			}
+		}
 		else if  (input == "`shutdown")
 		{
 			loop = false;
@@ -71,9 +1103,26 @@ void main(int argc, char* argv[])
 		{
 			cout << "WRONG COMMAND." << endl;
 			cout << "`client_size : return the number of clients connected." << endl;
-			cout << "`accept_size : return the number of accept calls posted." << endl;
+			cout << "`accept_size : return the number of accept calls posted and accepted." << endl;
+			cout << "`io_stats : return I/O calls, completions and dequeue calls." << endl;
+			cout << "`shard_stats : return the number of clients, completions and shard messages of each shard." << endl;
+			cout << "`numa_stats : return the remote frees and connections of each NUMA node." << endl;
+			cout << "`recv_buffers : return the number of receive buffers in the pool and in use." << endl;
+			cout << "`packet_stats : return the slab memory of each pooled packet size class and the larger blocks in use." << endl;
+			cout << "`client_pool : return the number of client objects and those ready to accept." << endl;
+			cout << "`upstream_stats : return connections and requests of each upstream." << endl;
+			cout << "`upstream_echo : send an echo request to each upstream." << endl;
+			cout << "`upstream_latency : return p50/p99/p99.9 round trips of 10000 echo requests to the first upstream." << endl;
+			cout << "`tls_stats : return the number of TLS handshakes completed." << endl;
+			cout << "`timer_bench : measure arming, cancelling and expiring 1M timers on a timer wheel." << endl;
+			cout << "`pool_bench : compare the lock-free pools with a locked object_pool from 1 to 32 threads." << endl;
+			cout << "`unix_bench : return p50/p99/p99.9 round trips of 10000 echo requests over loopback TCP and over the unix= listener." << endl;
+			cout << "`churn_bench : return connections per second of 10000 connect, echo and disconnect cycles from 1 to 16 threads." << endl;
+			cout << "`profile_bench : return p50/p99/p99.9 round trips of 10000 echo requests over loopback to each TCP listener with its socket profile." << endl;
+			cout << "`profiles : return the socket profiles which can be selected with profile=name or per listener with listen=." << endl;
 			cout << "`enable_trace : enable trace." << endl;
 			cout << "`disable_trace : disable trace." << endl;
+			cout << "`handoff : hand the listeners over to a new server started with takeover=1, drain the clients and shut down." << endl;
 			cout << "`shutdown : shut it down." << endl;
 
 			cout << endl;